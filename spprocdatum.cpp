@@ -9,19 +9,42 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include <stdint.h>
+#include <sys/socket.h>
 #include <sys/poll.h>
-#include <sys/time.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include "spprocdatum.hpp"
 
 #include "spprocmanager.hpp"
 #include "spprocpool.hpp"
 #include "spprocpdu.hpp"
+#include "spprocring.hpp"
 
 SP_ProcDatumHandler :: ~SP_ProcDatumHandler()
 {
 }
 
+void SP_ProcDatumHandler :: onReply( pid_t pid, const SP_ProcDataBlock * reply )
+{
+}
+
+void SP_ProcDatumHandler :: onError( pid_t pid )
+{
+}
+
+void SP_ProcDatumHandler :: onReplyEx( pid_t pid, unsigned int id, const SP_ProcDataBlock * reply )
+{
+	onReply( pid, reply );
+}
+
+void SP_ProcDatumHandler :: onErrorEx( pid_t pid, unsigned int id )
+{
+	onError( pid );
+}
+
 //-------------------------------------------------------------------
 
 SP_ProcDatumService :: ~SP_ProcDatumService()
@@ -49,52 +72,186 @@ public:
 	SP_ProcWorkerDatumAdapter( SP_ProcDatumServiceFactory * factory );
 	virtual ~SP_ProcWorkerDatumAdapter();
 
+	void setZygote( int isZygote );
+
 	virtual void process( SP_ProcInfo * procInfo );
 
 private:
 	SP_ProcDatumServiceFactory * mFactory;
+	int mIsZygote;
+
+	enum { MAX_BATCH = 16 };
+
+	// the socket replies are queued while more requests are buffered
+	SP_ProcPdu_t mReplyPdus[ MAX_BATCH ];
+	SP_ProcDataBlock mReplies[ MAX_BATCH ];
+	int mReplyCount;
+
+	// read a request from the ring or the socket
+	int readRequest( SP_ProcInfo * procInfo, SP_ProcPduReader * reader,
+			SP_ProcPdu_t * pdu, SP_ProcDataBlock * request );
+
+	// 0 : OK, -1 : Fail
+	int flushReplies( SP_ProcInfo * procInfo );
 };
 
 SP_ProcWorkerDatumAdapter :: SP_ProcWorkerDatumAdapter( SP_ProcDatumServiceFactory * factory )
 {
 	mFactory = factory;
+	mIsZygote = 0;
+	mReplyCount = 0;
 }
 
 SP_ProcWorkerDatumAdapter :: ~SP_ProcWorkerDatumAdapter()
 {
 }
 
+void SP_ProcWorkerDatumAdapter :: setZygote( int isZygote )
+{
+	mIsZygote = isZygote;
+}
+
+int SP_ProcWorkerDatumAdapter :: flushReplies( SP_ProcInfo * procInfo )
+{
+	if( mReplyCount <= 0 ) return 0;
+
+	const void * datas[ MAX_BATCH ];
+	for( int i = 0; i < mReplyCount; i++ ) datas[i] = mReplies[i].getData();
+
+	int ret = SP_ProcPduUtils::send_pdus( procInfo->getPipeFd(), mReplyPdus, datas, mReplyCount );
+
+	for( int i = 0; i < mReplyCount; i++ ) mReplies[i].reset();
+	mReplyCount = 0;
+
+	return ret < 0 ? -1 : 0;
+}
+
+int SP_ProcWorkerDatumAdapter :: readRequest( SP_ProcInfo * procInfo, SP_ProcPduReader * reader,
+		SP_ProcPdu_t * pdu, SP_ProcDataBlock * request )
+{
+	SP_ProcRingChannel * channel = procInfo->getChannel();
+
+	if( NULL == channel || reader->hasPdu() ) return reader->read_pdu( pdu, request );
+
+	struct pollfd pfd[ 2 ];
+	memset( pfd, 0, sizeof( pfd ) );
+	pfd[0].fd = channel->getEventFd( SP_ProcRingChannel::eRequest );
+	pfd[0].events = POLLIN;
+	pfd[1].fd = procInfo->getPipeFd();
+	pfd[1].events = POLLIN;
+
+	struct timespec start;
+	clock_gettime( CLOCK_MONOTONIC, &start );
+
+	for( ; ; ) {
+		if( channel->recv( SP_ProcRingChannel::eRequest, &( pdu->mSeqNo ), request ) > 0 ) {
+			pdu->mMagicNum = SP_ProcPdu_t::MAGIC_NUM;
+			pdu->mType = SP_ProcPdu_t::eData;
+			pdu->mDataSize = request->getDataSize();
+			return sizeof( SP_ProcPdu_t ) + pdu->mDataSize;
+		}
+
+		if( channel->getSpinUsec() > 0 ) {
+			struct timespec now;
+			clock_gettime( CLOCK_MONOTONIC, &now );
+
+			if( ( now.tv_sec - start.tv_sec ) * 1000000L
+					+ ( now.tv_nsec - start.tv_nsec ) / 1000 < channel->getSpinUsec() ) continue;
+		}
+
+		// the socket carries the messages which do not fit in the ring
+		if( 0 == channel->sleep( SP_ProcRingChannel::eRequest ) ) continue;
+
+		int ret = poll( pfd, 2, -1 );
+
+		channel->awake( SP_ProcRingChannel::eRequest );
+
+		if( ret > 0 && pfd[1].revents ) return reader->read_pdu( pdu, request );
+
+		if( ret > 0 && pfd[0].revents ) channel->clearEvent( SP_ProcRingChannel::eRequest );
+
+		if( ret < 0 && EINTR != errno ) return -1;
+
+		clock_gettime( CLOCK_MONOTONIC, &start );
+	}
+}
+
 void SP_ProcWorkerDatumAdapter :: process( SP_ProcInfo * procInfo )
 {
-	mFactory->workerInit( procInfo );
+	if( ! mIsZygote ) mFactory->workerInit( procInfo );
+
+	SP_ProcPduReader reader( procInfo->getPipeFd() );
 
 	for( ; ; ) {
+		// send the queued replies before waiting for more requests
+		if( ( ! reader.hasPdu() || MAX_BATCH == mReplyCount )
+				&& 0 != flushReplies( procInfo ) ) break;
+
 		SP_ProcDataBlock request;
 		SP_ProcPdu_t pdu;
 		memset( &pdu, 0, sizeof( pdu ) );
 
-		if( SP_ProcPduUtils::read_pdu( procInfo->getPipeFd(), &pdu, &request ) > 0 ) {
-			SP_ProcDataBlock reply;
+		if( readRequest( procInfo, &reader, &pdu, &request ) <= 0 ) break;
 
-			SP_ProcDatumService * service = mFactory->create();
-			service->handle( &request, &reply );
-			delete service;
-
-			SP_ProcPdu_t replyPdu;
-			memset( &replyPdu, 0, sizeof( SP_ProcPdu_t ) );
-			replyPdu.mMagicNum = SP_ProcPdu_t::MAGIC_NUM;
-			replyPdu.mSrcPid = getpid();
-			replyPdu.mDestPid = pdu.mSrcPid;
-			replyPdu.mDataSize = reply.getDataSize();
+		if( SP_ProcPdu_t::eAttachRing == pdu.mType ) {
+			int fds[ SP_ProcRingChannel::FD_COUNT ];
+			if( SP_ProcRingChannel::FD_COUNT != reader.recv_fds(
+					fds, SP_ProcRingChannel::FD_COUNT ) ) {
+				syslog( LOG_WARNING, "WARN: recv ring fds fail, errno %d, %s",
+						errno, strerror( errno ) );
+				break;
+			}
 
-			if( SP_ProcPduUtils::send_pdu( procInfo->getPipeFd(), &replyPdu, reply.getData() ) < 0 ) {
+			SP_ProcRingChannel * channel = new SP_ProcRingChannel();
+			if( 0 != channel->attach( fds ) ) {
+				delete channel;
 				break;
 			}
-		} else {
-			break;
+
+			delete procInfo->getChannel();
+			procInfo->setChannel( channel );
+
+			continue;
 		}
+
+		SP_ProcDataBlock * reply = &( mReplies[ mReplyCount ] );
+
+		SP_ProcDatumService * service = mFactory->create();
+		service->handle( &request, reply );
+		delete service;
+
+		SP_ProcRingChannel * channel = procInfo->getChannel();
+		if( NULL != channel && 0 == channel->send( SP_ProcRingChannel::eReply,
+				pdu.mSeqNo, reply->getData(), reply->getDataSize() ) ) {
+			reply->reset();
+			continue;
+		}
+
+		SP_ProcPdu_t * replyPdu = &( mReplyPdus[ mReplyCount ] );
+		memset( replyPdu, 0, sizeof( SP_ProcPdu_t ) );
+		replyPdu->mMagicNum = SP_ProcPdu_t::MAGIC_NUM;
+		replyPdu->mSrcPid = getpid();
+		replyPdu->mDestPid = pdu.mSrcPid;
+		replyPdu->mSeqNo = pdu.mSeqNo;
+		replyPdu->mDataSize = reply->getDataSize();
+
+		if( reply->getFd() < 0 ) {
+			mReplyCount++;
+			continue;
+		}
+
+		// a shared block is passed by its memfd, keep the order of the replies
+		int ret = flushReplies( procInfo );
+		if( 0 == ret ) {
+			ret = SP_ProcPduUtils::send_block( procInfo->getPipeFd(), replyPdu, reply );
+		}
+		reply->reset();
+
+		if( ret < 0 ) break;
 	}
 
+	flushReplies( procInfo );
+
 	mFactory->workerEnd( procInfo );
 }
 
@@ -107,14 +264,18 @@ public:
 
 	virtual SP_ProcWorker * create() const;
 
+	virtual void zygoteInit();
+
 private:
 	SP_ProcDatumServiceFactory * mFactory;
+	int mIsZygote;
 };
 
 SP_ProcWorkerFactoryDatumAdapter :: SP_ProcWorkerFactoryDatumAdapter(
 		SP_ProcDatumServiceFactory * factory )
 {
 	mFactory = factory;
+	mIsZygote = 0;
 }
 
 SP_ProcWorkerFactoryDatumAdapter :: ~SP_ProcWorkerFactoryDatumAdapter()
@@ -125,105 +286,377 @@ SP_ProcWorkerFactoryDatumAdapter :: ~SP_ProcWorkerFactoryDatumAdapter()
 
 SP_ProcWorker * SP_ProcWorkerFactoryDatumAdapter :: create() const
 {
-	return new SP_ProcWorkerDatumAdapter( mFactory );
+	SP_ProcWorkerDatumAdapter * worker = new SP_ProcWorkerDatumAdapter( mFactory );
+	worker->setZygote( mIsZygote );
+
+	return worker;
+}
+
+void SP_ProcWorkerFactoryDatumAdapter :: zygoteInit()
+{
+	SP_ProcInfo procInfo( -1 );
+	procInfo.setPid( getpid() );
+
+	mFactory->workerInit( &procInfo );
+
+	mIsZygote = 1;
 }
 
 //-------------------------------------------------------------------
 
+// The busy workers of the dispatcher. A worker may have up to queue.depth
+// requests outstanding, the seq.no of them are registered before sending.
+// A worker is held by the sender from takeOpen/append until done/cancel.
 class SP_ProcInfoListEx {
 public:
 	SP_ProcInfoListEx();
 	~SP_ProcInfoListEx();
 
-	void append( SP_ProcInfo * info );
-	SP_ProcInfo * takeByPipeFd( int pipeFd );
+	// the depth can only grow, the requests in flight keep their slots,
+	// 0 : OK, -1 : smaller than the current one, ignored
+	int setQueueDepth( int queueDepth );
+
+	int getQueueDepth() const;
+
+	// take a busy worker which can accept one more request
+	SP_ProcInfo * takeOpen();
+
+	// register a request before sending it
+	// > 0 : pending count, -1 : the worker is broken, the caller owns it
+	int append( SP_ProcInfo * info, unsigned int seqNo );
 
-	int conv2pollfd( struct pollfd pfd[], int nfds );
+	// the request has been sent, isOpen : can the worker accept more requests
+	// > 0 : pending count, 0 : no pending request, -1 : the worker is broken
+	// the caller owns the worker when <= 0
+	int done( SP_ProcInfo * info, int isOpen );
+
+	// fail to send the request
+	// 1 : no pending request or broken, the caller owns it, 0 : still busy
+	int cancel( SP_ProcInfo * info, unsigned int seqNo );
+
+	// a reply arrived, isDone : no more pending request, the caller owns it
+	// NULL : not exists
+	SP_ProcInfo * complete( int pipeFd, unsigned int seqNo, int * isDone );
+
+	// pop a reply from the ring of a busy worker
+	// 1 : OK, 0 : empty or not exists
+	int recvRing( int pipeFd, unsigned int * seqNo, SP_ProcDataBlock * reply );
+
+	// the worker is broken, the seq.no of the lost requests are returned
+	// isDone : the caller owns it, else the sender will find it broken
+	// NULL : not exists
+	SP_ProcInfo * takeByPipeFd( int pipeFd, unsigned int seqNos[], int * count, int * isDone );
 
 	int getCount() const;
 
 private:
+	typedef struct tagEntry {
+		int mCount;
+		char mIsHeld;
+		char mIsOpen;
+		char mIsBroken;
+		unsigned int * mSeqNos;
+	} Entry_t;
+
 	pthread_mutex_t mMutex;
-	pthread_cond_t mCond;
-	pthread_cond_t mEmptyCond;
+
+	int mQueueDepth;
 
 	SP_ProcInfoList * mList;
+	SP_ProcInfoList * mOpenList;
+
+	Entry_t * mEntries;
+	int mEntryCount;
+
+	Entry_t * getEntry( int pipeFd );
+	void remove( SP_ProcInfo * info );
 };
 
 SP_ProcInfoListEx :: SP_ProcInfoListEx()
 {
 	pthread_mutex_init( &mMutex, NULL );
-	pthread_cond_init( &mCond, NULL );
-	pthread_cond_init( &mEmptyCond, NULL );
+
+	mQueueDepth = 1;
 
 	mList = new SP_ProcInfoList();
+	mOpenList = new SP_ProcInfoList();
+
+	mEntries = NULL;
+	mEntryCount = 0;
 }
 
 SP_ProcInfoListEx :: ~SP_ProcInfoListEx()
 {
 	pthread_mutex_destroy( &mMutex );
-	pthread_cond_destroy( &mCond );
-	pthread_cond_destroy( &mEmptyCond );
+
+	// the items are owned by mList
+	for( ; mOpenList->getCount() > 0; ) mOpenList->takeItem( mOpenList->getCount() - 1 );
+
+	delete mOpenList;
+	mOpenList = NULL;
 
 	delete mList;
 	mList = NULL;
+
+	for( int i = 0; i < mEntryCount; i++ ) free( mEntries[i].mSeqNos );
+	free( mEntries );
+	mEntries = NULL;
+}
+
+int SP_ProcInfoListEx :: setQueueDepth( int queueDepth )
+{
+	int ret = 0;
+
+	pthread_mutex_lock( &mMutex );
+
+	if( queueDepth < mQueueDepth ) {
+		ret = -1;
+	} else if( queueDepth > mQueueDepth ) {
+		for( int i = 0; i < mEntryCount; i++ ) {
+			Entry_t * entry = &( mEntries[i] );
+			if( NULL == entry->mSeqNos ) continue;
+
+			entry->mSeqNos = (unsigned int*)realloc( entry->mSeqNos,
+					sizeof( unsigned int ) * queueDepth );
+			assert( NULL != entry->mSeqNos );
+		}
+
+		mQueueDepth = queueDepth;
+	}
+
+	pthread_mutex_unlock( &mMutex );
+
+	return ret;
+}
+
+int SP_ProcInfoListEx :: getQueueDepth() const
+{
+	return mQueueDepth;
+}
+
+SP_ProcInfoListEx::Entry_t * SP_ProcInfoListEx :: getEntry( int pipeFd )
+{
+	if( pipeFd >= mEntryCount ) {
+		int count = mEntryCount > 0 ? mEntryCount : 64;
+		for( ; pipeFd >= count; ) count = count * 2;
+
+		mEntries = (Entry_t*)realloc( mEntries, sizeof( Entry_t ) * count );
+		assert( NULL != mEntries );
+		memset( mEntries + mEntryCount, 0, sizeof( Entry_t ) * ( count - mEntryCount ) );
+		mEntryCount = count;
+	}
+
+	Entry_t * entry = &( mEntries[ pipeFd ] );
+
+	if( NULL == entry->mSeqNos ) {
+		entry->mSeqNos = (unsigned int*)malloc( sizeof( unsigned int ) * mQueueDepth );
+		assert( NULL != entry->mSeqNos );
+	}
+
+	return entry;
+}
+
+void SP_ProcInfoListEx :: remove( SP_ProcInfo * info )
+{
+	mOpenList->takeItem( mOpenList->findByPipeFd( info->getPipeFd() ) );
+	mList->takeItem( mList->findByPipeFd( info->getPipeFd() ) );
+
+	Entry_t * entry = getEntry( info->getPipeFd() );
+	entry->mCount = 0;
+	entry->mIsHeld = entry->mIsOpen = entry->mIsBroken = 0;
+}
+
+SP_ProcInfo * SP_ProcInfoListEx :: takeOpen()
+{
+	SP_ProcInfo * ret = NULL;
+
+	pthread_mutex_lock( &mMutex );
+
+	ret = mOpenList->takeItem( mOpenList->getCount() - 1 );
+	if( NULL != ret ) getEntry( ret->getPipeFd() )->mIsHeld = 1;
+
+	pthread_mutex_unlock( &mMutex );
+
+	return ret;
 }
 
-void SP_ProcInfoListEx :: append( SP_ProcInfo * info )
+int SP_ProcInfoListEx :: append( SP_ProcInfo * info, unsigned int seqNo )
 {
+	int ret = -1;
+
 	pthread_mutex_lock( &mMutex );
 
-	mList->append( info );
+	Entry_t * entry = getEntry( info->getPipeFd() );
+
+	if( entry->mIsBroken ) {
+		remove( info );
+	} else {
+		if( mList->findByPipeFd( info->getPipeFd() ) < 0 ) mList->append( info );
+
+		entry->mSeqNos[ entry->mCount++ ] = seqNo;
+		entry->mIsHeld = 1;
+
+		ret = entry->mCount;
+	}
+
+	pthread_mutex_unlock( &mMutex );
+
+	return ret;
+}
+
+int SP_ProcInfoListEx :: done( SP_ProcInfo * info, int isOpen )
+{
+	int ret = -1;
+
+	pthread_mutex_lock( &mMutex );
+
+	Entry_t * entry = getEntry( info->getPipeFd() );
+
+	if( entry->mIsBroken || 0 == entry->mCount ) {
+		ret = entry->mIsBroken ? -1 : 0;
+		remove( info );
+	} else {
+		entry->mIsHeld = 0;
+		entry->mIsOpen = isOpen;
+
+		if( entry->mIsOpen && entry->mCount < mQueueDepth ) mOpenList->append( info );
+
+		ret = entry->mCount;
+	}
+
+	pthread_mutex_unlock( &mMutex );
+
+	return ret;
+}
+
+int SP_ProcInfoListEx :: cancel( SP_ProcInfo * info, unsigned int seqNo )
+{
+	int ret = 0;
+
+	pthread_mutex_lock( &mMutex );
+
+	Entry_t * entry = getEntry( info->getPipeFd() );
+
+	for( int i = 0; i < entry->mCount; i++ ) {
+		if( seqNo == entry->mSeqNos[i] ) {
+			memmove( entry->mSeqNos + i, entry->mSeqNos + i + 1,
+					sizeof( unsigned int ) * ( entry->mCount - i - 1 ) );
+			entry->mCount--;
+			break;
+		}
+	}
+
+	entry->mIsHeld = 0;
+	entry->mIsOpen = 0;
 
-	if( 1 == mList->getCount() ) pthread_cond_signal( &mCond );
+	if( entry->mIsBroken || 0 == entry->mCount ) {
+		remove( info );
+		ret = 1;
+	}
 
 	pthread_mutex_unlock( &mMutex );
+
+	return ret;
 }
 
-SP_ProcInfo * SP_ProcInfoListEx :: takeByPipeFd( int pipeFd )
+SP_ProcInfo * SP_ProcInfoListEx :: complete( int pipeFd, unsigned int seqNo, int * isDone )
 {
 	SP_ProcInfo * ret = NULL;
 
+	* isDone = 0;
+
 	pthread_mutex_lock( &mMutex );
-	ret = mList->takeItem( mList->findByPipeFd( pipeFd ) );
-	if( mList->getCount() <= 0 ) pthread_cond_signal( &mEmptyCond );
+
+	ret = mList->getItem( mList->findByPipeFd( pipeFd ) );
+
+	if( NULL != ret ) {
+		Entry_t * entry = getEntry( pipeFd );
+
+		int index = 0;
+		for( ; index < entry->mCount && seqNo != entry->mSeqNos[ index ]; ) index++;
+
+		if( index < entry->mCount ) {
+			// keep the sending order, the ring and the socket are not ordered
+			memmove( entry->mSeqNos + index, entry->mSeqNos + index + 1,
+					sizeof( unsigned int ) * ( entry->mCount - index - 1 ) );
+			entry->mCount--;
+		} else {
+			syslog( LOG_WARNING, "WARN: process #%d reply unknown seq.no %u",
+					ret->getPid(), seqNo );
+		}
+
+		if( entry->mIsHeld ) {
+			// the sender will call done or cancel
+		} else if( 0 == entry->mCount ) {
+			remove( ret );
+			* isDone = 1;
+		} else if( entry->mIsOpen && entry->mCount == mQueueDepth - 1
+				&& mOpenList->findByPipeFd( pipeFd ) < 0 ) {
+			// it was full, accept requests again
+			mOpenList->append( ret );
+		}
+	}
 
 	pthread_mutex_unlock( &mMutex );
 
 	return ret;
 }
 
-int SP_ProcInfoListEx :: conv2pollfd( struct pollfd pfd[], int nfds )
+int SP_ProcInfoListEx :: recvRing( int pipeFd, unsigned int * seqNo, SP_ProcDataBlock * reply )
 {
+	int ret = 0;
+
 	pthread_mutex_lock( &mMutex );
 
-	if( mList->getCount() <= 0 ) {
-		syslog( LOG_INFO, "INFO: waiting for not empty" );
+	// the worker may go back to the pool and be freed without the lock
+	SP_ProcInfo * info = mList->getItem( mList->findByPipeFd( pipeFd ) );
+
+	if( NULL != info && NULL != info->getChannel() ) {
+		SP_ProcRingChannel * channel = info->getChannel();
 
-		struct timezone tz;
-		struct timeval now;
-		gettimeofday( &now, &tz );
+		channel->awake( SP_ProcRingChannel::eReply );
 
-		struct timespec timeout;
-		timeout.tv_sec = now.tv_sec + 5;
-		timeout.tv_nsec = now.tv_usec * 1000;
+		ret = channel->recv( SP_ProcRingChannel::eReply, seqNo, reply );
 
-		pthread_cond_timedwait( &mCond, &mMutex, &timeout );
+		if( 0 == ret && 0 == channel->sleep( SP_ProcRingChannel::eReply ) ) {
+			ret = channel->recv( SP_ProcRingChannel::eReply, seqNo, reply );
+		}
 	}
 
-	nfds = mList->getCount() > nfds ? nfds : mList->getCount();
+	pthread_mutex_unlock( &mMutex );
 
-	for( int i = 0; i < nfds; i++ ) {
-		const SP_ProcInfo * info = mList->getItem( i );
+	return ret;
+}
+
+SP_ProcInfo * SP_ProcInfoListEx :: takeByPipeFd( int pipeFd, unsigned int seqNos[],
+		int * count, int * isDone )
+{
+	SP_ProcInfo * ret = NULL;
+
+	* count = 0;
+	* isDone = 0;
+
+	pthread_mutex_lock( &mMutex );
+
+	ret = mList->getItem( mList->findByPipeFd( pipeFd ) );
+
+	if( NULL != ret ) {
+		Entry_t * entry = getEntry( pipeFd );
+
+		for( int i = 0; i < entry->mCount; i++ ) seqNos[ ( * count )++ ] = entry->mSeqNos[i];
+		entry->mCount = 0;
 
-		pfd[i].fd = info->getPipeFd();
-		pfd[i].events = POLLIN;
-		pfd[i].revents = 0;
+		if( entry->mIsHeld ) {
+			entry->mIsBroken = 1;
+		} else {
+			remove( ret );
+			* isDone = 1;
+		}
 	}
 
 	pthread_mutex_unlock( &mMutex );
 
-	return nfds;
+	return ret;
 }
 
 int SP_ProcInfoListEx :: getCount() const
@@ -234,11 +667,12 @@ int SP_ProcInfoListEx :: getCount() const
 //-------------------------------------------------------------------
 
 SP_ProcDatumDispatcher :: SP_ProcDatumDispatcher( SP_ProcDatumServiceFactory * factory,
-		SP_ProcDatumHandler * handler )
+		SP_ProcDatumHandler * handler, int isZygote )
 {
 	mHandler = handler;
 
 	mManager = new SP_ProcManager( new SP_ProcWorkerFactoryDatumAdapter( factory ) );
+	mManager->setZygote( isZygote );
 	mManager->start();
 
 	mPool = mManager->getProcPool();
@@ -249,6 +683,35 @@ SP_ProcDatumDispatcher :: SP_ProcDatumDispatcher( SP_ProcDatumServiceFactory * f
 
 	mMaxProc = 128;
 
+	mSeqNo = 0;
+
+	mRingSize = 0;
+	mRingSpinUsec = 0;
+
+	mEpollFd = epoll_create( 1024 );
+	assert( mEpollFd >= 0 );
+
+	mEventFd = eventfd( 0, EFD_NONBLOCK );
+	assert( mEventFd >= 0 );
+
+	struct epoll_event event;
+	memset( &event, 0, sizeof( event ) );
+	event.events = EPOLLIN;
+	event.data.u64 = mEventFd;
+	if( 0 != epoll_ctl( mEpollFd, EPOLL_CTL_ADD, mEventFd, &event ) ) {
+		syslog( LOG_WARNING, "WARN: epoll_ctl fail, errno %d, %s", errno, strerror( errno ) );
+	}
+
+	// the idle processes which have exited are removed at once
+	if( mPool->getExitFd() >= 0 ) {
+		event.data.u64 = mPool->getExitFd();
+		if( 0 != epoll_ctl( mEpollFd, EPOLL_CTL_ADD, mPool->getExitFd(), &event ) ) {
+			syslog( LOG_WARNING, "WARN: watch exit fd fail, errno %d, %s", errno, strerror( errno ) );
+		} else {
+			mPool->setExitWatched( 1 );
+		}
+	}
+
 	pthread_mutex_init( &mMutex, NULL );
 	pthread_cond_init( &mCond, NULL );
 
@@ -272,9 +735,16 @@ SP_ProcDatumDispatcher :: ~SP_ProcDatumDispatcher()
 {
 	pthread_mutex_lock( &mMutex );
 	mIsStop = 1;
+
+	uint64_t value = 1;
+	write( mEventFd, &value, sizeof( value ) );
+
 	pthread_cond_wait( &mCond, &mMutex );
 	pthread_mutex_unlock( &mMutex );
 
+	close( mEventFd );
+	mEventFd = -1;
+
 	delete mHandler;
 	mHandler = NULL;
 
@@ -283,6 +753,10 @@ SP_ProcDatumDispatcher :: ~SP_ProcDatumDispatcher()
 
 	delete mBusyList;
 	mBusyList = NULL;
+
+	// after the workers, their ring channels unwatch it
+	close( mEpollFd );
+	mEpollFd = -1;
 }
 
 SP_ProcPool * SP_ProcDatumDispatcher :: getProcPool()
@@ -295,65 +769,232 @@ void SP_ProcDatumDispatcher :: setMaxProc( int maxProc )
 	mMaxProc = maxProc;
 }
 
+void SP_ProcDatumDispatcher :: setQueueDepth( int queueDepth )
+{
+	if( queueDepth < 1 ) queueDepth = 1;
+
+	if( 0 != mBusyList->setQueueDepth( queueDepth ) ) {
+		syslog( LOG_WARNING, "WARN: cannot shrink queue.depth to %d, keep %d",
+				queueDepth, mBusyList->getQueueDepth() );
+	}
+}
+
+void SP_ProcDatumDispatcher :: setRingSize( size_t ringSize )
+{
+	mRingSize = ringSize;
+}
+
+void SP_ProcDatumDispatcher :: setRingSpin( int spinUsec )
+{
+	mRingSpinUsec = spinUsec;
+}
+
+void SP_ProcDatumDispatcher :: setMemLimit( const SP_ProcMemLimit_t * memLimit )
+{
+	mPool->setMemLimit( memLimit );
+}
+
+void SP_ProcDatumDispatcher :: setIdleTimeout( int idleTimeout, int minIdleProc )
+{
+	mPool->setIdleTimeout( idleTimeout, minIdleProc );
+}
+
+// the reply eventfd of a ring is registered with the pipe fd and this flag
+static const uint64_t SP_PROC_RING_EVENT = 1ULL << 32;
+
+int SP_ProcDatumDispatcher :: arm( int pipeFd )
+{
+	struct epoll_event event;
+	memset( &event, 0, sizeof( event ) );
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.u64 = pipeFd;
+
+	// re-arm a fd of a reused worker, or add a new one
+	if( 0 != epoll_ctl( mEpollFd, EPOLL_CTL_MOD, pipeFd, &event )
+			&& ( ENOENT != errno
+				|| 0 != epoll_ctl( mEpollFd, EPOLL_CTL_ADD, pipeFd, &event ) ) ) {
+		syslog( LOG_WARNING, "WARN: epoll_ctl fail, errno %d, %s", errno, strerror( errno ) );
+		return -1;
+	}
+
+	return 0;
+}
+
+int SP_ProcDatumDispatcher :: attachRing( SP_ProcInfo * info )
+{
+	SP_ProcRingChannel * channel = new SP_ProcRingChannel();
+
+	if( 0 != channel->create( mRingSize, mRingSpinUsec ) ) {
+		// keep using the socket
+		delete channel;
+		return 0;
+	}
+
+	int fds[ SP_ProcRingChannel::FD_COUNT ];
+	channel->getFds( fds );
+
+	SP_ProcPdu_t pdu;
+	memset( &pdu, 0, sizeof( pdu ) );
+	pdu.mMagicNum = SP_ProcPdu_t::MAGIC_NUM;
+	pdu.mType = SP_ProcPdu_t::eAttachRing;
+	pdu.mSrcPid = getpid();
+	pdu.mDestPid = info->getPid();
+
+	// edge triggered, the eventfd is never read, the channel unwatches it
+	// when it is deleted, else it could fire for a reused pipe fd
+	struct epoll_event event;
+	memset( &event, 0, sizeof( event ) );
+	event.events = EPOLLIN | EPOLLET;
+	event.data.u64 = SP_PROC_RING_EVENT | info->getPipeFd();
+
+	if( 0 == channel->watch( SP_ProcRingChannel::eReply, mEpollFd, &event )
+			&& SP_ProcPduUtils::send_pdu( info->getPipeFd(), &pdu, NULL ) > 0
+			&& 0 == SP_ProcPduUtils::send_fds( info->getPipeFd(), fds, SP_ProcRingChannel::FD_COUNT ) ) {
+		info->setChannel( channel );
+		return 0;
+	}
+
+	syslog( LOG_WARNING, "WARN: attach ring to process #%d fail, errno %d, %s",
+			info->getPid(), errno, strerror( errno ) );
+
+	delete channel;
+
+	return -1;
+}
+
+void SP_ProcDatumDispatcher :: broken( int pipeFd )
+{
+	int count = 0, isDone = 0;
+	unsigned int * seqNos = (unsigned int*)malloc(
+			sizeof( unsigned int ) * mBusyList->getQueueDepth() );
+	assert( NULL != seqNos );
+
+	// the pending requests are lost
+	SP_ProcInfo * info = mBusyList->takeByPipeFd( pipeFd, seqNos, &count, &isDone );
+	if( NULL != info ) {
+		for( int i = 0; i < count; i++ ) mHandler->onErrorEx( info->getPid(), seqNos[i] );
+
+		if( isDone ) mPool->erase( info );
+	}
+
+	free( seqNos );
+}
+
+void SP_ProcDatumDispatcher :: complete( int pipeFd, unsigned int seqNo,
+		const SP_ProcDataBlock * reply, int isRing )
+{
+	int isDone = 0;
+
+	SP_ProcInfo * info = mBusyList->complete( pipeFd, seqNo, &isDone );
+	if( NULL == info ) {
+		syslog( LOG_CRIT, "CRIT: found a not exists fd %d, dangerous", pipeFd );
+		return;
+	}
+
+	pid_t pid = info->getPid();
+
+	// back to the pool first, so the handler can dispatch to it again
+	if( isDone ) mPool->save( info );
+
+	mHandler->onReplyEx( pid, seqNo, reply );
+
+	// the pipe fd is still armed after a reply from the ring
+	if( ! isDone && ! isRing && 0 != arm( pipeFd ) ) broken( pipeFd );
+}
+
 void * SP_ProcDatumDispatcher :: checkReply( void * args )
 {
 	SP_ProcDatumDispatcher * dispatcher = (SP_ProcDatumDispatcher*)args;
 
 	SP_ProcInfoListEx * list = dispatcher->mBusyList;
-	SP_ProcDatumHandler * handler = dispatcher->mHandler;
-	SP_ProcPool * pool = dispatcher->mPool;
+
+	static const int SP_PROC_MAX_EVENTS = 256;
+	struct epoll_event events[ SP_PROC_MAX_EVENTS ];
+
+	// the socket replies are read by a buffered reader of each pipe fd
+	SP_ProcPduReader ** readers = NULL;
+	int readerCount = 0;
 
 	for( ; ! ( dispatcher->mIsStop && 0 == list->getCount() ); ) {
-		// 1. collect fd
-		static int SP_PROC_MAX_FD = 1024;
-		struct pollfd pfd[ SP_PROC_MAX_FD ];
-		int nfds = list->conv2pollfd( pfd, SP_PROC_MAX_FD );
-
-		if( 0 == nfds ) continue;
-
-		// 2. select fd
-		int ret = -1;
-		for( int retry = 0; retry < 2; retry++ ) {
-			ret = poll( pfd, nfds, 10 );
-			if( -1 == ret && EINTR == errno ) continue;
-			break;
-		}
+		int nevents = epoll_wait( dispatcher->mEpollFd, events, SP_PROC_MAX_EVENTS, -1 );
+
+		for( int i = 0; i < nevents; i++ ) {
+			int fd = (int)( events[i].data.u64 & 0xFFFFFFFF );
 
-		// 3. dispatch reply/error
-		if( ret > 0 ) {
-			for( int i = 0; i < nfds; i++ ) {
-				if( 0 == pfd[i].revents ) {
-					// timeout, wait for next turn
-				} else {
-					SP_ProcInfo * info = list->takeByPipeFd( pfd[i].fd );
-					if( NULL == info ) {
-						syslog( LOG_CRIT, "CRIT: found a not exists fd %d, dangerous", pfd[i].fd );
-						continue;
+			if( fd == dispatcher->mEventFd ) {
+				uint64_t value = 0;
+				read( fd, &value, sizeof( value ) );
+				continue;
+			}
+
+			if( fd == dispatcher->mPool->getExitFd() ) {
+				dispatcher->mPool->reapExited();
+				continue;
+			}
+
+			if( events[i].data.u64 & SP_PROC_RING_EVENT ) {
+				unsigned int seqNo = 0;
+				SP_ProcDataBlock reply;
+
+				for( ; list->recvRing( fd, &seqNo, &reply ) > 0; reply.reset() ) {
+					dispatcher->complete( fd, seqNo, &reply, 1 );
+				}
+
+				continue;
+			}
+
+			if( fd >= readerCount ) {
+				int count = fd + 64;
+				readers = (SP_ProcPduReader**)realloc( readers, sizeof( void * ) * count );
+				assert( NULL != readers );
+				for( ; readerCount < count; readerCount++ ) readers[ readerCount ] = NULL;
+			}
+
+			// a partial reply is kept by the reader, this thread never waits for the rest
+			if( NULL == readers[ fd ] ) readers[ fd ] = new SP_ProcPduReader( fd, 16384, 1 );
+
+			SP_ProcPduReader * reader = readers[ fd ];
+			SP_ProcPdu_t pdu;
+			SP_ProcDataBlock reply;
+
+			int isBroken = 1;
+
+			if( events[i].events & EPOLLIN ) {
+				// the replies which come with the first one are taken too
+				for( ; ; reply.reset() ) {
+					int ret = reader->read_pdu( &pdu, &reply );
+
+					if( SP_ProcPduReader::INCOMPLETE == ret ) {
+						isBroken = ( 0 != dispatcher->arm( fd ) );
+						break;
 					}
 
-					SP_ProcPdu_t pdu;
-					SP_ProcDataBlock reply;
-
-					if( pfd[i].revents & POLLIN ) {
-						// readable
-						if( SP_ProcPduUtils::read_pdu( pfd[i].fd, &pdu, &reply ) > 0 ) {
-							handler->onReply( info->getPid(), &reply );
-							pool->save( info );
-						} else {
-							pool->erase( info );
-						}
-					} else {
-						// error
-						handler->onError( info->getPid() );
-						pool->erase( info );
+					if( ret <= 0 ) break;
+
+					dispatcher->complete( fd, pdu.mSeqNo, &reply, 0 );
+
+					if( ! reader->hasPdu() ) {
+						isBroken = 0;
+						break;
 					}
 				}
 			}
-		} else {
-			// ignore
+
+			if( isBroken ) {
+				// drop the buffered data, the fd may be reused by a new worker
+				delete reader;
+				readers[ fd ] = NULL;
+
+				dispatcher->broken( fd );
+			}
 		}
 	}
 
+	for( int i = 0; i < readerCount; i++ ) delete readers[i];
+	free( readers );
+
+	dispatcher->mPool->setExitWatched( 0 );
+
 	pthread_mutex_lock( &( dispatcher->mMutex ) );
 	pthread_cond_signal( &( dispatcher->mCond ) );
 	pthread_mutex_unlock( &( dispatcher->mMutex ) );
@@ -363,25 +1004,109 @@ void * SP_ProcDatumDispatcher :: checkReply( void * args )
 
 pid_t SP_ProcDatumDispatcher :: dispatch( const void * request, size_t len )
 {
-	if( mBusyList->getCount() >= mMaxProc ) return -1;
+	return dispatch( request, len, NULL );
+}
 
-	pid_t ret = -1;
+pid_t SP_ProcDatumDispatcher :: dispatch( const void * request, size_t len, unsigned int * id )
+{
+	return dispatch( request, len, NULL, id );
+}
 
-	SP_ProcInfo * info = mPool->get();
-	if( NULL != info ) {
-		SP_ProcPdu_t pdu;
-		memset( &pdu, 0, sizeof( pdu ) );
-		pdu.mMagicNum = SP_ProcPdu_t::MAGIC_NUM;
-		pdu.mSrcPid = getpid();
-		pdu.mDestPid = info->getPid();
-		pdu.mDataSize = len;
-
-		if( SP_ProcPduUtils::send_pdu( info->getPipeFd(), &pdu, request ) > 0 ) {
-			ret = info->getPid();
-			mBusyList->append( info );
+pid_t SP_ProcDatumDispatcher :: dispatch( SP_ProcDataBlock * request, unsigned int * id )
+{
+	return dispatch( request->getData(), request->getDataSize(), request, id );
+}
+
+pid_t SP_ProcDatumDispatcher :: dispatch( const void * request, size_t len,
+		SP_ProcDataBlock * block, unsigned int * id )
+{
+	SP_ProcInfo * info = NULL;
+
+	// prefer an idle worker, then a busy one which can accept more requests
+	if( mBusyList->getQueueDepth() > 1
+			&& ( mBusyList->getCount() >= mMaxProc || mPool->getIdleCount() <= 0 ) ) {
+		info = mBusyList->takeOpen();
+		if( NULL != info ) info->setRequests( info->getRequests() + 1 );
+	}
+
+	if( NULL == info ) {
+		if( mBusyList->getCount() >= mMaxProc ) return -1;
+
+		info = mPool->get();
+		if( NULL == info ) return -1;
+
+		if( mRingSize > 0 && NULL == info->getChannel() && 0 != attachRing( info ) ) {
+			mPool->erase( info );
+			return -1;
+		}
+
+		// the reply thread may leave it awake when the last reply is taken
+		if( NULL != info->getChannel() ) info->getChannel()->sleep( SP_ProcRingChannel::eReply );
+	}
+
+	unsigned int seqNo = __sync_add_and_fetch( &mSeqNo, 1 );
+
+	// the reply thread may report it before we return
+	if( NULL != id ) * id = seqNo;
+
+	int pending = mBusyList->append( info, seqNo );
+	if( pending < 0 ) {
+		// broken while it was taken
+		mPool->erase( info );
+		return -1;
+	}
+
+	pid_t ret = info->getPid();
+	int isSent = 0;
+
+	if( 1 == pending && 0 != arm( info->getPipeFd() ) ) {
+		// the request is reported by onErrorEx, done() finds it broken
+		broken( info->getPipeFd() );
+		isSent = 1;
+	} else {
+		SP_ProcRingChannel * channel = info->getChannel();
+
+		// a shared block is larger than the ring usually, pass it by the memfd
+		if( NULL != channel && ( NULL == block || block->getFd() < 0 )
+				&& 0 == channel->send( SP_ProcRingChannel::eRequest, seqNo, request, len ) ) {
+			isSent = 1;
 		} else {
+			SP_ProcPdu_t pdu;
+			memset( &pdu, 0, sizeof( pdu ) );
+			pdu.mMagicNum = SP_ProcPdu_t::MAGIC_NUM;
+			pdu.mSrcPid = getpid();
+			pdu.mDestPid = info->getPid();
+			pdu.mSeqNo = seqNo;
+			pdu.mDataSize = len;
+
+			if( NULL != block ) {
+				isSent = SP_ProcPduUtils::send_block( info->getPipeFd(), &pdu, block ) > 0;
+			} else {
+				isSent = SP_ProcPduUtils::send_pdu( info->getPipeFd(), &pdu, request ) > 0;
+			}
+		}
+	}
+
+	if( isSent ) {
+		int maxRequests = mPool->getMaxRequestsPerProc();
+		int isOpen = ( maxRequests <= 0 || info->getRequests() < maxRequests );
+
+		pending = mBusyList->done( info, isOpen );
+
+		if( pending < 0 ) {
 			mPool->erase( info );
+		} else if( 0 == pending ) {
+			// all the replies arrived while sending
+			mPool->save( info );
+		}
+	} else {
+		if( mBusyList->cancel( info, seqNo ) ) {
+			mPool->erase( info );
+		} else {
+			// let the reply thread report the pending requests
+			shutdown( info->getPipeFd(), SHUT_RDWR );
 		}
+		ret = -1;
 	}
 
 	return ret;
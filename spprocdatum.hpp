@@ -8,7 +8,6 @@
 
 #include <unistd.h>
 #include <pthread.h>
-#include <sys/poll.h>
 
 class SP_ProcPool;
 class SP_ProcManager;
@@ -16,19 +15,26 @@ class SP_ProcDatumServiceFactory;
 class SP_ProcDataBlock;
 class SP_ProcInfo;
 
+typedef struct tagSP_ProcMemLimit SP_ProcMemLimit_t;
+
 class SP_ProcDatumHandler {
 public:
 	virtual ~SP_ProcDatumHandler();
-	virtual void onReply( pid_t pid, const SP_ProcDataBlock * reply ) = 0;
-	virtual void onError( pid_t pid ) = 0;
+	virtual void onReply( pid_t pid, const SP_ProcDataBlock * reply );
+	virtual void onError( pid_t pid );
+
+	// id : returned by dispatch, default to call onReply/onError
+	virtual void onReplyEx( pid_t pid, unsigned int id, const SP_ProcDataBlock * reply );
+	virtual void onErrorEx( pid_t pid, unsigned int id );
 };
 
 class SP_ProcInfoListEx;
 
 class SP_ProcDatumDispatcher {
 public:
+	// isZygote : see SP_ProcManager::setZygote
 	SP_ProcDatumDispatcher( SP_ProcDatumServiceFactory * factory,
-			SP_ProcDatumHandler * handler );
+			SP_ProcDatumHandler * handler, int isZygote = 0 );
 	~SP_ProcDatumDispatcher();
 
 	// get the proc pool object to set parameters
@@ -37,9 +43,37 @@ public:
 	// default is 128
 	void setMaxProc( int maxProc );
 
+	// requests outstanding on one worker, default is 1, should be set before dispatch,
+	// it can only grow, a smaller depth is logged and ignored
+	void setQueueDepth( int queueDepth );
+
+	// bytes of the shared memory rings between the app and a worker,
+	// default is 0, only the socket is used. A message which does not
+	// fit in the ring is sent through the socket. Should be set before dispatch
+	void setRingSize( size_t ringSize );
+
+	// microseconds a worker polls its ring before sleeping, default is 0
+	void setRingSpin( int spinUsec );
+
+	// default is unlimited, the workers over the limit are recycled
+	// when they are saved into the pool, see SP_ProcPool::setMemLimit
+	void setMemLimit( const SP_ProcMemLimit_t * memLimit );
+
+	// default is 0, never. The idle workers unused for idleTimeout seconds
+	// are retired by the reply thread, down to minIdleProc
+	void setIdleTimeout( int idleTimeout, int minIdleProc = 0 );
+
 	// > 0 : Success, < 0 : fail, reach MaxProc limit or cannot get a process
 	pid_t dispatch( const void * request, size_t len );
 
+	// id : the request id, which is passed back to onReplyEx/onErrorEx.
+	// It is set before the request is sent, the callbacks for it may run
+	// in the reply thread before dispatch returns, even if it returns < 0
+	pid_t dispatch( const void * request, size_t len, unsigned int * id );
+
+	// a block from SP_ProcDataBlock::allocShared is passed without copy
+	pid_t dispatch( SP_ProcDataBlock * request, unsigned int * id );
+
 	void dump() const;
 
 private:
@@ -56,8 +90,26 @@ private:
 
 	SP_ProcInfoListEx * mBusyList;
 
+	// the busy fds are armed one-shot when a request is sent
+	int mEpollFd;
+
+	// wake up the reply thread to check the stop flag
+	int mEventFd;
+
 	int mMaxProc;
 
+	unsigned int mSeqNo;
+
+	size_t mRingSize;
+	int mRingSpinUsec;
+
+	int arm( int pipeFd );
+	int attachRing( SP_ProcInfo * info );
+	void broken( int pipeFd );
+	void complete( int pipeFd, unsigned int seqNo, const SP_ProcDataBlock * reply, int isRing );
+
+	pid_t dispatch( const void * request, size_t len, SP_ProcDataBlock * block, unsigned int * id );
+
 	static void * checkReply( void * );
 };
 
@@ -66,6 +118,9 @@ private:
 class SP_ProcDatumService {
 public:
 	virtual ~SP_ProcDatumService();
+
+	// build the reply in reply->alloc() to avoid malloc/free per request,
+	// a large reply can be built in reply->allocShared() to avoid copies
 	virtual void handle( const SP_ProcDataBlock * request, SP_ProcDataBlock * reply ) = 0;
 };
 
@@ -14,6 +14,13 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 
 #include "spprocinetsvr.hpp"
 
@@ -26,15 +33,19 @@ public:
 	SP_ProcWorkerInetAdapter( SP_ProcInetServiceFactory * factory );
 	~SP_ProcWorkerInetAdapter();
 
+	void setZygote( int isZygote );
+
 	virtual void process( SP_ProcInfo * procInfo );
 
 private:
 	SP_ProcInetServiceFactory * mFactory;
+	int mIsZygote;
 };
 
 SP_ProcWorkerInetAdapter :: SP_ProcWorkerInetAdapter( SP_ProcInetServiceFactory * factory )
 {
 	mFactory = factory;
+	mIsZygote = 0;
 }
 
 SP_ProcWorkerInetAdapter :: ~SP_ProcWorkerInetAdapter()
@@ -43,21 +54,33 @@ SP_ProcWorkerInetAdapter :: ~SP_ProcWorkerInetAdapter()
 	mFactory = NULL;
 }
 
+void SP_ProcWorkerInetAdapter :: setZygote( int isZygote )
+{
+	mIsZygote = isZygote;
+}
+
 void SP_ProcWorkerInetAdapter :: process( SP_ProcInfo * procInfo )
 {
-	mFactory->workerInit( procInfo );
+	if( ! mIsZygote ) mFactory->workerInit( procInfo );
+
+	int fds[ SP_ProcPduUtils::MAX_PASS_FDS ];
+	SP_ProcFdMeta_t metas[ SP_ProcPduUtils::MAX_PASS_FDS ];
 
 	for( ; ; ) {
-		int fd = SP_ProcPduUtils::recv_fd( procInfo->getPipeFd() );
-		if( fd >= 0 ) {
-			procInfo->setRequests( procInfo->getRequests() + 1 );
-			SP_ProcInetService * service = mFactory->create();
+		int count = SP_ProcPduUtils::recv_fds( procInfo->getPipeFd(),
+				fds, metas, SP_ProcPduUtils::MAX_PASS_FDS );
+		if( count > 0 ) {
+			for( int i = 0; i < count; i++ ) {
+				procInfo->setRequests( procInfo->getRequests() + 1 );
+				SP_ProcInetService * service = mFactory->create();
 
-			service->handle( fd );
-			close( fd );
+				service->handleEx( fds[i], &( metas[i] ) );
+				close( fds[i] );
 
-			delete service;
+				delete service;
+			}
 
+			// one completion for the whole batch
 			SP_ProcPdu_t replyPdu;
 			memset( &replyPdu, 0, sizeof( SP_ProcPdu_t ) );
 			replyPdu.mMagicNum = SP_ProcPdu_t::MAGIC_NUM;
@@ -67,7 +90,9 @@ void SP_ProcWorkerInetAdapter :: process( SP_ProcInfo * procInfo )
 				break;
 			}
 		} else {
-			syslog( LOG_WARNING, "WARN: recv_fd fail, errno %d, %s", errno, strerror( errno ) );
+			if( count < 0 ) {
+				syslog( LOG_WARNING, "WARN: recv_fds fail, errno %d, %s", errno, strerror( errno ) );
+			}
 			break;
 		}
 	}
@@ -85,8 +110,11 @@ public:
 
 	virtual SP_ProcWorker * create() const;
 
+	virtual void zygoteInit();
+
 private:
 	SP_ProcInetServiceFactory * mFactory;
+	int mIsZygote;
 };
 
 
@@ -94,6 +122,7 @@ SP_ProcWorkerFactoryInetAdapter :: SP_ProcWorkerFactoryInetAdapter(
 		SP_ProcInetServiceFactory * factory )
 {
 	mFactory = factory;
+	mIsZygote = 0;
 }
 
 SP_ProcWorkerFactoryInetAdapter :: ~SP_ProcWorkerFactoryInetAdapter()
@@ -104,7 +133,576 @@ SP_ProcWorkerFactoryInetAdapter :: ~SP_ProcWorkerFactoryInetAdapter()
 
 SP_ProcWorker * SP_ProcWorkerFactoryInetAdapter :: create() const
 {
-	return new SP_ProcWorkerInetAdapter( mFactory );
+	SP_ProcWorkerInetAdapter * worker = new SP_ProcWorkerInetAdapter( mFactory );
+	worker->setZygote( mIsZygote );
+
+	return worker;
+}
+
+void SP_ProcWorkerFactoryInetAdapter :: zygoteInit()
+{
+	SP_ProcInfo procInfo( -1 );
+	procInfo.setPid( getpid() );
+
+	mFactory->workerInit( &procInfo );
+
+	mIsZygote = 1;
+}
+
+//-------------------------------------------------------------------
+
+typedef struct tagSP_ProcAcceptorArgs {
+	int mListenfd;
+	int mStopfd;
+	int mKickfd;                  // passes the accept queue to another acceptor
+	int mTopUpfd;                 // asks the keeper to top up the pool
+	int mRefillfd;                // the keeper has topped up the pool
+	SP_ProcPool * mProcPool;
+	int * mIsStop;
+
+	int mMaxProc;                 // the share of this acceptor
+	int mTotalMaxProc;
+	int mMinIdleProc;
+	int mMaxRequestsPerProc;
+	int mAcceptBatch;
+	int mPeekSize;
+	int mQueueDepth;
+
+	// shared by all the acceptors
+	int * mBusyTotal;
+	int * mIsTopUpPending;
+	int * mIsSpawning;
+} SP_ProcAcceptorArgs_t;
+
+/**
+ * An acceptor owns an epoll set and the workers which it passes
+ * connections to, the listen socket and the proc pool are shared.
+ */
+class SP_ProcInetAcceptor {
+public:
+	SP_ProcInetAcceptor( const SP_ProcAcceptorArgs_t * args );
+	~SP_ProcInetAcceptor();
+
+	void run();
+
+	static void * runThread( void * arg );
+
+private:
+	SP_ProcAcceptorArgs_t mArgs;
+
+	int mEpfd;
+
+	SP_ProcInfoList mBusyList;
+
+	// the busy workers which can queue more connections, not owned
+	SP_ProcInfoList mOpenList;
+
+	// outstanding messages of each busy pipe fd
+	int * mPending;
+	int mPendingSize;
+
+	// the pool failed to give a worker, wait for a refill
+	int mIsStarved;
+
+	int & pending( int pipeFd );
+
+	// a busy worker which can take more
+	int isOpen( SP_ProcInfo * info );
+
+	// drain the accept queue, 0 : more connections may be waiting, -1 : no more
+	int acceptClient();
+
+	void addBusy( SP_ProcInfo * info );
+	void removeBusy( int pipeFd );
+
+	// ask the keeper for more idle workers, at most one request is pending
+	void requestTopUp();
+
+	// a worker can be had from the pool now or soon
+	int canGetIdle();
+
+	// a worker replies or exits
+	void checkWorker( SP_ProcInfo * info );
+};
+
+SP_ProcInetAcceptor :: SP_ProcInetAcceptor( const SP_ProcAcceptorArgs_t * args )
+{
+	mArgs = * args;
+
+	mEpfd = -1;
+
+	mPending = NULL;
+	mPendingSize = 0;
+
+	mIsStarved = 0;
+}
+
+SP_ProcInetAcceptor :: ~SP_ProcInetAcceptor()
+{
+	for( ; mOpenList.getCount() > 0; ) mOpenList.takeItem( mOpenList.getCount() - 1 );
+
+	free( mPending );
+	mPending = NULL;
+}
+
+void * SP_ProcInetAcceptor :: runThread( void * arg )
+{
+	( (SP_ProcInetAcceptor*)arg )->run();
+
+	return NULL;
+}
+
+int & SP_ProcInetAcceptor :: pending( int pipeFd )
+{
+	if( pipeFd >= mPendingSize ) {
+		int size = pipeFd + 64;
+		mPending = (int*)realloc( mPending, sizeof( int ) * size );
+		assert( NULL != mPending );
+		for( ; mPendingSize < size; mPendingSize++ ) mPending[ mPendingSize ] = 0;
+	}
+
+	return mPending[ pipeFd ];
+}
+
+int SP_ProcInetAcceptor :: isOpen( SP_ProcInfo * info )
+{
+	return pending( info->getPipeFd() ) < mArgs.mQueueDepth
+			&& ( mArgs.mMaxRequestsPerProc <= 0 || info->getRequests() < mArgs.mMaxRequestsPerProc );
+}
+
+void SP_ProcInetAcceptor :: addBusy( SP_ProcInfo * info )
+{
+	mBusyList.append( info );
+	__sync_add_and_fetch( mArgs.mBusyTotal, 1 );
+}
+
+void SP_ProcInetAcceptor :: removeBusy( int pipeFd )
+{
+	int index = mBusyList.findByPipeFd( pipeFd );
+	if( index < 0 ) return;
+
+	mBusyList.takeItem( index );
+	__sync_sub_and_fetch( mArgs.mBusyTotal, 1 );
+}
+
+void SP_ProcInetAcceptor :: requestTopUp()
+{
+	int idleCount = mArgs.mProcPool->getIdleCount();
+
+	// an acceptor which has room but finds no idle worker asks too
+	if( idleCount >= mArgs.mMinIdleProc
+			&& ( idleCount > 0 || mBusyList.getCount() >= mArgs.mMaxProc ) ) return;
+
+	if( ! __sync_bool_compare_and_swap( mArgs.mIsTopUpPending, 0, 1 ) ) return;
+
+	uint64_t value = 1;
+	write( mArgs.mTopUpfd, &value, sizeof( value ) );
+}
+
+int SP_ProcInetAcceptor :: canGetIdle()
+{
+	if( mIsStarved ) return 0;
+
+	return mArgs.mProcPool->getIdleCount() > 0
+			|| * mArgs.mIsTopUpPending || * mArgs.mIsSpawning;
+}
+
+int SP_ProcInetAcceptor :: acceptClient()
+{
+	SP_ProcInfo * info = NULL;
+	int isBusy = 0;
+
+	// prefer an idle worker, then a busy one which can queue more
+	if( mOpenList.getCount() > 0
+			&& ( mArgs.mProcPool->getIdleCount() <= 0 || mBusyList.getCount() >= mArgs.mMaxProc ) ) {
+		info = mOpenList.takeItem( mOpenList.getCount() - 1 );
+		info->setRequests( info->getRequests() + 1 );
+		isBusy = 1;
+	} else if( mBusyList.getCount() < mArgs.mMaxProc ) {
+		info = mArgs.mProcPool->get();
+
+		// the listen socket stays readable, stop listening till a refill
+		if( NULL == info ) mIsStarved = 1;
+	}
+
+	if( NULL == info ) return -1;
+
+	int fds[ SP_ProcPduUtils::MAX_PASS_FDS ];
+	SP_ProcFdMeta_t metas[ SP_ProcPduUtils::MAX_PASS_FDS ];
+
+	int count = 0, isEmpty = 0;
+
+	// the listen socket is non-blocking, take what is in the accept queue
+	for( ; count < mArgs.mAcceptBatch; ) {
+		SP_ProcFdMeta_t * meta = &( metas[ count ] );
+		memset( meta, 0, sizeof( SP_ProcFdMeta_t ) );
+
+		socklen_t clientLen = sizeof( meta->mPeerAddr );
+		int clientFd = ::accept( mArgs.mListenfd, (struct sockaddr *)&( meta->mPeerAddr ), &clientLen );
+
+		if( clientFd < 0 ) {
+			if( EINTR == errno || ECONNABORTED == errno ) continue;
+
+			if( EAGAIN != errno && EWOULDBLOCK != errno ) {
+				syslog( LOG_WARNING, "WARN: accept fail, errno %d, %s", errno, strerror( errno ) );
+			}
+			isEmpty = 1;
+			break;
+		}
+
+		gettimeofday( &( meta->mAcceptTime ), NULL );
+
+		if( mArgs.mPeekSize > 0 ) {
+			int len = recv( clientFd, meta->mHead, mArgs.mPeekSize, MSG_PEEK | MSG_DONTWAIT );
+			meta->mHeadLen = len > 0 ? len : 0;
+		}
+
+		fds[ count++ ] = clientFd;
+	}
+
+	// get() and the open list count one request for the message
+	info->setRequests( info->getRequests() - 1 );
+
+	if( count <= 0 ) {
+		if( isBusy ) {
+			mOpenList.append( info );
+		} else {
+			mArgs.mProcPool->save( info );
+		}
+		return -1;
+	}
+
+	if( 0 == SP_ProcPduUtils::send_fds( info->getPipeFd(), fds, metas, count ) ) {
+		// one request per connection
+		info->setRequests( info->getRequests() + count );
+
+		if( isBusy ) {
+			// the pipe is still armed for the outstanding ones
+			pending( info->getPipeFd() )++;
+			if( isOpen( info ) ) mOpenList.append( info );
+		} else {
+			struct epoll_event event;
+			memset( &event, 0, sizeof( event ) );
+			event.events = EPOLLIN | EPOLLONESHOT;
+			event.data.ptr = info;
+
+			// re-arm the pipe, a new or recycled pipe fd is added only once
+			if( 0 == epoll_ctl( mEpfd, EPOLL_CTL_MOD, info->getPipeFd(), &event )
+					|| ( ENOENT == errno
+						&& 0 == epoll_ctl( mEpfd, EPOLL_CTL_ADD, info->getPipeFd(), &event ) ) ) {
+				pending( info->getPipeFd() ) = 1;
+				addBusy( info );
+				if( isOpen( info ) ) mOpenList.append( info );
+			} else {
+				syslog( LOG_WARNING, "WARN: epoll_ctl fail, errno %d, %s", errno, strerror( errno ) );
+				mArgs.mProcPool->erase( info );
+			}
+		}
+	} else {
+		if( isBusy ) {
+			// the outstanding connections are lost with it
+			epoll_ctl( mEpfd, EPOLL_CTL_DEL, info->getPipeFd(), NULL );
+			removeBusy( info->getPipeFd() );
+			pending( info->getPipeFd() ) = 0;
+		}
+		mArgs.mProcPool->erase( info );
+	}
+
+	for( int i = 0; i < count; i++ ) close( fds[i] );
+
+	return isEmpty ? -1 : 0;
+}
+
+void SP_ProcInetAcceptor :: checkWorker( SP_ProcInfo * info )
+{
+	int pipeFd = info->getPipeFd();
+
+	// a worker comes back or makes room
+	mIsStarved = 0;
+
+	SP_ProcPdu_t pdu;
+	if( SP_ProcPduUtils::read_pdu( pipeFd, &pdu, NULL ) > 0 ) {
+		assert( info->getPid() == pdu.mSrcPid );
+
+		if( --pending( pipeFd ) > 0 ) {
+			struct epoll_event event;
+			memset( &event, 0, sizeof( event ) );
+			event.events = EPOLLIN | EPOLLONESHOT;
+			event.data.ptr = info;
+
+			if( 0 == epoll_ctl( mEpfd, EPOLL_CTL_MOD, pipeFd, &event ) ) {
+				if( mOpenList.findByPipeFd( pipeFd ) < 0 && isOpen( info ) ) mOpenList.append( info );
+				return;
+			}
+
+			syslog( LOG_WARNING, "WARN: epoll_ctl fail, errno %d, %s", errno, strerror( errno ) );
+		} else {
+			/* a busy child is available again */
+			pending( pipeFd ) = 0;
+			removeBusy( pipeFd );
+			mOpenList.takeItem( mOpenList.findByPipeFd( pipeFd ) );
+			mArgs.mProcPool->save( info );
+			return;
+		}
+	}
+
+	/* the child exited, the outstanding connections are lost with it */
+	pending( pipeFd ) = 0;
+	epoll_ctl( mEpfd, EPOLL_CTL_DEL, pipeFd, NULL );
+	removeBusy( pipeFd );
+	mOpenList.takeItem( mOpenList.findByPipeFd( pipeFd ) );
+	mArgs.mProcPool->erase( info );
+}
+
+void SP_ProcInetAcceptor :: run()
+{
+	/* the listen socket and every worker pipe are registered only once,
+	 * worker pipes are re-armed by EPOLLONESHOT each time a connection is
+	 * passed, and are removed from the epoll set when the worker is deleted
+	 */
+	mEpfd = epoll_create( 1024 );
+	assert( mEpfd >= 0 );
+
+	// level triggered and never read, it wakes up all the acceptors
+	struct epoll_event stopEvent;
+	memset( &stopEvent, 0, sizeof( stopEvent ) );
+	stopEvent.events = EPOLLIN;
+	stopEvent.data.ptr = this;
+	if( 0 != epoll_ctl( mEpfd, EPOLL_CTL_ADD, mArgs.mStopfd, &stopEvent ) ) {
+		syslog( LOG_WARNING, "WARN: epoll_ctl fail, errno %d, %s", errno, strerror( errno ) );
+	}
+
+	// only one of the acceptors is woken up for a connection
+	struct epoll_event listenEvent;
+	memset( &listenEvent, 0, sizeof( listenEvent ) );
+	listenEvent.events = EPOLLIN | EPOLLEXCLUSIVE;
+	listenEvent.data.ptr = NULL;
+	if( 0 != epoll_ctl( mEpfd, EPOLL_CTL_ADD, mArgs.mListenfd, &listenEvent ) ) {
+		syslog( LOG_WARNING, "WARN: epoll_ctl fail, errno %d, %s", errno, strerror( errno ) );
+	}
+
+	// an acceptor which stops listening kicks one of the others to drain the queue
+	struct epoll_event kickEvent;
+	memset( &kickEvent, 0, sizeof( kickEvent ) );
+	kickEvent.events = EPOLLIN | EPOLLEXCLUSIVE;
+	kickEvent.data.ptr = &( mArgs.mKickfd );
+	if( 0 != epoll_ctl( mEpfd, EPOLL_CTL_ADD, mArgs.mKickfd, &kickEvent ) ) {
+		syslog( LOG_WARNING, "WARN: epoll_ctl fail, errno %d, %s", errno, strerror( errno ) );
+	}
+
+	// edge triggered and never read, every write wakes up every acceptor
+	struct epoll_event refillEvent;
+	memset( &refillEvent, 0, sizeof( refillEvent ) );
+	refillEvent.events = EPOLLIN | EPOLLET;
+	refillEvent.data.ptr = &( mArgs.mRefillfd );
+	if( 0 != epoll_ctl( mEpfd, EPOLL_CTL_ADD, mArgs.mRefillfd, &refillEvent ) ) {
+		syslog( LOG_WARNING, "WARN: epoll_ctl fail, errno %d, %s", errno, strerror( errno ) );
+	}
+
+	int isListening = 1;
+
+	static const int SP_PROC_MAX_EVENTS = 256;
+	struct epoll_event events[ SP_PROC_MAX_EVENTS ];
+
+	for ( ; 0 == * mArgs.mIsStop; ) {
+		/* stop accepting when all the processes are busy, or no idle one
+		 * can be had until the keeper forks more, the listen socket is level
+		 * triggered and would wake us up again at once.
+		 * An exclusive event cannot be modified, so it is deleted and added
+		 */
+		int canAccept = mOpenList.getCount() > 0
+				|| ( mBusyList.getCount() < mArgs.mMaxProc && canGetIdle() );
+		if( isListening != canAccept ) {
+			isListening = canAccept;
+			epoll_ctl( mEpfd, isListening ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, mArgs.mListenfd, &listenEvent );
+			epoll_ctl( mEpfd, isListening ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, mArgs.mKickfd, &kickEvent );
+
+			// the exclusive wakeup may have left connections in the accept queue
+			if( ! isListening ) {
+				uint64_t value = 1;
+				write( mArgs.mKickfd, &value, sizeof( value ) );
+			}
+		}
+
+		int nevents = 0;
+
+		for( ; 0 == * mArgs.mIsStop && nevents <= 0; ) {
+			nevents = epoll_wait( mEpfd, events, SP_PROC_MAX_EVENTS, -1 );
+			if( nevents < 0 && EINTR != errno ) {
+				syslog( LOG_WARNING, "WARN: epoll_wait fail, errno %d, %s", errno, strerror( errno ) );
+			}
+		}
+
+		for( int i = 0; i < nevents; i++ ) {
+			SP_ProcInfo * info = (SP_ProcInfo*)events[i].data.ptr;
+
+			if( NULL == info || (void*)&( mArgs.mKickfd ) == (void*)info ) {
+				if( NULL != info ) {
+					uint64_t value = 0;
+					read( mArgs.mKickfd, &value, sizeof( value ) );
+				}
+
+				/* hand off new connections until the accept queue is empty */
+				for( ; mBusyList.getCount() < mArgs.mMaxProc || mOpenList.getCount() > 0; ) {
+					if( 0 != acceptClient() ) break;
+				}
+			} else if( (void*)&( mArgs.mRefillfd ) == (void*)info ) {
+				mIsStarved = 0;
+			} else if( (void*)this != (void*)info ) {
+				checkWorker( info );
+			}
+		}
+
+		requestTopUp();
+	}
+
+	// wake up the other acceptors
+	uint64_t value = 1;
+	write( mArgs.mStopfd, &value, sizeof( value ) );
+
+	close( mEpfd );
+	mEpfd = -1;
+}
+
+//-------------------------------------------------------------------
+
+/**
+ * The keeper reaps the exited idle processes and forks new ones,
+ * so the acceptors never wait for the process manager.
+ */
+class SP_ProcInetKeeper {
+public:
+	SP_ProcInetKeeper( const SP_ProcAcceptorArgs_t * args );
+	~SP_ProcInetKeeper();
+
+	void run();
+
+	static void * runThread( void * arg );
+
+private:
+	SP_ProcAcceptorArgs_t mArgs;
+
+	// a failed top-up is retried after RETRY_SECONDS, not at every request
+	enum { RETRY_SECONDS = 1 };
+
+	// keep MinIdleProc idle workers, at least one for a starved acceptor,
+	// within MaxProc of all the acceptors, then wake up the acceptors
+	// 0 : OK, -1 : no worker could be forked
+	int topUp();
+};
+
+SP_ProcInetKeeper :: SP_ProcInetKeeper( const SP_ProcAcceptorArgs_t * args )
+{
+	mArgs = * args;
+}
+
+SP_ProcInetKeeper :: ~SP_ProcInetKeeper()
+{
+}
+
+void * SP_ProcInetKeeper :: runThread( void * arg )
+{
+	( (SP_ProcInetKeeper*)arg )->run();
+
+	return NULL;
+}
+
+int SP_ProcInetKeeper :: topUp()
+{
+	SP_ProcPool * procPool = mArgs.mProcPool;
+
+	// the acceptors keep listening while a request is served
+	__sync_lock_test_and_set( mArgs.mIsSpawning, 1 );
+
+	// a request made from now on is served by the next round
+	__sync_lock_release( mArgs.mIsTopUpPending );
+
+	int ret = 0, minIdleProc = mArgs.mMinIdleProc > 0 ? mArgs.mMinIdleProc : 1;
+
+	int idleCount = procPool->getIdleCount();
+	int totalCount = idleCount + __sync_add_and_fetch( mArgs.mBusyTotal, 0 );
+	if( ( idleCount < minIdleProc ) && ( totalCount < mArgs.mTotalMaxProc ) ) {
+		int count = minIdleProc - idleCount;
+		if( count > mArgs.mTotalMaxProc - totalCount ) count = mArgs.mTotalMaxProc - totalCount;
+		if( procPool->ensureIdleProc( idleCount + count ) <= 0 ) ret = -1;
+	}
+
+	__sync_lock_release( mArgs.mIsSpawning );
+
+	uint64_t value = 1;
+	write( mArgs.mRefillfd, &value, sizeof( value ) );
+
+	return ret;
+}
+
+void SP_ProcInetKeeper :: run()
+{
+	SP_ProcPool * procPool = mArgs.mProcPool;
+
+	int epfd = epoll_create( 16 );
+	assert( epfd >= 0 );
+
+	struct epoll_event event;
+	memset( &event, 0, sizeof( event ) );
+	event.events = EPOLLIN;
+
+	event.data.fd = mArgs.mStopfd;
+	if( 0 != epoll_ctl( epfd, EPOLL_CTL_ADD, mArgs.mStopfd, &event ) ) {
+		syslog( LOG_WARNING, "WARN: epoll_ctl fail, errno %d, %s", errno, strerror( errno ) );
+	}
+
+	event.data.fd = mArgs.mTopUpfd;
+	if( 0 != epoll_ctl( epfd, EPOLL_CTL_ADD, mArgs.mTopUpfd, &event ) ) {
+		syslog( LOG_WARNING, "WARN: epoll_ctl fail, errno %d, %s", errno, strerror( errno ) );
+	}
+
+	// the idle processes which have exited are removed at once
+	if( procPool->getExitFd() >= 0 ) {
+		event.data.fd = procPool->getExitFd();
+		if( 0 != epoll_ctl( epfd, EPOLL_CTL_ADD, procPool->getExitFd(), &event ) ) {
+			syslog( LOG_WARNING, "WARN: watch exit fd fail, errno %d, %s", errno, strerror( errno ) );
+		} else {
+			procPool->setExitWatched( 1 );
+		}
+	}
+
+	struct epoll_event events[ 4 ];
+
+	// the pool could not be topped up, fork again after retryTime
+	time_t retryTime = 0;
+
+	for( ; 0 == * mArgs.mIsStop; ) {
+		int nevents = epoll_wait( epfd, events, 4, retryTime > 0 ? RETRY_SECONDS * 1000 : -1 );
+		if( nevents < 0 && EINTR != errno ) {
+			syslog( LOG_WARNING, "WARN: epoll_wait fail, errno %d, %s", errno, strerror( errno ) );
+		}
+
+		for( int i = 0; i < nevents; i++ ) {
+			if( events[i].data.fd == mArgs.mTopUpfd ) {
+				uint64_t value = 0;
+				read( mArgs.mTopUpfd, &value, sizeof( value ) );
+			} else if( events[i].data.fd == procPool->getExitFd() ) {
+				procPool->reapExited();
+			}
+		}
+
+		if( 0 != * mArgs.mIsStop ) break;
+
+		struct timespec now;
+		clock_gettime( CLOCK_MONOTONIC, &now );
+		if( retryTime > now.tv_sec ) continue;
+
+		retryTime = 0 == topUp() ? 0 : now.tv_sec + RETRY_SECONDS;
+	}
+
+	// the signal which stops the server may have been caught by this thread,
+	// wake up the acceptors
+	uint64_t value = 1;
+	write( mArgs.mStopfd, &value, sizeof( value ) );
+
+	procPool->setExitWatched( 0 );
+
+	close( epfd );
 }
 
 //-------------------------------------------------------------------
@@ -113,12 +711,42 @@ SP_ProcInetServer :: SP_ProcInetServer( const char * bindIP, int port,
 			SP_ProcInetServiceFactory * factory )
 	: SP_ProcBaseServer( bindIP, port, factory )
 {
+	mAcceptBatch = 1;
+	mPeekSize = 0;
+	mQueueDepth = 1;
+	mAcceptThreads = 1;
 }
 
 SP_ProcInetServer :: ~SP_ProcInetServer()
 {
 }
 
+void SP_ProcInetServer :: setAcceptBatch( int acceptBatch )
+{
+	if( acceptBatch < 1 ) acceptBatch = 1;
+	if( acceptBatch > SP_ProcPduUtils::MAX_PASS_FDS ) acceptBatch = SP_ProcPduUtils::MAX_PASS_FDS;
+
+	mAcceptBatch = acceptBatch;
+}
+
+void SP_ProcInetServer :: setPeekSize( int peekSize )
+{
+	if( peekSize < 0 ) peekSize = 0;
+	if( peekSize > SP_ProcFdMeta_t::MAX_HEAD ) peekSize = SP_ProcFdMeta_t::MAX_HEAD;
+
+	mPeekSize = peekSize;
+}
+
+void SP_ProcInetServer :: setQueueDepth( int queueDepth )
+{
+	mQueueDepth = queueDepth > 0 ? queueDepth : 1;
+}
+
+void SP_ProcInetServer :: setAcceptThreads( int acceptThreads )
+{
+	mAcceptThreads = acceptThreads > 0 ? acceptThreads : 1;
+}
+
 int SP_ProcInetServer :: start()
 {
 	/* Don't die with SIGPIPE on remote read shutdown. That's dumb. */
@@ -126,89 +754,112 @@ int SP_ProcInetServer :: start()
 
 	int listenfd = -1;
 	assert( 0 == SP_ProcPduUtils::tcp_listen( mBindIP, mPort, &listenfd ) );
+	if( 0 != fcntl( listenfd, F_SETFL, fcntl( listenfd, F_GETFL ) | O_NONBLOCK ) ) {
+		syslog( LOG_WARNING, "WARN: set listen fd non-blocking fail, errno %d, %s", errno, strerror( errno ) );
+	}
 
 	SP_ProcManager procManager( new SP_ProcWorkerFactoryInetAdapter( mFactory ) );
+	procManager.setZygote( mIsZygote );
 	procManager.start();
 	SP_ProcPool * procPool = procManager.getProcPool();
 
 	procPool->setMaxRequestsPerProc( mMaxRequestsPerProc );
 	procPool->setMaxIdleProc( mArgs->mMaxIdleProc );
+	procPool->setMemLimit( mMemLimit );
+	procPool->setIdleTimeout( mIdleTimeout, mArgs->mMinIdleProc );
 	procPool->ensureIdleProc( mArgs->mMinIdleProc );
 
-	SP_ProcInfoList busyList;
+	int stopfd = eventfd( 0, EFD_NONBLOCK );
+	assert( stopfd >= 0 );
 
-	mIsStop = 0;
+	int kickfd = eventfd( 0, EFD_NONBLOCK );
+	assert( kickfd >= 0 );
 
-	for ( ; 0 == mIsStop; ) {
-		fd_set rset;
-		FD_ZERO( &rset );
+	int topUpfd = eventfd( 0, EFD_NONBLOCK );
+	assert( topUpfd >= 0 );
 
-		FD_SET( listenfd, &rset );
-		int maxfd = listenfd;
+	int refillfd = eventfd( 0, EFD_NONBLOCK );
+	assert( refillfd >= 0 );
 
-		for( int i = 0; i < busyList.getCount(); i++ ) {
-			const SP_ProcInfo * iter = busyList.getItem( i );
-			FD_SET( iter->getPipeFd(), &rset );
-			maxfd = maxfd > iter->getPipeFd() ? maxfd : iter->getPipeFd();
-		}
+	int threads = mAcceptThreads;
+	if( threads > mArgs->mMaxProc ) threads = mArgs->mMaxProc;
+	if( threads < 1 ) threads = 1;
 
-		if( busyList.getCount() >= mArgs->mMaxProc ) FD_CLR( listenfd, &rset );
+	int busyTotal = 0, isTopUpPending = 0, isSpawning = 0;
 
-		int nsel = 0;
+	SP_ProcInetAcceptor ** acceptors = (SP_ProcInetAcceptor**)malloc( sizeof( void * ) * threads );
+	pthread_t * threadIds = (pthread_t*)malloc( sizeof( pthread_t ) * threads );
 
-		for( ; 0 == mIsStop && nsel <= 0; ) {
-			nsel = select( maxfd + 1, &rset, NULL, NULL, NULL );
-		}
+	mIsStop = 0;
 
-		/* check for new connections */
-		if( FD_ISSET( listenfd, &rset ) && busyList.getCount() < mArgs->mMaxProc ) {
-			SP_ProcInfo * info = procPool->get();
-
-			if( NULL != info ) {
-				struct sockaddr_in clientAddr;
-				socklen_t clientLen = sizeof( clientAddr );
-				int clientFd = accept( listenfd, (struct sockaddr *)&clientAddr, &clientLen );
-
-				if( clientFd >= 0 ) {
-					if( 0 == SP_ProcPduUtils::send_fd( info->getPipeFd(), clientFd ) ) {
-						busyList.append( info );
-					} else {
-						procPool->erase( info );
-					}
-					close( clientFd );
-				} else {
-					procPool->save( info );
-				}
-			}
+	for( int i = 0; i < threads; i++ ) {
+		SP_ProcAcceptorArgs_t args;
+		memset( &args, 0, sizeof( args ) );
+		args.mListenfd = listenfd;
+		args.mStopfd = stopfd;
+		args.mKickfd = kickfd;
+		args.mTopUpfd = topUpfd;
+		args.mRefillfd = refillfd;
+		args.mProcPool = procPool;
+		args.mIsStop = &mIsStop;
+
+		// the workers are shared out among the acceptors
+		args.mMaxProc = mArgs->mMaxProc / threads + ( i < mArgs->mMaxProc % threads ? 1 : 0 );
+		args.mTotalMaxProc = mArgs->mMaxProc;
+		args.mBusyTotal = &busyTotal;
+		args.mIsTopUpPending = &isTopUpPending;
+		args.mIsSpawning = &isSpawning;
+		args.mMinIdleProc = mArgs->mMinIdleProc;
+		args.mMaxRequestsPerProc = mMaxRequestsPerProc;
+		args.mAcceptBatch = mAcceptBatch;
+		args.mPeekSize = mPeekSize;
+		args.mQueueDepth = mQueueDepth;
+
+		acceptors[i] = new SP_ProcInetAcceptor( &args );
+	}
 
-			if (--nsel == 0) continue;	/* all done with select() results */
-		}
+	// the acceptors share their args with the keeper
+	SP_ProcAcceptorArgs_t keeperArgs;
+	memset( &keeperArgs, 0, sizeof( keeperArgs ) );
+	keeperArgs.mStopfd = stopfd;
+	keeperArgs.mTopUpfd = topUpfd;
+	keeperArgs.mRefillfd = refillfd;
+	keeperArgs.mProcPool = procPool;
+	keeperArgs.mIsStop = &mIsStop;
+	keeperArgs.mTotalMaxProc = mArgs->mMaxProc;
+	keeperArgs.mMinIdleProc = mArgs->mMinIdleProc;
+	keeperArgs.mBusyTotal = &busyTotal;
+	keeperArgs.mIsTopUpPending = &isTopUpPending;
+	keeperArgs.mIsSpawning = &isSpawning;
+
+	SP_ProcInetKeeper keeper( &keeperArgs );
+	pthread_t keeperId;
+	int ret = pthread_create( &keeperId, NULL, SP_ProcInetKeeper::runThread, &keeper );
+	assert( 0 == ret );
+
+	// the first one runs in this thread
+	for( int i = 1; i < threads; i++ ) {
+		ret = pthread_create( &( threadIds[i] ), NULL,
+				SP_ProcInetAcceptor::runThread, acceptors[i] );
+		assert( 0 == ret );
+	}
 
-		/* find any newly-available children */
-		for( int i = busyList.getCount() - 1; i >= 0; i-- ) {
-			const SP_ProcInfo * iter = busyList.getItem( i );
-			if( FD_ISSET( iter->getPipeFd(), &rset ) ) {
-				SP_ProcInfo * info = busyList.takeItem( i );
-
-				SP_ProcPdu_t pdu;
-				if( SP_ProcPduUtils::read_pdu( iter->getPipeFd(), &pdu, NULL ) > 0 ) {
-					assert( info->getPid() == pdu.mSrcPid );
-					procPool->save( info );
-				} else {
-					procPool->erase( info );
-				}
+	acceptors[0]->run();
 
-				if (--nsel == 0) break;	/* all done with select() results */
-			}
-		}
+	for( int i = 1; i < threads; i++ ) pthread_join( threadIds[i], NULL );
 
-		int idleCount = procPool->getIdleCount();
-		int totalCount = idleCount + busyList.getCount();
-		if( ( idleCount < mArgs->mMinIdleProc ) && ( totalCount < mArgs->mMaxProc ) ) {
-			procPool->ensureIdleProc( procPool->getIdleCount() + 1 );
-		}
-	}
+	// whichever thread sees the stop first writes the stopfd, which wakes up the others
+	pthread_join( keeperId, NULL );
+
+	for( int i = 0; i < threads; i++ ) delete acceptors[i];
+
+	free( acceptors );
+	free( threadIds );
 
+	close( refillfd );
+	close( topUpfd );
+	close( kickfd );
+	close( stopfd );
 	close( listenfd );
 
 	return 0;
@@ -14,7 +14,31 @@ public:
 			SP_ProcInetServiceFactory * factory );
 	virtual ~SP_ProcInetServer();
 
+	// connections passed to a worker in one message, default is 1,
+	// at most SP_ProcPduUtils::MAX_PASS_FDS. The worker serves them one
+	// by one, so a batch only suits short connections
+	void setAcceptBatch( int acceptBatch );
+
+	// bytes peeked from a new connection into SP_ProcFdMeta_t::mHead,
+	// default is 0, at most SP_ProcFdMeta_t::MAX_HEAD
+	void setPeekSize( int peekSize );
+
+	// messages of connections outstanding on one worker, default is 1.
+	// A busy worker gets the next one before it finishes the current one,
+	// idle workers are still preferred
+	void setQueueDepth( int queueDepth );
+
+	// threads which accept and pass connections, each one has its own
+	// epoll set and its share of MaxProc, default is 1
+	void setAcceptThreads( int acceptThreads );
+
 	virtual int start();
+
+private:
+	int mAcceptBatch;
+	int mPeekSize;
+	int mQueueDepth;
+	int mAcceptThreads;
 };
 
 #endif
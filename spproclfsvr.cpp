@@ -15,6 +15,7 @@
 #include <stdlib.h>
 
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 
 #include "spproclfsvr.hpp"
@@ -24,6 +25,8 @@
 #include "spprocpool.hpp"
 #include "spprocpdu.hpp"
 #include "spproclock.hpp"
+#include "spprocscoreboard.hpp"
+#include "spprocmem.hpp"
 
 class SP_ProcWorkerLFAdapter : public SP_ProcWorker {
 public:
@@ -32,16 +35,33 @@ public:
 
 	void setMaxRequestsPerProc( int maxRequestsPerProc );
 
+	void setMemLimit( const SP_ProcMemLimit_t * memLimit );
+
 	virtual void process( SP_ProcInfo * procInfo );
 
 	void setAcceptLock( SP_ProcLock * lock );
 
+	void setScoreboard( SP_ProcScoreboard * scoreboard );
+
+	// see SP_ProcBaseServer::setAcceptMode, reusePortfds is indexed by the slot
+	void setAcceptMode( int acceptMode, const int * reusePortfds, int reusePortCount );
+
+	void setZygote( int isZygote );
+
 private:
 	int mListenfd, mPodfd;
 	SP_ProcInetServiceFactory * mFactory;
 	SP_ProcLock * mLock;
+	SP_ProcScoreboard * mScoreboard;
+	int mIsZygote;
+
+	int mAcceptMode;
+	// not owned, the factory keeps them
+	const int * mReusePortfds;
+	int mReusePortCount;
 
 	int mMaxRequestsPerProc;
+	SP_ProcMemLimit_t mMemLimit;
 };
 
 SP_ProcWorkerLFAdapter :: SP_ProcWorkerLFAdapter( int listenfd, int podfd, SP_ProcInetServiceFactory * factory )
@@ -50,8 +70,15 @@ SP_ProcWorkerLFAdapter :: SP_ProcWorkerLFAdapter( int listenfd, int podfd, SP_Pr
 	mPodfd = podfd;
 	mFactory = factory;
 	mLock = NULL;
+	mScoreboard = NULL;
+	mIsZygote = 0;
+
+	mAcceptMode = SP_ProcBaseServer::eAcceptShared;
+	mReusePortfds = NULL;
+	mReusePortCount = 0;
 
 	mMaxRequestsPerProc = 0;
+	memset( &mMemLimit, 0, sizeof( mMemLimit ) );
 }
 
 SP_ProcWorkerLFAdapter :: ~SP_ProcWorkerLFAdapter()
@@ -65,49 +92,136 @@ void SP_ProcWorkerLFAdapter :: setMaxRequestsPerProc( int maxRequestsPerProc )
 	mMaxRequestsPerProc = maxRequestsPerProc;
 }
 
+void SP_ProcWorkerLFAdapter :: setMemLimit( const SP_ProcMemLimit_t * memLimit )
+{
+	mMemLimit = * memLimit;
+}
+
 void SP_ProcWorkerLFAdapter :: setAcceptLock( SP_ProcLock * lock )
 {
 	mLock = lock;
 }
 
+void SP_ProcWorkerLFAdapter :: setScoreboard( SP_ProcScoreboard * scoreboard )
+{
+	mScoreboard = scoreboard;
+}
+
+void SP_ProcWorkerLFAdapter :: setAcceptMode( int acceptMode, const int * reusePortfds, int reusePortCount )
+{
+	mAcceptMode = acceptMode;
+
+	mReusePortfds = reusePortfds;
+	mReusePortCount = reusePortCount;
+}
+
+void SP_ProcWorkerLFAdapter :: setZygote( int isZygote )
+{
+	mIsZygote = isZygote;
+}
+
 void SP_ProcWorkerLFAdapter :: process( SP_ProcInfo * procInfo )
 {
-	mFactory->workerInit( procInfo );
+	// the parent tells us which scoreboard slot we own
+	int slot = -1;
+	if( (ssize_t)sizeof( slot ) == SP_ProcPduUtils::readn( procInfo->getPipeFd(), &slot, sizeof( slot ) ) ) {
+		procInfo->setSlot( slot );
+	} else {
+		syslog( LOG_WARNING, "WARN: read slot fail, errno %d, %s", errno, strerror( errno ) );
+	}
+
+	if( ! mIsZygote ) mFactory->workerInit( procInfo );
 
 	int flags = 0;
 	assert( ( flags = fcntl( mPodfd, F_GETFL, 0 ) ) >= 0 );
 	flags |= O_NONBLOCK;
 	assert( fcntl( mPodfd, F_SETFL, flags ) >= 0 );
 
+	int listenfd = mListenfd;
+	SP_ProcLock * lock = mLock;
+
+	// the socket of our slot, the kernel balances the connections
+	if( SP_ProcBaseServer::eAcceptReusePort == mAcceptMode ) {
+		lock = NULL;
+		listenfd = -1;
+		if( procInfo->getSlot() >= 0 && procInfo->getSlot() < mReusePortCount ) {
+			listenfd = mReusePortfds[ procInfo->getSlot() ];
+		} else {
+			syslog( LOG_WARNING, "WARN: no reuseport socket for slot %d", procInfo->getSlot() );
+		}
+	}
+
+	// the listen socket is non-blocking, the worker waits on it together
+	// with the pods, only one waiting worker is woken up for a connection
+	// on the shared socket, the pods wake up all of them
+	int epfd = -1;
+	if( SP_ProcBaseServer::eAcceptShared != mAcceptMode && listenfd >= 0 ) {
+		lock = NULL;
+
+		epfd = epoll_create( 2 );
+		assert( epfd >= 0 );
+
+		struct epoll_event event;
+		memset( &event, 0, sizeof( event ) );
+		event.events = EPOLLIN;
+		if( SP_ProcBaseServer::eAcceptExclusive == mAcceptMode ) event.events |= EPOLLEXCLUSIVE;
+		if( 0 != epoll_ctl( epfd, EPOLL_CTL_ADD, listenfd, &event ) ) {
+			syslog( LOG_WARNING, "WARN: epoll_ctl fail, errno %d, %s", errno, strerror( errno ) );
+		}
+
+		event.events = EPOLLIN;
+		if( 0 != epoll_ctl( epfd, EPOLL_CTL_ADD, mPodfd, &event ) ) {
+			syslog( LOG_WARNING, "WARN: epoll_ctl fail, errno %d, %s", errno, strerror( errno ) );
+		}
+	}
+
+	// count the acquisitions of this worker in the stats of its slot
+	SP_ProcSlotStats_t * stats = mScoreboard->getStats( procInfo->getSlot() );
+	if( NULL != lock && NULL != stats ) lock->setStats( &( stats->mLockStats ) );
+
+	// the parent reads the memory report of the worker from there
+	SP_ProcMemInfo_t * memInfo = NULL != stats ? &( stats->mMemInfo ) : procInfo->getMemInfo();
+
 	for( ; ( 0 == mMaxRequestsPerProc )
 			|| ( mMaxRequestsPerProc > 0 && procInfo->getRequests() < mMaxRequestsPerProc ); ) {
 
 		struct sockaddr_in clientAddr;
 		socklen_t clientLen = sizeof( clientAddr );
 
-		if( NULL != mLock ) assert( 0 == mLock->lock() );
+		if( NULL != lock ) assert( 0 == lock->lock() );
 
-		int fd = accept( mListenfd, (struct sockaddr *)&clientAddr, &clientLen );
+		int fd = accept( listenfd, (struct sockaddr *)&clientAddr, &clientLen );
 
-		if( NULL != mLock ) assert( 0 == mLock->unlock() );
+		if( NULL != lock ) assert( 0 == lock->unlock() );
 
-		if( fd >= 0 ) {
-			assert( write( procInfo->getPipeFd(), &SP_ProcInfo::CHAR_BUSY, 1 ) > 0 );
+		if( fd < 0 && epfd >= 0 && ( EAGAIN == errno || EWOULDBLOCK == errno ) ) {
+			// the accept queue is empty
+			struct epoll_event event;
+			epoll_wait( epfd, &event, 1, -1 );
+		} else if( fd >= 0 ) {
+			mScoreboard->setBusy( procInfo->getSlot() );
 
 			SP_ProcInetService * service = mFactory->create();
 			service->handle( fd );
 			close( fd );
 			delete service;
 
-			assert( write( procInfo->getPipeFd(), &SP_ProcInfo::CHAR_IDLE, 1 ) > 0 );
+			mScoreboard->setIdle( procInfo->getSlot() );
 
 			procInfo->setRequests( procInfo->getRequests() + 1 );
+
+			// recycled as if MaxRequestsPerProc is reached
+			if( SP_ProcMemUtils::isOverLimit( getpid(), procInfo->getRequests(),
+					&mMemLimit, memInfo ) ) {
+				break;
+			}
 		} else {
 			syslog( LOG_WARNING, "WARN: accept fail, errno %d, %s", errno, strerror( errno ) );
 
 			if( errno == EWOULDBLOCK || errno == ECONNABORTED || errno == EPROTO || errno == EINTR ) {
 				// ignore these errno
 			} else {
+				mScoreboard->setExit( procInfo->getSlot() );
 				assert( write( procInfo->getPipeFd(), &SP_ProcInfo::CHAR_EXIT, 1 ) > 0 );
 				break;
 			}
@@ -115,11 +229,16 @@ void SP_ProcWorkerLFAdapter :: process( SP_ProcInfo * procInfo )
 
 		char pod = 0;
 		if( read( mPodfd, &pod, 1 ) > 0 ) {
+			mScoreboard->setExit( procInfo->getSlot() );
 			assert( write( procInfo->getPipeFd(), &SP_ProcInfo::CHAR_EXIT, 1 ) > 0 );
 			break;
 		}
 	}
 
+	mScoreboard->setExit( procInfo->getSlot() );
+
+	if( epfd >= 0 ) close( epfd );
+
 	procInfo->setLastActiveTime( time( NULL ) );
 
 	mFactory->workerEnd( procInfo );
@@ -134,16 +253,32 @@ public:
 
 	void setMaxRequestsPerProc( int maxRequestsPerProc );
 
+	void setMemLimit( const SP_ProcMemLimit_t * memLimit );
+
 	void setAcceptLock( SP_ProcLock * lock );
 
+	void setScoreboard( SP_ProcScoreboard * scoreboard );
+
+	// see SP_ProcBaseServer::setAcceptMode, reusePortfds is indexed by the slot
+	void setAcceptMode( int acceptMode, const int * reusePortfds, int reusePortCount );
+
 	virtual SP_ProcWorker * create() const;
 
+	virtual void zygoteInit();
+
 private:
 	int mListenfd, mPodfd;
 	SP_ProcInetServiceFactory * mFactory;
 	SP_ProcLock * mLock;
+	SP_ProcScoreboard * mScoreboard;
+	int mIsZygote;
+
+	int mAcceptMode;
+	int * mReusePortfds;
+	int mReusePortCount;
 
 	int mMaxRequestsPerProc;
+	SP_ProcMemLimit_t mMemLimit;
 };
 
 SP_ProcWorkerFactoryLFAdapter :: SP_ProcWorkerFactoryLFAdapter(
@@ -153,14 +288,24 @@ SP_ProcWorkerFactoryLFAdapter :: SP_ProcWorkerFactoryLFAdapter(
 	mPodfd = podfd;
 	mFactory = factory;
 	mLock = NULL;
+	mScoreboard = NULL;
+	mIsZygote = 0;
+
+	mAcceptMode = SP_ProcBaseServer::eAcceptShared;
+	mReusePortfds = NULL;
+	mReusePortCount = 0;
 
 	mMaxRequestsPerProc = 0;
+	memset( &mMemLimit, 0, sizeof( mMemLimit ) );
 }
 
 SP_ProcWorkerFactoryLFAdapter :: ~SP_ProcWorkerFactoryLFAdapter()
 {
 	delete mFactory;
 	mFactory = NULL;
+
+	free( mReusePortfds );
+	mReusePortfds = NULL;
 }
 
 void SP_ProcWorkerFactoryLFAdapter :: setMaxRequestsPerProc( int maxRequestsPerProc )
@@ -168,20 +313,60 @@ void SP_ProcWorkerFactoryLFAdapter :: setMaxRequestsPerProc( int maxRequestsPerP
 	mMaxRequestsPerProc = maxRequestsPerProc;
 }
 
+void SP_ProcWorkerFactoryLFAdapter :: setMemLimit( const SP_ProcMemLimit_t * memLimit )
+{
+	mMemLimit = * memLimit;
+}
+
 void SP_ProcWorkerFactoryLFAdapter :: setAcceptLock( SP_ProcLock * lock )
 {
 	mLock = lock;
 }
 
+void SP_ProcWorkerFactoryLFAdapter :: setScoreboard( SP_ProcScoreboard * scoreboard )
+{
+	mScoreboard = scoreboard;
+}
+
+void SP_ProcWorkerFactoryLFAdapter :: setAcceptMode( int acceptMode, const int * reusePortfds, int reusePortCount )
+{
+	mAcceptMode = acceptMode;
+
+	free( mReusePortfds );
+	mReusePortfds = NULL;
+	mReusePortCount = 0;
+
+	if( reusePortCount > 0 ) {
+		mReusePortfds = (int*)malloc( sizeof( int ) * reusePortCount );
+		assert( NULL != mReusePortfds );
+		memcpy( mReusePortfds, reusePortfds, sizeof( int ) * reusePortCount );
+		mReusePortCount = reusePortCount;
+	}
+}
+
 SP_ProcWorker * SP_ProcWorkerFactoryLFAdapter :: create() const
 {
 	SP_ProcWorkerLFAdapter * worker = new SP_ProcWorkerLFAdapter( mListenfd, mPodfd, mFactory );
 	worker->setMaxRequestsPerProc( mMaxRequestsPerProc );
+	worker->setMemLimit( &mMemLimit );
 	worker->setAcceptLock( mLock );
+	worker->setScoreboard( mScoreboard );
+	worker->setAcceptMode( mAcceptMode, mReusePortfds, mReusePortCount );
+	worker->setZygote( mIsZygote );
 
 	return worker;
 }
 
+void SP_ProcWorkerFactoryLFAdapter :: zygoteInit()
+{
+	SP_ProcInfo procInfo( -1 );
+	procInfo.setPid( getpid() );
+
+	mFactory->workerInit( &procInfo );
+
+	mIsZygote = 1;
+}
+
 //-------------------------------------------------------------------
 
 SP_ProcLFServer :: SP_ProcLFServer( const char * bindIP, int port,
@@ -210,110 +395,60 @@ int SP_ProcLFServer :: start()
 	assert( 0 == pipe( podfds ) );
 
 	int listenfd = -1;
-	assert( 0 == SP_ProcPduUtils::tcp_listen( mBindIP, mPort, &listenfd ) );
+	int * reusePortfds = NULL, reusePortCount = 0;
+
+	// a socket per slot, opened before the process manager is forked, so the
+	// sockets and their accept queues stay while the workers come and go
+	if( eAcceptReusePort == mAcceptMode ) {
+		reusePortCount = mArgs->mMaxProc;
+		reusePortfds = (int*)malloc( sizeof( int ) * reusePortCount );
+		assert( NULL != reusePortfds );
+		int ret = listenReusePort( reusePortfds, reusePortCount );
+		assert( 0 == ret );
+	} else {
+		assert( 0 == SP_ProcPduUtils::tcp_listen( mBindIP, mPort, &listenfd ) );
+	}
+
+	if( eAcceptExclusive == mAcceptMode ) {
+		if( 0 != fcntl( listenfd, F_SETFL, fcntl( listenfd, F_GETFL ) | O_NONBLOCK ) ) {
+			syslog( LOG_WARNING, "WARN: set listen fd non-blocking fail, errno %d, %s", errno, strerror( errno ) );
+		}
+	}
+
+	SP_ProcScoreboard scoreboard( mArgs->mMaxProc );
+	int ret = scoreboard.init();
+	assert( 0 == ret );
+
+	// the pool is kept full for the reuseport sockets, see supervise
+	if( eAcceptReusePort == mAcceptMode ) {
+		scoreboard.setIdleRange( 0, mArgs->mMaxProc );
+	} else {
+		scoreboard.setIdleRange( mArgs->mMinIdleProc, mArgs->mMaxIdleProc );
+	}
 
 	SP_ProcWorkerFactoryLFAdapter * factory =
 			new SP_ProcWorkerFactoryLFAdapter( listenfd, podfds[0], mFactory );
 	factory->setMaxRequestsPerProc( mMaxRequestsPerProc );
+	factory->setMemLimit( mMemLimit );
 	factory->setAcceptLock( mLock );
+	factory->setScoreboard( &scoreboard );
+	factory->setAcceptMode( mAcceptMode, reusePortfds, reusePortCount );
 
 	SP_ProcManager procManager( factory );
+	procManager.setZygote( mIsZygote );
 	procManager.start();
 	SP_ProcPool * procPool = procManager.getProcPool();
 
+	// the process manager holds the listen sockets from now on
 	close( podfds[0] );
-	close( listenfd );
-
-	SP_ProcInfoList procList;
-
-	for( int i = 0; i < mArgs->mMinIdleProc; i++ ) {
-		SP_ProcInfo * info = procPool->get();
-		if( NULL != info ) {
-			procList.append( info );
-		} else {
-			syslog( LOG_WARNING, "WARN: Create proc fail, only %d idle proc",
-					procList.getCount() );
-			break;
-		}
-	}
-
-	int idleCount = procList.getCount();
-
-	mIsStop = 0;
-
-	for( ; 0 == mIsStop ; ) {
-		fd_set rset;
-		FD_ZERO( &rset );
-
-		int maxfd = 0;
+	if( listenfd >= 0 ) close( listenfd );
+	for( int i = 0; i < reusePortCount; i++ ) close( reusePortfds[i] );
+	free( reusePortfds );
 
-		for( int i = 0; i < procList.getCount(); i++ ) {
-			const SP_ProcInfo * iter = procList.getItem( i );
-			FD_SET( iter->getPipeFd(), &rset );
-			maxfd = maxfd > iter->getPipeFd() ? maxfd : iter->getPipeFd();
-		}
-
-		int nsel = select( maxfd + 1, &rset, NULL, NULL, NULL );
-
-		/* find out the child is busy/idle/exit */
-		for( int i = procList.getCount() - 1; i >= 0; i-- ) {
-			SP_ProcInfo * iter = procList.getItem( i );
-
-			if( FD_ISSET( iter->getPipeFd(), &rset ) ) {
-				int isProcExit = 0;
-
-				char buff[ 128 ] = { 0 };
-				int len = recv( iter->getPipeFd(), buff, sizeof( buff ), MSG_DONTWAIT );
-				if( len > 0 ) {
-					iter->setRequests( iter->getRequests() + len );
-					if( SP_ProcInfo::CHAR_IDLE == buff[ len - 1 ] ) {
-						if( ! iter->isIdle() ) idleCount++;
-						iter->setIdle( 1 );
-					} else if( SP_ProcInfo::CHAR_BUSY == buff[ len - 1 ] ) {
-						if( iter->isIdle() ) idleCount--;
-						iter->setIdle( 0 );
-					} else {
-						isProcExit = 1;
-					}
-				} else if( 0 == len ) {
-					isProcExit = 1;
-				}
-
-				if( isProcExit ) {
-					syslog( LOG_INFO, "INFO: proc #%u exit", iter->getPid() );
-					if( iter->isIdle() ) idleCount--;
-					iter = procList.takeItem( i );
-					procPool->erase( iter );
-				}
-				if (--nsel == 0) break;	/* all done with select() results */
-			}
-		}
+	supervise( procPool, &scoreboard, podfds[1],
+			eAcceptShared == mAcceptMode ? mLock : NULL );
 
-		if( idleCount > mArgs->mMaxIdleProc ) {
-			assert( write( podfds[1], &SP_ProcInfo::CHAR_EXIT, 1 ) > 0 );
-			syslog( LOG_INFO, "INFO: idle.count %d, max.idle %d, send a pod",
-					idleCount, mArgs->mMaxIdleProc );
-
-			for( int i = 0; i < procList.getCount(); i++ ) {
-				SP_ProcInfo * iter = procList.getItem( i );
-				if( iter->isIdle() ) {
-					iter->setIdle( 0 );
-					idleCount--;
-					break;
-				}
-			}
-		}
-
-		if( idleCount < mArgs->mMinIdleProc && procList.getCount() < mArgs->mMaxProc ) {
-			SP_ProcInfo * info = procPool->get();
-			if( NULL != info ) {
-				idleCount++;
-				procList.append( info );
-			} else {
-				syslog( LOG_WARNING, "WARN: Create proc fail, only %d idle proc", idleCount );
-			}
-		}
-	}
+	close( podfds[1] );
 
 	return 0;
 }
@@ -14,13 +14,84 @@
 #include <syslog.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
 #include "spproclock.hpp"
 
+#include "spprocshm.hpp"
+
+SP_ProcLock :: SP_ProcLock()
+{
+	mStats = NULL;
+	mIsStatsEnabled = 0;
+}
+
 SP_ProcLock :: ~SP_ProcLock()
 {
 }
 
+pid_t SP_ProcLock :: getOwner()
+{
+	return 0;
+}
+
+int SP_ProcLock :: getRecoverCount()
+{
+	return 0;
+}
+
+void SP_ProcLock :: setStatsEnabled( int isStatsEnabled )
+{
+	mIsStatsEnabled = isStatsEnabled;
+}
+
+int SP_ProcLock :: isStatsEnabled() const
+{
+	return mIsStatsEnabled;
+}
+
+void SP_ProcLock :: setStats( SP_ProcLockStats_t * stats )
+{
+	mStats = mIsStatsEnabled ? stats : NULL;
+}
+
+void SP_ProcLock :: addStats( SP_ProcLockStats_t * total, const SP_ProcLockStats_t * stats )
+{
+	total->mAcquires += stats->mAcquires;
+	total->mContended += stats->mContended;
+	total->mWaitUsec += stats->mWaitUsec;
+
+	for( int i = 0; i < SP_ProcLockStats_t::HIST_BUCKETS; i++ ) {
+		total->mWaitHist[i] += stats->mWaitHist[i];
+	}
+}
+
+void SP_ProcLock :: record( const struct timespec * start )
+{
+	// only the owner of the slot writes it, the parent just reads
+	mStats->mAcquires++;
+
+	if( NULL == start ) return;
+
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+
+	long long usec = ( now.tv_sec - start->tv_sec ) * 1000000LL
+			+ ( now.tv_nsec - start->tv_nsec ) / 1000;
+	if( usec < 0 ) usec = 0;
+
+	mStats->mContended++;
+	mStats->mWaitUsec += usec;
+
+	int bucket = 0;
+	for( long long limit = 1; usec >= limit && bucket < SP_ProcLockStats_t::HIST_BUCKETS - 1; ) {
+		bucket++;
+		limit *= 10;
+	}
+
+	mStats->mWaitHist[ bucket ]++;
+}
+
 //-------------------------------------------------------------------
 
 SP_ProcFileLock :: SP_ProcFileLock()
@@ -47,6 +118,17 @@ int SP_ProcFileLock :: lock()
 
 	int rc = -1;
 
+	struct timespec start;
+
+	if( NULL != mStats ) {
+		if( 0 == fcntl( mFd, F_SETLK, &lock_it ) ) {
+			record( NULL );
+			return 0;
+		}
+
+		clock_gettime( CLOCK_MONOTONIC, &start );
+	}
+
 	while( ( rc = fcntl( mFd, F_SETLKW, &lock_it ) ) < 0 ) {
 		if( errno == EINTR ) {
 			continue;
@@ -55,6 +137,8 @@ int SP_ProcFileLock :: lock()
 		}
 	}
 
+	if( 0 == rc && NULL != mStats ) record( &start );
+
 	return rc;
 }
 
@@ -88,21 +172,20 @@ int SP_ProcFileLock :: init( const char * filePath )
 
 SP_ProcThreadLock :: SP_ProcThreadLock()
 {
-	mMutex = NULL;
+	mShared = NULL;
+	mIsOwnMap = 1;
+	mSpinCount = 0;
 
 #ifdef _POSIX_THREAD_PROCESS_SHARED
 	int fd = open("/dev/zero", O_RDWR, 0);
 	if( fd >= 0 ) {
-		mMutex = (pthread_mutex_t*)mmap( 0, sizeof(pthread_mutex_t),
+		Shared_t * shared = (Shared_t*)mmap( 0, sizeof(Shared_t),
 			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
 		close( fd );
 
-		assert( NULL != mMutex );
+		assert( MAP_FAILED != shared );
 
-		pthread_mutexattr_t mattr;
-		pthread_mutexattr_init( &mattr );
-		assert( 0 == pthread_mutexattr_setpshared( &mattr, PTHREAD_PROCESS_SHARED ) );
-		assert( 0 == pthread_mutex_init( mMutex, &mattr ) );
+		init( shared );
 	} else {
 		syslog( LOG_WARNING, "WARN: open /dev/zero fail, errno %d, %s",
 				errno, strerror( errno ) );
@@ -110,22 +193,87 @@ SP_ProcThreadLock :: SP_ProcThreadLock()
 #endif
 }
 
+SP_ProcThreadLock :: SP_ProcThreadLock( SP_ProcShmArena * arena )
+{
+	mShared = NULL;
+	mIsOwnMap = 0;
+	mSpinCount = 0;
+
+#ifdef _POSIX_THREAD_PROCESS_SHARED
+	Shared_t * shared = arena->allocArray< Shared_t >( 1 );
+	if( NULL != shared ) init( shared );
+#endif
+}
+
 SP_ProcThreadLock :: ~SP_ProcThreadLock()
 {
-	if( NULL != mMutex ) {
-		pthread_mutex_destroy( mMutex );
-		assert( 0 == munmap( mMutex, sizeof( pthread_mutex_t ) ) );
+	if( NULL != mShared ) {
+		pthread_mutex_destroy( &( mShared->mMutex ) );
+		if( mIsOwnMap ) assert( 0 == munmap( mShared, sizeof( Shared_t ) ) );
 	}
 
-	mMutex = NULL;
+	mShared = NULL;
+}
+
+void SP_ProcThreadLock :: init( Shared_t * shared )
+{
+	mShared = shared;
+
+	mShared->mOwner = 0;
+	mShared->mRecoverCount = 0;
+
+	pthread_mutexattr_t mattr;
+	pthread_mutexattr_init( &mattr );
+
+	int ret = pthread_mutexattr_setpshared( &mattr, PTHREAD_PROCESS_SHARED );
+	if( 0 == ret ) ret = pthread_mutexattr_setrobust( &mattr, PTHREAD_MUTEX_ROBUST );
+	if( 0 == ret ) ret = pthread_mutex_init( &( mShared->mMutex ), &mattr );
+	assert( 0 == ret );
+
+	pthread_mutexattr_destroy( &mattr );
 }
 
 int SP_ProcThreadLock :: lock()
 {
 #ifdef _POSIX_THREAD_PROCESS_SHARED
-	if( NULL == mMutex ) return -1;
+	if( NULL == mShared ) return -1;
+
+	int ret = EBUSY;
+
+	struct timespec start, * wait = NULL;
+
+	if( NULL != mStats || mSpinCount > 0 ) {
+		ret = pthread_mutex_trylock( &( mShared->mMutex ) );
+		if( EBUSY == ret && NULL != mStats ) {
+			clock_gettime( CLOCK_MONOTONIC, &start );
+			wait = &start;
+		}
+	}
+
+	for( int i = 0; EBUSY == ret && i < mSpinCount; i++ ) {
+#if defined(__i386__) || defined(__x86_64__)
+		__asm__ __volatile__( "pause" );
+#endif
+		ret = pthread_mutex_trylock( &( mShared->mMutex ) );
+	}
+
+	if( EBUSY == ret ) ret = pthread_mutex_lock( &( mShared->mMutex ) );
+
+	if( EOWNERDEAD == ret ) {
+		syslog( LOG_WARNING, "WARN: process #%d exited with the lock held, recovered by #%d",
+				(int)mShared->mOwner, (int)getpid() );
+
+		ret = pthread_mutex_consistent( &( mShared->mMutex ) );
+		__sync_fetch_and_add( &( mShared->mRecoverCount ), 1 );
+	}
+
+	if( 0 != ret ) {
+		syslog( LOG_WARNING, "WARN: lock fail, errno %d, %s", ret, strerror( ret ) );
+		return -1;
+	}
 
-	return pthread_mutex_lock( mMutex );
+	mShared->mOwner = getpid();
+	if( NULL != mStats ) record( wait );
 #endif
 
 	return 0;
@@ -134,11 +282,33 @@ int SP_ProcThreadLock :: lock()
 int SP_ProcThreadLock :: unlock()
 {
 #ifdef _POSIX_THREAD_PROCESS_SHARED
-	if( NULL == mMutex ) return -1;
+	if( NULL == mShared ) return -1;
+
+	mShared->mOwner = 0;
+
+	int ret = pthread_mutex_unlock( &( mShared->mMutex ) );
 
-	return pthread_mutex_unlock( mMutex );
+	if( 0 != ret ) {
+		syslog( LOG_WARNING, "WARN: unlock fail, errno %d, %s", ret, strerror( ret ) );
+		return -1;
+	}
 #endif
 
 	return 0;
 }
 
+pid_t SP_ProcThreadLock :: getOwner()
+{
+	return NULL != mShared ? mShared->mOwner : 0;
+}
+
+int SP_ProcThreadLock :: getRecoverCount()
+{
+	return NULL != mShared ? mShared->mRecoverCount : 0;
+}
+
+void SP_ProcThreadLock :: setSpinCount( int spinCount )
+{
+	mSpinCount = spinCount > 0 ? spinCount : 0;
+}
+
@@ -7,9 +7,29 @@
 #define __spproclock_hpp__
 
 #include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+
+class SP_ProcShmArena;
+
+/**
+ * Acquisitions of a lock by one worker, kept in the stats of its scoreboard slot.
+ * The wait time of the accept lock also covers the time the owner
+ * waits in accept() for a new connection, so it grows when idle.
+ */
+typedef struct tagSP_ProcLockStats {
+	// < 1us, < 10us, < 100us, < 1ms, < 10ms, < 100ms, < 1s, >= 1s
+	enum { HIST_BUCKETS = 8 };
+
+	volatile unsigned int mAcquires;
+	volatile unsigned int mContended;
+	volatile unsigned long long mWaitUsec;
+	volatile unsigned int mWaitHist[ HIST_BUCKETS ];
+} SP_ProcLockStats_t;
 
 class SP_ProcLock {
 public:
+	SP_ProcLock();
 	virtual ~SP_ProcLock();
 
 	// 0 : OK, -1 : Fail
@@ -17,6 +37,32 @@ public:
 
 	// 0 : OK, -1 : Fail
 	virtual int unlock() = 0;
+
+	// the process which holds the lock, 0 : free or unknown
+	virtual pid_t getOwner();
+
+	// how many times the lock is recovered from an exited owner
+	virtual int getRecoverCount();
+
+	// default is 0, must be set before the workers are forked
+	void setStatsEnabled( int isStatsEnabled );
+
+	int isStatsEnabled() const;
+
+	// worker side, the servers pass the lock stats of the scoreboard slot,
+	// ignored if the stats is not enabled
+	void setStats( SP_ProcLockStats_t * stats );
+
+	static void addStats( SP_ProcLockStats_t * total, const SP_ProcLockStats_t * stats );
+
+protected:
+	SP_ProcLockStats_t * mStats;
+
+	// start : when the lock is found busy, NULL for an uncontended lock
+	void record( const struct timespec * start );
+
+private:
+	int mIsStatsEnabled;
 };
 
 class SP_ProcFileLock : public SP_ProcLock {
@@ -36,17 +82,45 @@ private:
 	int mFd;
 };
 
+/**
+ * A robust process-shared mutex, when the owner exits with the lock
+ * held, the next locker gets EOWNERDEAD, makes the mutex consistent
+ * and carries on. The mutex is a futex word, so lock/unlock make no
+ * syscall when there is no contention.
+ */
 class SP_ProcThreadLock : public SP_ProcLock {
 public:
 	SP_ProcThreadLock();
+
+	// the shared state is allocated from the arena instead of a page of its own
+	SP_ProcThreadLock( SP_ProcShmArena * arena );
+
 	virtual ~SP_ProcThreadLock();
 
 	virtual int lock();
 
 	virtual int unlock();
 
+	virtual pid_t getOwner();
+
+	virtual int getRecoverCount();
+
+	// trylock spinCount times before sleeping in the kernel, default is 0,
+	// worth it on a multi-processor host when the lock is held briefly
+	void setSpinCount( int spinCount );
+
 private:
-	pthread_mutex_t * mMutex;
+	typedef struct tagShared {
+		pthread_mutex_t mMutex;
+		volatile pid_t mOwner;
+		volatile int mRecoverCount;
+	} Shared_t;
+
+	Shared_t * mShared;
+	int mIsOwnMap;
+	int mSpinCount;
+
+	void init( Shared_t * shared );
 };
 
 #endif
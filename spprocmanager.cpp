@@ -10,6 +10,9 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <syslog.h>
 #include <string.h>
 #include <errno.h>
@@ -29,6 +32,10 @@ SP_ProcWorkerFactory :: ~SP_ProcWorkerFactory()
 {
 }
 
+void SP_ProcWorkerFactory :: zygoteInit()
+{
+}
+
 //-------------------------------------------------------------------
 
 SP_ProcManager :: SP_ProcManager( SP_ProcWorkerFactory * factory )
@@ -36,6 +43,7 @@ SP_ProcManager :: SP_ProcManager( SP_ProcWorkerFactory * factory )
 	mFactory = factory;
 
 	mPool = NULL;
+	mIsZygote = 0;
 }
 
 SP_ProcManager :: ~SP_ProcManager()
@@ -47,8 +55,19 @@ SP_ProcManager :: ~SP_ProcManager()
 	mPool = NULL;
 }
 
+// the write end of the self-pipe in the process manager, -1 in the others
+static int gChildPipe = -1;
+
 void SP_ProcManager :: sigchild( int signo )
 {
+	if( gChildPipe >= 0 ) {
+		// the manager reaps them in its loop, see reapChildren
+		int savedErrno = errno;
+		write( gChildPipe, "c", 1 );
+		errno = savedErrno;
+		return;
+	}
+
 	pid_t pid;
 	int stat;
 
@@ -56,28 +75,116 @@ void SP_ProcManager :: sigchild( int signo )
 	}
 }
 
+void SP_ProcManager :: reapChildren( int exitFd )
+{
+	SP_ProcExitPdu_t msg;
+	memset( &msg, 0, sizeof( msg ) );
+	msg.mPdu.mMagicNum = SP_ProcPdu_t::MAGIC_NUM;
+	msg.mPdu.mType = SP_ProcPdu_t::eExit;
+	msg.mPdu.mSrcPid = getpid();
+	msg.mPdu.mDestPid = getppid();
+	msg.mPdu.mDataSize = sizeof( msg.mExit );
+
+	for( ; ; ) {
+		pid_t pid = wait4( -1, &( msg.mExit.mStatus ), WNOHANG, &( msg.mExit.mUsage ) );
+		if( pid <= 0 ) break;
+
+		msg.mExit.mPid = pid;
+
+		// never blocks, the app may not watch the exits
+		if( exitFd >= 0 && send( exitFd, &msg, sizeof( msg ), MSG_DONTWAIT ) < 0 ) {
+			if( EAGAIN == errno || EWOULDBLOCK == errno ) {
+				syslog( LOG_DEBUG, "DEBUG: exit of #%d is dropped, app is not reading", pid );
+			} else {
+				syslog( LOG_WARNING, "WARN: send exit of #%d fail, errno %d, %s",
+						pid, errno, strerror( errno ) );
+			}
+		}
+	}
+}
+
+void SP_ProcManager :: setZygote( int isZygote )
+{
+	mIsZygote = isZygote;
+}
+
 void SP_ProcManager :: start()
 {
 	int pipeFd[ 2 ] = { -1, -1 };
 
+	// the exit pdus, one message each, the workers are still usable without it
+	int exitFd[ 2 ] = { -1, -1 };
+	if( 0 != socketpair( AF_UNIX, SOCK_SEQPACKET, 0, exitFd ) ) {
+		syslog( LOG_WARNING, "WARN: socketpair fail, errno %d, %s", errno, strerror( errno ) );
+		exitFd[0] = exitFd[1] = -1;
+	}
+
 	if( 0 == socketpair( AF_UNIX, SOCK_STREAM, 0, pipeFd ) ) {
 		pid_t pid = fork();
 
 		if( pid > 0 ) {
 			// parent, app process
 			close( pipeFd[1] );
+			if( exitFd[1] >= 0 ) close( exitFd[1] );
 
-			mPool = new SP_ProcPool( pipeFd[0] );
+			mPool = new SP_ProcPool( pipeFd[0], exitFd[0] );
 
 		} else if( 0 == pid ) {
 			// child, process manager
+			close( pipeFd[0] );
+			if( exitFd[0] >= 0 ) close( exitFd[0] );
+
+			// SIGCHLD only wakes up the loop, the exits are reaped by the loop
+			int childPipe[ 2 ] = { -1, -1 };
+			if( 0 == pipe2( childPipe, O_NONBLOCK ) ) {
+				gChildPipe = childPipe[1];
+			} else {
+				syslog( LOG_WARNING, "WARN: pipe fail, errno %d, %s", errno, strerror( errno ) );
+			}
+
 			signal( SIGCHLD, sigchild );
 
-			close( pipeFd[0] );
+			if( mIsZygote ) mFactory->zygoteInit();
 
 			for( ; ; ) {
-				int fd = SP_ProcPduUtils::recv_fd( pipeFd[1] );
-				if( fd >= 0 ) {
+				struct pollfd pfds[ 2 ];
+				pfds[0].fd = pipeFd[1];
+				pfds[0].events = POLLIN;
+				pfds[1].fd = childPipe[0];
+				pfds[1].events = POLLIN;
+
+				if( poll( pfds, childPipe[0] >= 0 ? 2 : 1, -1 ) < 0 ) {
+					if( EINTR != errno ) {
+						syslog( LOG_WARNING, "WARN: poll fail, errno %d, %s", errno, strerror( errno ) );
+					}
+					continue;
+				}
+
+				if( childPipe[0] >= 0 && ( pfds[1].revents & POLLIN ) ) {
+					char buff[ 64 ];
+					for( ; read( childPipe[0], buff, sizeof( buff ) ) > 0; ) ;
+
+					reapChildren( exitFd[1] );
+				}
+
+				if( 0 == pfds[0].revents ) continue;
+
+				// the app may ask for several processes in one message,
+				// reply each of them as soon as it is forked
+				int fds[ SP_ProcPduUtils::MAX_PASS_FDS ];
+				errno = 0;
+				int count = SP_ProcPduUtils::recv_fds( pipeFd[1], fds, SP_ProcPduUtils::MAX_PASS_FDS );
+
+				int isError = 0;
+
+				for( int i = 0; i < count; i++ ) {
+					int fd = fds[i];
+
+					if( isError ) {
+						close( fd );
+						continue;
+					}
+
 					SP_ProcPdu_t pdu;
 					memset( &pdu, 0, sizeof( pdu ) );
 					pdu.mMagicNum = SP_ProcPdu_t::MAGIC_NUM;
@@ -86,6 +193,13 @@ void SP_ProcManager :: start()
 					pid_t workerPid = fork();
 					if( 0 == workerPid ) {
 						// worker, working
+						for( int j = i + 1; j < count; j++ ) close( fds[j] );
+
+						// reap its own children as before
+						gChildPipe = -1;
+						if( childPipe[0] >= 0 ) close( childPipe[0] );
+						if( childPipe[1] >= 0 ) close( childPipe[1] );
+						if( exitFd[1] >= 0 ) close( exitFd[1] );
 
 						SP_ProcInfo * info = new SP_ProcInfo( fd );
 						info->setPid( getpid() );
@@ -106,13 +220,19 @@ void SP_ProcManager :: start()
 						}
 
 						if( SP_ProcPduUtils::send_pdu( pipeFd[1], &pdu, NULL ) < 0 ) {
-							kill( 0, SIGUSR1 );
-							break;
+							isError = 1;
 						}
 
 						close( fd );
 					}
-				} else {
+				}
+
+				if( isError ) {
+					kill( 0, SIGUSR1 );
+					break;
+				}
+
+				if( count <= 0 ) {
 					if( 0 == errno ) {
 						syslog( LOG_INFO, "INFO: proc manager exit" );
 					} else {
@@ -127,6 +247,8 @@ void SP_ProcManager :: start()
 		} else {
 			close( pipeFd[0] );
 			close( pipeFd[1] );
+			if( exitFd[0] >= 0 ) close( exitFd[0] );
+			if( exitFd[1] >= 0 ) close( exitFd[1] );
 
 			perror( "fork fail" );
 			exit( -1 );
@@ -23,6 +23,10 @@ public:
 	virtual ~SP_ProcWorkerFactory();
 
 	virtual SP_ProcWorker * create() const = 0;
+
+	// only called in zygote mode, once in the process manager before
+	// any worker is forked, the workers inherit the state copy-on-write
+	virtual void zygoteInit();
 };
 
 class SP_ProcManager {
@@ -30,6 +34,13 @@ public:
 	SP_ProcManager( SP_ProcWorkerFactory * factory );
 	~SP_ProcManager();
 
+	// default is 0, must be called before start.
+	// Run the worker initialization once in the process manager and fork
+	// every worker from it, threads created by the initialization are not
+	// inherited by the workers.
+	void setZygote( int isZygote );
+
+	// the workers which exit are reported to the pool, see SP_ProcPool::reapExited
 	void start();
 
 	SP_ProcPool * getProcPool();
@@ -37,8 +48,12 @@ public:
 private:
 	SP_ProcPool * mPool;
 	SP_ProcWorkerFactory * mFactory;
+	int mIsZygote;
 
 	static void sigchild( int signo );
+
+	// reap the exited workers, and report them to the app by exitFd
+	static void reapChildren( int exitFd );
 };
 
 #endif
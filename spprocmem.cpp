@@ -0,0 +1,174 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "spprocmem.hpp"
+
+// 0 : OK, -1 : Fail
+static int readFile( const char * path, char * buff, size_t size )
+{
+	int fd = open( path, O_RDONLY | O_CLOEXEC );
+	if( fd < 0 ) return -1;
+
+	size_t len = 0;
+	for( ; len < size - 1; ) {
+		ssize_t ret = ::read( fd, buff + len, size - 1 - len );
+		if( ret < 0 && EINTR == errno ) continue;
+		if( ret <= 0 ) break;
+		len += ret;
+	}
+
+	close( fd );
+
+	buff[ len ] = '\0';
+
+	return len > 0 ? 0 : -1;
+}
+
+int SP_ProcMemUtils :: read( pid_t pid, SP_ProcMemInfo_t * info )
+{
+	char path[ 64 ] = { 0 };
+	char buff[ 2048 ] = { 0 };
+
+	snprintf( path, sizeof( path ), "/proc/%d/smaps_rollup", (int)pid );
+
+	info->mRss = info->mPss = info->mShared = 0;
+	info->mSharedClean = info->mSharedDirty = 0;
+	info->mPrivateClean = info->mPrivateDirty = 0;
+	info->mIsDetailed = 0;
+
+	if( 0 == readFile( path, buff, sizeof( buff ) ) ) {
+		static const struct {
+			const char * mName;
+			size_t mOffset;
+		} fields[] = {
+			{ "Rss:", offsetof( SP_ProcMemInfo_t, mRss ) },
+			{ "Pss:", offsetof( SP_ProcMemInfo_t, mPss ) },
+			{ "Shared_Clean:", offsetof( SP_ProcMemInfo_t, mSharedClean ) },
+			{ "Shared_Dirty:", offsetof( SP_ProcMemInfo_t, mSharedDirty ) },
+			{ "Private_Clean:", offsetof( SP_ProcMemInfo_t, mPrivateClean ) },
+			{ "Private_Dirty:", offsetof( SP_ProcMemInfo_t, mPrivateDirty ) }
+		};
+
+		static const int count = sizeof( fields ) / sizeof( fields[0] );
+
+		// the first line is the range of the rollup
+		for( char * line = strchr( buff, '\n' ); NULL != line; line = strchr( line, '\n' ) ) {
+			line++;
+
+			for( int i = 0; i < count; i++ ) {
+				size_t nameLen = strlen( fields[i].mName );
+				if( 0 == strncmp( line, fields[i].mName, nameLen ) ) {
+					* (unsigned int*)( (char*)info + fields[i].mOffset ) =
+							strtoul( line + nameLen, NULL, 10 );
+					break;
+				}
+			}
+		}
+
+		info->mShared = info->mSharedClean + info->mSharedDirty;
+		info->mIsDetailed = 1;
+
+		return 0;
+	}
+
+	snprintf( path, sizeof( path ), "/proc/%d/statm", (int)pid );
+
+	if( 0 == readFile( path, buff, sizeof( buff ) ) ) {
+		unsigned long size = 0, resident = 0, shared = 0;
+		if( 3 != sscanf( buff, "%lu %lu %lu", &size, &resident, &shared ) ) return -1;
+
+		unsigned long pageKB = sysconf( _SC_PAGESIZE ) / 1024;
+
+		// the shared pages of statm are file backed, dirty or not,
+		// so the split of clean and dirty is unknown
+		info->mRss = resident * pageKB;
+		info->mShared = shared * pageKB;
+
+		return 0;
+	}
+
+	syslog( LOG_WARNING, "WARN: read memory of process #%d fail, errno %d, %s",
+			(int)pid, errno, strerror( errno ) );
+
+	return -1;
+}
+
+int SP_ProcMemUtils :: isEnabled( const SP_ProcMemLimit_t * limit )
+{
+	return limit->mMaxRss > 0 || limit->mMaxPrivateDirty > 0 || limit->mMaxGrowth > 0;
+}
+
+int SP_ProcMemUtils :: isOverLimit( pid_t pid, unsigned int requests,
+		const SP_ProcMemLimit_t * limit, SP_ProcMemInfo_t * info )
+{
+	if( ! isEnabled( limit ) ) return 0;
+
+	unsigned int interval = limit->mCheckInterval > 0 ? limit->mCheckInterval : DEFAULT_CHECK_INTERVAL;
+	if( info->mCheckRequests > 0 && requests - info->mCheckRequests < interval ) return 0;
+
+	if( 0 != read( pid, info ) ) return 0;
+
+	info->mCheckRequests = requests;
+
+	// the first check is the base of the growth
+	if( 0 == info->mBaseRequests && info->mIsDetailed ) {
+		info->mBaseRequests = requests;
+		info->mBaseDirty = info->mPrivateDirty;
+	}
+
+	const char * reason = NULL;
+
+	unsigned int growth = 0;
+	if( info->mIsDetailed && requests - info->mBaseRequests >= MIN_GROWTH_REQUESTS
+			&& info->mPrivateDirty > info->mBaseDirty ) {
+		growth = (unsigned int)( (unsigned long long)( info->mPrivateDirty - info->mBaseDirty )
+				* 1000 / ( requests - info->mBaseRequests ) );
+	}
+
+	if( limit->mMaxRss > 0 && info->mRss > limit->mMaxRss ) {
+		reason = "rss";
+	} else if( ! info->mIsDetailed ) {
+		// the private dirty pages are unknown
+	} else if( limit->mMaxPrivateDirty > 0 && info->mPrivateDirty > limit->mMaxPrivateDirty ) {
+		reason = "private.dirty";
+	} else if( limit->mMaxGrowth > 0 && growth > limit->mMaxGrowth ) {
+		reason = "growth";
+	}
+
+	if( NULL == reason ) return 0;
+
+	syslog( LOG_INFO, "INFO: process #%d over the %s limit after %u requests, "
+			"rss %u KB, private.dirty %u KB, growth %u KB/1000 requests, recycle",
+			(int)pid, reason, requests, info->mRss, info->mPrivateDirty, growth );
+
+	dump( pid, info );
+
+	return 1;
+}
+
+void SP_ProcMemUtils :: dump( pid_t pid, const SP_ProcMemInfo_t * info )
+{
+	if( ! info->mIsDetailed ) {
+		syslog( LOG_INFO, "INFO: process #%d rss %u KB, shared %u KB, no smaps_rollup",
+				(int)pid, info->mRss, info->mShared );
+		return;
+	}
+
+	syslog( LOG_INFO, "INFO: process #%d rss %u KB, pss %u KB, shared %u KB ( clean %u, dirty %u ), "
+			"private %u KB ( clean %u, dirty %u )", (int)pid, info->mRss, info->mPss,
+			info->mShared, info->mSharedClean, info->mSharedDirty,
+			info->mPrivateClean + info->mPrivateDirty, info->mPrivateClean, info->mPrivateDirty );
+}
+
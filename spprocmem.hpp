@@ -0,0 +1,72 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spprocmem_hpp__
+#define __spprocmem_hpp__
+
+#include <sys/types.h>
+
+// all the sizes are in KB, 0 : unlimited
+typedef struct tagSP_ProcMemLimit {
+	unsigned int mMaxRss;
+	// the pages which are no longer shared with the parent, the COW breakage
+	unsigned int mMaxPrivateDirty;
+	// Private_Dirty growth per 1000 requests since the first check
+	unsigned int mMaxGrowth;
+	// check every N requests, 0 : DEFAULT_CHECK_INTERVAL, a check reads
+	// /proc/pid/smaps_rollup, which walks all the mappings of the process,
+	// and the pool does it in save(), on the event loop of the app
+	unsigned int mCheckInterval;
+} SP_ProcMemLimit_t;
+
+// the memory of one worker, from /proc/pid/smaps_rollup, in KB
+typedef struct tagSP_ProcMemInfo {
+	unsigned int mRss;
+	unsigned int mPss;
+	// clean and dirty
+	unsigned int mShared;
+	unsigned int mSharedClean;
+	unsigned int mSharedDirty;
+	unsigned int mPrivateClean;
+	unsigned int mPrivateDirty;
+
+	// 0 : from /proc/pid/statm, only mRss and mShared are known
+	unsigned int mIsDetailed;
+
+	// kept by SP_ProcMemUtils::isOverLimit
+	unsigned int mCheckRequests;
+	unsigned int mBaseRequests;
+	unsigned int mBaseDirty;
+} SP_ProcMemInfo_t;
+
+class SP_ProcMemUtils {
+public:
+	enum { DEFAULT_CHECK_INTERVAL = 1000 };
+
+	// without smaps_rollup ( Linux < 4.14 ), only /proc/pid/statm is read,
+	// it has the resident and shared totals, so the private dirty and the
+	// growth limits are skipped
+	// 0 : OK, -1 : Fail
+	static int read( pid_t pid, SP_ProcMemInfo_t * info );
+
+	static int isEnabled( const SP_ProcMemLimit_t * limit );
+
+	// check the process on the first request and every mCheckInterval
+	// requests after it, the info of the process is updated on every
+	// check, and the reason is logged
+	// 1 : recycle the process, 0 : keep it
+	static int isOverLimit( pid_t pid, unsigned int requests,
+			const SP_ProcMemLimit_t * limit, SP_ProcMemInfo_t * info );
+
+	// shared vs private of the process, log it as INFO
+	static void dump( pid_t pid, const SP_ProcMemInfo_t * info );
+
+private:
+	// the growth is not trusted until the requests since the first check
+	enum { MIN_GROWTH_REQUESTS = 100 };
+};
+
+#endif
+
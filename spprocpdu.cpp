@@ -16,18 +16,120 @@
 #include <assert.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "spprocpdu.hpp"
 
+enum { SP_PROC_POOL_CLASSES = 10 };   // 128 bytes .. 64KB
+
+typedef struct tagSP_ProcPoolCache {
+	void * mHead[ SP_PROC_POOL_CLASSES ];
+	int mCount[ SP_PROC_POOL_CLASSES ];
+} SP_ProcPoolCache_t;
+
+static pthread_key_t gPoolKey;
+static pthread_once_t gPoolOnce = PTHREAD_ONCE_INIT;
+static __thread SP_ProcPoolCache_t * gPoolCache = NULL;
+
+static void sp_proc_pool_free( void * arg )
+{
+	SP_ProcPoolCache_t * cache = (SP_ProcPoolCache_t*)arg;
+
+	for( int i = 0; i < SP_PROC_POOL_CLASSES; i++ ) {
+		for( void * buff = cache->mHead[i]; NULL != buff; ) {
+			void * next = *(void**)buff;
+			free( buff );
+			buff = next;
+		}
+	}
+
+	free( cache );
+	gPoolCache = NULL;
+}
+
+static void sp_proc_pool_init()
+{
+	pthread_key_create( &gPoolKey, sp_proc_pool_free );
+}
+
+static SP_ProcPoolCache_t * sp_proc_pool_cache()
+{
+	if( NULL == gPoolCache ) {
+		pthread_once( &gPoolOnce, sp_proc_pool_init );
+
+		gPoolCache = (SP_ProcPoolCache_t*)calloc( 1, sizeof( SP_ProcPoolCache_t ) );
+		if( NULL != gPoolCache ) pthread_setspecific( gPoolKey, gPoolCache );
+	}
+
+	return gPoolCache;
+}
+
+static int sp_proc_pool_class( size_t size )
+{
+	int index = 0;
+	for( size_t cap = SP_ProcBufferPool::MIN_SIZE; cap < size; cap = cap * 2 ) index++;
+
+	return index;
+}
+
+void * SP_ProcBufferPool :: get( size_t size, size_t * capacity )
+{
+	if( size > MAX_SIZE ) {
+		* capacity = size;
+		return malloc( size );
+	}
+
+	int index = sp_proc_pool_class( size );
+	* capacity = (size_t)MIN_SIZE << index;
+
+	SP_ProcPoolCache_t * cache = sp_proc_pool_cache();
+	if( NULL != cache && NULL != cache->mHead[ index ] ) {
+		void * buff = cache->mHead[ index ];
+		cache->mHead[ index ] = *(void**)buff;
+		cache->mCount[ index ]--;
+		return buff;
+	}
+
+	return malloc( * capacity );
+}
+
+void SP_ProcBufferPool :: put( void * buff, size_t capacity )
+{
+	if( NULL == buff ) return;
+
+	SP_ProcPoolCache_t * cache = NULL;
+	if( capacity >= MIN_SIZE && capacity <= MAX_SIZE ) cache = sp_proc_pool_cache();
+
+	int index = sp_proc_pool_class( capacity );
+
+	if( NULL != cache && ( (size_t)MIN_SIZE << index ) == capacity
+			&& cache->mCount[ index ] < MAX_FREE ) {
+		*(void**)buff = cache->mHead[ index ];
+		cache->mHead[ index ] = buff;
+		cache->mCount[ index ]++;
+	} else {
+		free( buff );
+	}
+}
+
+//-------------------------------------------------------------------
+
 SP_ProcDataBlock :: SP_ProcDataBlock()
 {
 	mData = NULL;
 	mDataSize = 0;
+	mKind = eNone;
+
+	mFd = -1;
+	mMapSize = 0;
+	mIsSealed = 0;
 }
 
 SP_ProcDataBlock :: ~SP_ProcDataBlock()
@@ -51,14 +153,144 @@ void SP_ProcDataBlock :: setData( void * data, size_t dataSize )
 
 	mData = data;
 	mDataSize = dataSize;
+	if( NULL != mData ) mKind = eMalloc;
 }
 
-void SP_ProcDataBlock :: reset()
+void * SP_ProcDataBlock :: alloc( size_t dataSize )
+{
+	reset();
+
+	if( dataSize < sizeof( mInline ) ) {
+		mData = mInline;
+		mKind = eInline;
+	} else {
+		mData = SP_ProcBufferPool::get( dataSize + 1, &mMapSize );
+		if( NULL == mData ) {
+			mMapSize = 0;
+			return NULL;
+		}
+		mKind = ePool;
+	}
+
+	mDataSize = dataSize;
+	((char*)mData)[ dataSize ] = '\0';
+
+	return mData;
+}
+
+int SP_ProcDataBlock :: setMappedData( int memFd, size_t dataSize )
 {
-	if( NULL != mData ) free( mData );
+	reset();
+
+	// the sender cannot change the data after it is sealed
+	int seals = fcntl( memFd, F_GET_SEALS );
+	int expected = F_SEAL_SHRINK | F_SEAL_WRITE;
+
+	struct stat st;
+	if( seals < 0 || expected != ( seals & expected )
+			|| 0 != fstat( memFd, &st ) || (size_t)st.st_size <= dataSize ) {
+		syslog( LOG_WARNING, "WARN: invalid memfd, seals %d, errno %d, %s",
+				seals, errno, strerror( errno ) );
+		close( memFd );
+		return -1;
+	}
+
+	// the extra byte is the terminating '\0' as read_pdu does
+	void * addr = mmap( NULL, dataSize + 1, PROT_READ, MAP_SHARED, memFd, 0 );
+	if( MAP_FAILED == addr ) {
+		syslog( LOG_WARNING, "WARN: mmap memfd fail, errno %d, %s", errno, strerror( errno ) );
+		close( memFd );
+		return -1;
+	}
+
+	mData = addr;
+	mDataSize = dataSize;
+	mKind = eMapped;
+	mFd = memFd;
+	mMapSize = dataSize + 1;
+	mIsSealed = 1;
+
+	return 0;
+}
+
+void * SP_ProcDataBlock :: allocShared( size_t dataSize )
+{
+	reset();
+
+	int memFd = memfd_create( "spprocpdu", MFD_CLOEXEC | MFD_ALLOW_SEALING );
+	if( memFd < 0 || 0 != ftruncate( memFd, dataSize + 1 ) ) {
+		syslog( LOG_WARNING, "WARN: create memfd fail, errno %d, %s", errno, strerror( errno ) );
+		if( memFd >= 0 ) close( memFd );
+		return NULL;
+	}
+
+	void * addr = mmap( NULL, dataSize + 1, PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0 );
+	if( MAP_FAILED == addr ) {
+		syslog( LOG_WARNING, "WARN: mmap memfd fail, errno %d, %s", errno, strerror( errno ) );
+		close( memFd );
+		return NULL;
+	}
+
+	mData = addr;
+	mDataSize = dataSize;
+	mKind = eMapped;
+	mFd = memFd;
+	mMapSize = dataSize + 1;
+
+	return mData;
+}
+
+int SP_ProcDataBlock :: getFd() const
+{
+	return mFd;
+}
+
+int SP_ProcDataBlock :: seal()
+{
+	if( mFd < 0 ) return -1;
+	if( mIsSealed ) return 0;
+
+	// no writable shared mapping is allowed by F_SEAL_WRITE
+	munmap( mData, mMapSize );
 	mData = NULL;
 
+	if( 0 != fcntl( mFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL ) ) {
+		syslog( LOG_WARNING, "WARN: seal memfd fail, errno %d, %s", errno, strerror( errno ) );
+		reset();
+		return -1;
+	}
+
+	void * addr = mmap( NULL, mMapSize, PROT_READ, MAP_SHARED, mFd, 0 );
+	if( MAP_FAILED == addr ) {
+		syslog( LOG_WARNING, "WARN: mmap memfd fail, errno %d, %s", errno, strerror( errno ) );
+		reset();
+		return -1;
+	}
+
+	mData = addr;
+	mIsSealed = 1;
+
+	return 0;
+}
+
+void SP_ProcDataBlock :: reset()
+{
+	if( eMapped == mKind ) {
+		if( NULL != mData ) munmap( mData, mMapSize );
+		close( mFd );
+	} else if( ePool == mKind ) {
+		SP_ProcBufferPool::put( mData, mMapSize );
+	} else if( eMalloc == mKind ) {
+		free( mData );
+	}
+
+	mData = NULL;
 	mDataSize = 0;
+	mKind = eNone;
+
+	mFd = -1;
+	mMapSize = 0;
+	mIsSealed = 0;
 }
 
 //-------------------------------------------------------------------
@@ -169,6 +401,239 @@ int SP_ProcPduUtils :: send_fd (int sockfd, int fd)
 	return 0;
 }
 
+int SP_ProcPduUtils :: send_fds( int sockfd, const int fds[], int count )
+{
+	if( count <= 0 || count > MAX_PASS_FDS ) return -1;
+
+	union {
+		struct cmsghdr cm;
+		char control[ CMSG_SPACE( sizeof( int ) * MAX_PASS_FDS ) ];
+	} tmpbuf;
+
+	struct iovec iov[1];
+	struct msghdr msg;
+	char buf[1] = { 0 };
+
+	iov[0].iov_base = buf;
+	iov[0].iov_len = 1;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 1;
+	msg.msg_name = NULL;
+	msg.msg_namelen = 0;
+	msg.msg_control = tmpbuf.control;
+	msg.msg_controllen = CMSG_SPACE( sizeof( int ) * count );
+	msg.msg_flags = 0;
+
+	struct cmsghdr * cmptr = CMSG_FIRSTHDR( &msg );
+	cmptr->cmsg_level = SOL_SOCKET;
+	cmptr->cmsg_type = SCM_RIGHTS;
+	cmptr->cmsg_len = CMSG_LEN( sizeof( int ) * count );
+	memcpy( CMSG_DATA( cmptr ), fds, sizeof( int ) * count );
+
+	for( ; ; ) {
+		if (sendmsg(sockfd, &msg, 0) != 1) {
+			if( EINTR == errno ) {
+				continue;
+			} else {
+				return -1;
+			}
+		} else {
+			break;
+		}
+	}
+
+	return 0;
+}
+
+int SP_ProcPduUtils :: recv_fds( int sockfd, int fds[], int maxCount )
+{
+	union {
+		struct cmsghdr cm;
+		char control[ CMSG_SPACE( sizeof( int ) * MAX_PASS_FDS ) ];
+	} tmpbuf;
+
+	struct iovec iov[1];
+	struct msghdr msg;
+	char buf[1];
+
+	iov[0].iov_base = buf;
+	iov[0].iov_len = sizeof (buf);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 1;
+	msg.msg_name = NULL;
+	msg.msg_namelen = 0;
+	msg.msg_control = tmpbuf.control;
+	msg.msg_controllen = sizeof( tmpbuf.control );
+	msg.msg_flags = 0;
+
+	int ret = -1;
+
+	for( ; ; ) {
+		ret = recvmsg( sockfd, &msg, 0 );
+		if( ret < 0 && EINTR == errno ) continue;
+		break;
+	}
+
+	if( ret <= 0 ) return ret;
+
+	if( msg.msg_flags & MSG_CTRUNC ) {
+		syslog( LOG_WARNING, "WARN: recv fds, control data truncated" );
+	}
+
+	int count = 0;
+
+	for( struct cmsghdr * cmptr = CMSG_FIRSTHDR( &msg ); NULL != cmptr;
+			cmptr = CMSG_NXTHDR( &msg, cmptr ) ) {
+		if( SOL_SOCKET != cmptr->cmsg_level || SCM_RIGHTS != cmptr->cmsg_type ) continue;
+
+		int * data = (int*)CMSG_DATA( cmptr );
+		int n = ( cmptr->cmsg_len - CMSG_LEN( 0 ) ) / sizeof( int );
+
+		for( int i = 0; i < n; i++ ) {
+			if( count < maxCount ) {
+				fds[ count++ ] = data[i];
+			} else {
+				close( data[i] );
+			}
+		}
+	}
+
+	return count;
+}
+
+int SP_ProcPduUtils :: send_fds( int sockfd, const int fds[], const SP_ProcFdMeta_t metas[], int count )
+{
+	if( count <= 0 || count > MAX_PASS_FDS ) return -1;
+
+	union {
+		struct cmsghdr cm;
+		char control[ CMSG_SPACE( sizeof( int ) * MAX_PASS_FDS ) ];
+	} tmpbuf;
+
+	// the count of records, then the records
+	struct iovec iov[2];
+	struct msghdr msg;
+
+	iov[0].iov_base = &count;
+	iov[0].iov_len = sizeof( count );
+	iov[1].iov_base = (void*)metas;
+	iov[1].iov_len = sizeof( SP_ProcFdMeta_t ) * count;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_name = NULL;
+	msg.msg_namelen = 0;
+	msg.msg_control = tmpbuf.control;
+	msg.msg_controllen = CMSG_SPACE( sizeof( int ) * count );
+	msg.msg_flags = 0;
+
+	struct cmsghdr * cmptr = CMSG_FIRSTHDR( &msg );
+	cmptr->cmsg_level = SOL_SOCKET;
+	cmptr->cmsg_type = SCM_RIGHTS;
+	cmptr->cmsg_len = CMSG_LEN( sizeof( int ) * count );
+	memcpy( CMSG_DATA( cmptr ), fds, sizeof( int ) * count );
+
+	ssize_t total = iov[0].iov_len + iov[1].iov_len;
+	ssize_t ret = -1;
+
+	for( ; ; ) {
+		ret = sendmsg( sockfd, &msg, 0 );
+		if( ret < 0 && EINTR == errno ) continue;
+		break;
+	}
+
+	if( ret <= 0 ) return -1;
+
+	// the fds go with the first part, the rest is plain data
+	if( ret < total ) {
+		ret -= sizeof( count );
+		if( ret < 0 ) {
+			if( -ret != writen( sockfd, (char*)&count + sizeof( count ) + ret, -ret ) ) return -1;
+			ret = 0;
+		}
+
+		ssize_t left = iov[1].iov_len - ret;
+		if( left != writen( sockfd, (char*)metas + ret, left ) ) return -1;
+	}
+
+	return 0;
+}
+
+int SP_ProcPduUtils :: recv_fds( int sockfd, int fds[], SP_ProcFdMeta_t metas[], int maxCount )
+{
+	union {
+		struct cmsghdr cm;
+		char control[ CMSG_SPACE( sizeof( int ) * MAX_PASS_FDS ) ];
+	} tmpbuf;
+
+	int count = 0;
+
+	// a recvmsg stops after the message which carries fds
+	struct iovec iov[2];
+	struct msghdr msg;
+
+	iov[0].iov_base = &count;
+	iov[0].iov_len = sizeof( count );
+	iov[1].iov_base = metas;
+	iov[1].iov_len = sizeof( SP_ProcFdMeta_t ) * maxCount;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_name = NULL;
+	msg.msg_namelen = 0;
+	msg.msg_control = tmpbuf.control;
+	msg.msg_controllen = sizeof( tmpbuf.control );
+	msg.msg_flags = 0;
+
+	ssize_t ret = -1;
+
+	for( ; ; ) {
+		ret = recvmsg( sockfd, &msg, 0 );
+		if( ret < 0 && EINTR == errno ) continue;
+		break;
+	}
+
+	if( ret <= 0 ) return ret;
+
+	int fdCount = 0;
+
+	for( struct cmsghdr * cmptr = CMSG_FIRSTHDR( &msg ); NULL != cmptr;
+			cmptr = CMSG_NXTHDR( &msg, cmptr ) ) {
+		if( SOL_SOCKET != cmptr->cmsg_level || SCM_RIGHTS != cmptr->cmsg_type ) continue;
+
+		int * data = (int*)CMSG_DATA( cmptr );
+		int n = ( cmptr->cmsg_len - CMSG_LEN( 0 ) ) / sizeof( int );
+
+		for( int i = 0; i < n; i++ ) {
+			if( fdCount < maxCount ) {
+				fds[ fdCount++ ] = data[i];
+			} else {
+				close( data[i] );
+			}
+		}
+	}
+
+	if( ret < (ssize_t)sizeof( count ) ) {
+		ssize_t len = readn( sockfd, (char*)&count + ret, sizeof( count ) - ret );
+		if( len != (ssize_t)sizeof( count ) - ret ) count = -1;
+		ret = 0;
+	} else {
+		ret -= sizeof( count );
+	}
+
+	if( count != fdCount ) {
+		syslog( LOG_WARNING, "WARN: recv fds, %d records, but %d fds", count, fdCount );
+		for( int i = 0; i < fdCount; i++ ) close( fds[i] );
+		return -1;
+	}
+
+	ssize_t left = sizeof( SP_ProcFdMeta_t ) * count - ret;
+	if( left > 0 && left != readn( sockfd, (char*)metas + ret, left ) ) {
+		for( int i = 0; i < fdCount; i++ ) close( fds[i] );
+		return -1;
+	}
+
+	return count;
+}
+
 /* Read "n" bytes from a descriptor. */
 ssize_t SP_ProcPduUtils :: readn(int fd, void *vptr, size_t n)
 {
@@ -217,27 +682,125 @@ ssize_t SP_ProcPduUtils :: writen(int fd, const void *vptr, size_t n)
 	return(n);
 }
 
+ssize_t SP_ProcPduUtils :: writevn( int fd, struct iovec * iov, int count )
+{
+	ssize_t total = 0;
+
+	for( ; count > 0; ) {
+		ssize_t ret = writev( fd, iov, count );
+		if( ret <= 0 ) {
+			if( ret < 0 && EINTR == errno ) continue;
+			return ret;
+		}
+
+		total += ret;
+
+		// skip the buffers which are written
+		for( ; count > 0 && (size_t)ret >= iov->iov_len; count-- ) {
+			ret -= iov->iov_len;
+			iov++;
+		}
+
+		if( count > 0 ) {
+			iov->iov_base = (char*)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return total;
+}
+
+size_t SP_ProcPduUtils :: mLargeThreshold = 0;
+
+void SP_ProcPduUtils :: setLargeThreshold( size_t largeThreshold )
+{
+	mLargeThreshold = largeThreshold;
+}
+
+size_t SP_ProcPduUtils :: getLargeThreshold()
+{
+	return mLargeThreshold;
+}
+
+int SP_ProcPduUtils :: read_header( int fd, SP_ProcPdu_t * pdu, int * passedFd )
+{
+	union {
+		struct cmsghdr cm;
+		char control[ CMSG_SPACE( sizeof( int ) ) ];
+	} tmpbuf;
+
+	struct iovec iov[1];
+	struct msghdr msg;
+
+	iov[0].iov_base = pdu;
+	iov[0].iov_len = sizeof( SP_ProcPdu_t );
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 1;
+	msg.msg_name = NULL;
+	msg.msg_namelen = 0;
+	msg.msg_control = tmpbuf.control;
+	msg.msg_controllen = sizeof( tmpbuf.control );
+	msg.msg_flags = 0;
+
+	* passedFd = -1;
+
+	int ret = -1;
+
+	for( ; ; ) {
+		ret = recvmsg( fd, &msg, MSG_CMSG_CLOEXEC );
+		if( ret < 0 && EINTR == errno ) continue;
+		break;
+	}
+
+	if( ret <= 0 ) return ret;
+
+	struct cmsghdr * cmptr = CMSG_FIRSTHDR( &msg );
+	if( NULL != cmptr && SOL_SOCKET == cmptr->cmsg_level && SCM_RIGHTS == cmptr->cmsg_type ) {
+		* passedFd = * (int*)CMSG_DATA( cmptr );
+	}
+
+	// the header is sent in one message, but may be read in pieces
+	if( ret < (int)sizeof( SP_ProcPdu_t ) ) {
+		int len = readn( fd, (char*)pdu + ret, sizeof( SP_ProcPdu_t ) - ret );
+		ret = len < 0 ? len : ret + len;
+	}
+
+	return ret;
+}
+
 int SP_ProcPduUtils :: read_pdu( int fd, SP_ProcPdu_t * pdu, SP_ProcDataBlock * block )
 {
 	int ret = -1;
 
 	memset( pdu, 0, sizeof( SP_ProcPdu_t ) );
 
-	ret = readn( fd, pdu, sizeof( SP_ProcPdu_t ) );
+	int passedFd = -1;
+
+	ret = read_header( fd, pdu, &passedFd );
 	if( sizeof( SP_ProcPdu_t ) == ret ) {
 		if( SP_ProcPdu_t::MAGIC_NUM == pdu->mMagicNum ) { //&& getpid() == pdu->mDestPid ) {
-			if( pdu->mDataSize > 0 ) {
-				char * buff = (char*)malloc( pdu->mDataSize + 1 );
+			if( SP_ProcPdu_t::eDataFd == pdu->mType ) {
+				pdu->mType = SP_ProcPdu_t::eData;
+
+				if( passedFd >= 0 && NULL != block
+						&& 0 == block->setMappedData( passedFd, pdu->mDataSize ) ) {
+					ret = sizeof( SP_ProcPdu_t ) + pdu->mDataSize;
+				} else {
+					syslog( LOG_WARNING, "WARN: read memfd data fail, fd %d", passedFd );
+					if( passedFd >= 0 && NULL == block ) close( passedFd );
+					ret = -1;
+				}
+
+				passedFd = -1;
+			} else if( pdu->mDataSize > 0 ) {
+				char * buff = (char*)block->alloc( pdu->mDataSize );
 				assert( NULL != buff );
 
 				ret = readn( fd, buff, pdu->mDataSize );
 				if( (int)pdu->mDataSize == ret ) {
 					ret = sizeof( SP_ProcPdu_t ) + pdu->mDataSize;
-					buff[ pdu->mDataSize ] = '\0';
-
-					block->setData( buff, pdu->mDataSize );
 				} else {
-					free( buff );
+					block->reset();
 					if( ret < 0 ) {
 						syslog( LOG_WARNING, "WARN: read data fail, errno %d, %s",
 								errno, strerror( errno ) );
@@ -257,24 +820,73 @@ int SP_ProcPduUtils :: read_pdu( int fd, SP_ProcPdu_t * pdu, SP_ProcDataBlock *
 		}
 	}
 
+	if( passedFd >= 0 ) close( passedFd );
+
 	return ret;
 }
 
+int SP_ProcPduUtils :: send_header( int fd, const SP_ProcPdu_t * pdu, int memFd )
+{
+	if( memFd < 0 ) {
+		return sizeof( SP_ProcPdu_t ) == writen( fd, pdu, sizeof( SP_ProcPdu_t ) ) ? 0 : -1;
+	}
+
+	union {
+		struct cmsghdr cm;
+		char control[ CMSG_SPACE( sizeof( int ) ) ];
+	} tmpbuf;
+
+	struct iovec iov[1];
+	struct msghdr msg;
+
+	iov[0].iov_base = (void*)pdu;
+	iov[0].iov_len = sizeof( SP_ProcPdu_t );
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 1;
+	msg.msg_name = NULL;
+	msg.msg_namelen = 0;
+	msg.msg_control = tmpbuf.control;
+	msg.msg_controllen = sizeof( tmpbuf.control );
+	msg.msg_flags = 0;
+
+	struct cmsghdr * cmptr = CMSG_FIRSTHDR( &msg );
+	cmptr->cmsg_level = SOL_SOCKET;
+	cmptr->cmsg_type = SCM_RIGHTS;
+	cmptr->cmsg_len = CMSG_LEN( sizeof( int ) );
+	* (int*)CMSG_DATA( cmptr ) = memFd;
+
+	int ret = -1;
+
+	for( ; ; ) {
+		ret = sendmsg( fd, &msg, 0 );
+		if( ret < 0 && EINTR == errno ) continue;
+		break;
+	}
+
+	if( ret <= 0 ) return -1;
+
+	if( ret < (int)sizeof( SP_ProcPdu_t ) ) {
+		int left = sizeof( SP_ProcPdu_t ) - ret;
+		if( left != writen( fd, (char*)pdu + ret, left ) ) return -1;
+	}
+
+	return 0;
+}
+
 int SP_ProcPduUtils :: send_pdu( int fd, const SP_ProcPdu_t * pdu, const void * data )
 {
 	int ret = -1;
 
-	if( sizeof( SP_ProcPdu_t ) == writen( fd, pdu, sizeof( SP_ProcPdu_t ) ) )  {
-		if( pdu->mDataSize > 0 ) {
-			if( (int)pdu->mDataSize == writen( fd, data, pdu->mDataSize ) ) {
-				ret = sizeof( SP_ProcPdu_t ) + pdu->mDataSize;
-			} else {
-				syslog( LOG_WARNING, "WARN: send data fail, errno %d, %s",
-						errno, strerror( errno ) );
-			}
-		} else {
-			ret = sizeof( SP_ProcPdu_t );
-		}
+	struct iovec iov[2];
+	iov[0].iov_base = (void*)pdu;
+	iov[0].iov_len = sizeof( SP_ProcPdu_t );
+	iov[1].iov_base = (void*)data;
+	iov[1].iov_len = pdu->mDataSize;
+
+	ssize_t len = sizeof( SP_ProcPdu_t ) + pdu->mDataSize;
+
+	if( len == writevn( fd, iov, pdu->mDataSize > 0 ? 2 : 1 ) ) {
+		ret = len;
 	} else {
 		syslog( LOG_WARNING, "WARN: send pdu fail, errno %d, %s",
 				errno, strerror( errno ) );
@@ -283,7 +895,64 @@ int SP_ProcPduUtils :: send_pdu( int fd, const SP_ProcPdu_t * pdu, const void *
 	return ret;
 }
 
-int SP_ProcPduUtils :: tcp_listen( const char * ip, int port, int * fd )
+int SP_ProcPduUtils :: send_pdus( int fd, const SP_ProcPdu_t pdus[], const void * datas[], int count )
+{
+	static const int SP_PROC_MAX_BATCH = 64;
+	struct iovec iov[ SP_PROC_MAX_BATCH * 2 ];
+
+	int total = 0;
+
+	for( int i = 0; i < count; ) {
+		int iovCount = 0;
+		ssize_t len = 0;
+
+		for( ; i < count && iovCount < SP_PROC_MAX_BATCH * 2; i++ ) {
+			iov[ iovCount ].iov_base = (void*)&( pdus[i] );
+			iov[ iovCount++ ].iov_len = sizeof( SP_ProcPdu_t );
+
+			if( pdus[i].mDataSize > 0 ) {
+				iov[ iovCount ].iov_base = (void*)datas[i];
+				iov[ iovCount++ ].iov_len = pdus[i].mDataSize;
+			}
+
+			len += sizeof( SP_ProcPdu_t ) + pdus[i].mDataSize;
+		}
+
+		if( len != writevn( fd, iov, iovCount ) ) {
+			syslog( LOG_WARNING, "WARN: send pdus fail, errno %d, %s",
+					errno, strerror( errno ) );
+			return -1;
+		}
+
+		total += len;
+	}
+
+	return total;
+}
+
+int SP_ProcPduUtils :: send_block( int fd, const SP_ProcPdu_t * pdu, SP_ProcDataBlock * block )
+{
+	// sealing and passing a memfd costs more than copying a small block
+	if( block->getFd() < 0 || pdu->mDataSize > block->getDataSize()
+			|| pdu->mDataSize < mLargeThreshold ) {
+		return send_pdu( fd, pdu, block->getData() );
+	}
+
+	if( 0 != block->seal() ) return -1;
+
+	SP_ProcPdu_t header = * pdu;
+	header.mType = SP_ProcPdu_t::eDataFd;
+
+	if( 0 != send_header( fd, &header, block->getFd() ) ) {
+		syslog( LOG_WARNING, "WARN: send pdu fail, errno %d, %s",
+				errno, strerror( errno ) );
+		return -1;
+	}
+
+	return sizeof( SP_ProcPdu_t ) + pdu->mDataSize;
+}
+
+int SP_ProcPduUtils :: tcp_listen( const char * ip, int port, int * fd, int isReusePort )
 {
 	int ret = 0;
 
@@ -299,6 +968,10 @@ int SP_ProcPduUtils :: tcp_listen( const char * ip, int port, int * fd )
 			syslog( LOG_WARNING, "failed to set setsock to reuseaddr" );
 			ret = -1;
 		}
+		if( isReusePort && setsockopt( listenFd, SOL_SOCKET, SO_REUSEPORT, &flags, sizeof( flags ) ) < 0 ) {
+			syslog( LOG_WARNING, "failed to set setsock to reuseport" );
+			ret = -1;
+		}
 		if( setsockopt( listenFd, IPPROTO_TCP, TCP_NODELAY, &flags, sizeof(flags) ) < 0 ) {
 			syslog( LOG_WARNING, "failed to set socket to nodelay" );
 			ret = -1;
@@ -367,3 +1040,245 @@ void SP_ProcPduUtils :: print_cpu_time()
 	printf("\nuser time = %g, sys time = %g\n", user, sys);
 }
 
+//-------------------------------------------------------------------
+
+SP_ProcPduReader :: SP_ProcPduReader( int fd, size_t buffSize, int isNonBlock )
+{
+	mFd = fd;
+	mIsNonBlock = isNonBlock;
+
+	mBuffSize = buffSize > sizeof( SP_ProcPdu_t ) ? buffSize : sizeof( SP_ProcPdu_t );
+	mBuff = (char*)malloc( mBuffSize );
+	assert( NULL != mBuff );
+
+	mInitSize = mBuffSize;
+
+	mHead = mTail = 0;
+
+	mFdCount = 0;
+}
+
+SP_ProcPduReader :: ~SP_ProcPduReader()
+{
+	free( mBuff );
+	mBuff = NULL;
+
+	for( int i = 0; i < mFdCount; i++ ) close( mFds[i] );
+	mFdCount = 0;
+}
+
+int SP_ProcPduReader :: getFd() const
+{
+	return mFd;
+}
+
+int SP_ProcPduReader :: fill()
+{
+	if( mHead > 0 ) {
+		memmove( mBuff, mBuff + mHead, mTail - mHead );
+		mTail -= mHead;
+		mHead = 0;
+	}
+
+	union {
+		struct cmsghdr cm;
+		char control[ CMSG_SPACE( sizeof( int ) * SP_ProcPduUtils::MAX_PASS_FDS ) ];
+	} tmpbuf;
+
+	struct iovec iov[1];
+	struct msghdr msg;
+
+	iov[0].iov_base = mBuff + mTail;
+	iov[0].iov_len = mBuffSize - mTail;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 1;
+	msg.msg_name = NULL;
+	msg.msg_namelen = 0;
+	msg.msg_control = tmpbuf.control;
+	msg.msg_controllen = sizeof( tmpbuf.control );
+	msg.msg_flags = 0;
+
+	int ret = -1;
+
+	for( ; ; ) {
+		ret = recvmsg( mFd, &msg, MSG_CMSG_CLOEXEC | ( mIsNonBlock ? MSG_DONTWAIT : 0 ) );
+		if( ret < 0 && EINTR == errno ) continue;
+		break;
+	}
+
+	if( ret < 0 && mIsNonBlock && ( EAGAIN == errno || EWOULDBLOCK == errno ) ) return INCOMPLETE;
+
+	if( ret <= 0 ) return ret;
+
+	mTail += ret;
+
+	// a recvmsg stops after the message which carries fds, so they are in order
+	for( struct cmsghdr * cmptr = CMSG_FIRSTHDR( &msg ); NULL != cmptr;
+			cmptr = CMSG_NXTHDR( &msg, cmptr ) ) {
+		if( SOL_SOCKET != cmptr->cmsg_level || SCM_RIGHTS != cmptr->cmsg_type ) continue;
+
+		int * data = (int*)CMSG_DATA( cmptr );
+		int n = ( cmptr->cmsg_len - CMSG_LEN( 0 ) ) / sizeof( int );
+
+		for( int i = 0; i < n; i++ ) {
+			if( mFdCount < SP_ProcPduUtils::MAX_PASS_FDS ) {
+				mFds[ mFdCount++ ] = data[i];
+			} else {
+				syslog( LOG_WARNING, "WARN: too many fds are queued, drop fd %d", data[i] );
+				close( data[i] );
+			}
+		}
+	}
+
+	return ret;
+}
+
+int SP_ProcPduReader :: ensure( size_t n )
+{
+	if( n > mBuffSize ) {
+		if( mHead > 0 ) {
+			memmove( mBuff, mBuff + mHead, mTail - mHead );
+			mTail -= mHead;
+			mHead = 0;
+		}
+
+		mBuff = (char*)realloc( mBuff, n );
+		assert( NULL != mBuff );
+		mBuffSize = n;
+	}
+
+	for( ; mTail - mHead < n; ) {
+		int ret = fill();
+		if( ret <= 0 ) return ret;
+	}
+
+	return n;
+}
+
+int SP_ProcPduReader :: takeFd()
+{
+	if( mFdCount <= 0 ) return -1;
+
+	int fd = mFds[0];
+
+	mFdCount--;
+	memmove( mFds, mFds + 1, sizeof( int ) * mFdCount );
+
+	return fd;
+}
+
+int SP_ProcPduReader :: read_pdu( SP_ProcPdu_t * pdu, SP_ProcDataBlock * block )
+{
+	memset( pdu, 0, sizeof( SP_ProcPdu_t ) );
+
+	int ret = ensure( sizeof( SP_ProcPdu_t ) );
+	if( ret <= 0 ) {
+		if( ret < 0 && INCOMPLETE != ret ) {
+			syslog( LOG_WARNING, "WARN: read pdu fail, errno %d, %s",
+					errno, strerror( errno ) );
+		}
+		return ret;
+	}
+
+	memcpy( pdu, mBuff + mHead, sizeof( SP_ProcPdu_t ) );
+
+	if( SP_ProcPdu_t::MAGIC_NUM != pdu->mMagicNum ) {
+		syslog( LOG_WARNING, "WARN: invalid pdu, magic.num %x, dest.pid %d",
+				pdu->mMagicNum, pdu->mDestPid );
+		return -1;
+	}
+
+	// nothing is taken until the whole pdu is buffered
+	if( mIsNonBlock && SP_ProcPdu_t::eDataFd != pdu->mType && pdu->mDataSize > 0 ) {
+		ret = ensure( sizeof( SP_ProcPdu_t ) + pdu->mDataSize );
+		if( ret <= 0 ) {
+			if( ret < 0 && INCOMPLETE != ret ) {
+				syslog( LOG_WARNING, "WARN: read data fail, errno %d, %s",
+						errno, strerror( errno ) );
+			}
+			return ret;
+		}
+	}
+
+	mHead += sizeof( SP_ProcPdu_t );
+
+	if( SP_ProcPdu_t::eDataFd == pdu->mType ) {
+		pdu->mType = SP_ProcPdu_t::eData;
+
+		// the fd comes with the header
+		int memFd = takeFd();
+		if( memFd < 0 || NULL == block || 0 != block->setMappedData( memFd, pdu->mDataSize ) ) {
+			syslog( LOG_WARNING, "WARN: read memfd data fail, fd %d", memFd );
+			if( memFd >= 0 && NULL == block ) close( memFd );
+			return -1;
+		}
+	} else if( pdu->mDataSize > 0 ) {
+		char * buff = (char*)block->alloc( pdu->mDataSize );
+		assert( NULL != buff );
+
+		size_t len = mTail - mHead;
+		if( len > pdu->mDataSize ) len = pdu->mDataSize;
+
+		memcpy( buff, mBuff + mHead, len );
+		mHead += len;
+
+		// the rest goes to the block directly
+		if( len < pdu->mDataSize ) {
+			ret = SP_ProcPduUtils::readn( mFd, buff + len, pdu->mDataSize - len );
+			if( (int)( pdu->mDataSize - len ) != ret ) {
+				block->reset();
+				if( ret < 0 ) {
+					syslog( LOG_WARNING, "WARN: read data fail, errno %d, %s",
+							errno, strerror( errno ) );
+					return -1;
+				}
+				return 0;
+			}
+		}
+	}
+
+	// give back the room of a large pdu
+	if( mBuffSize > mInitSize && mHead == mTail ) {
+		free( mBuff );
+		mBuff = (char*)malloc( mInitSize );
+		assert( NULL != mBuff );
+		mBuffSize = mInitSize;
+		mHead = mTail = 0;
+	}
+
+	return sizeof( SP_ProcPdu_t ) + pdu->mDataSize;
+}
+
+int SP_ProcPduReader :: recv_fds( int fds[], int maxCount )
+{
+	// send_fds passes the fds with one byte
+	int ret = ensure( 1 );
+	if( ret <= 0 ) return ret;
+
+	mHead++;
+
+	int count = 0;
+
+	for( int fd = takeFd(); fd >= 0; fd = takeFd() ) {
+		if( count < maxCount ) {
+			fds[ count++ ] = fd;
+		} else {
+			close( fd );
+		}
+	}
+
+	return count;
+}
+
+int SP_ProcPduReader :: hasPdu() const
+{
+	if( mTail - mHead < sizeof( SP_ProcPdu_t ) ) return 0;
+
+	SP_ProcPdu_t pdu;
+	memcpy( &pdu, mBuff + mHead, sizeof( SP_ProcPdu_t ) );
+
+	if( SP_ProcPdu_t::eDataFd == pdu.mType ) return 1;
+
+	return mTail - mHead >= sizeof( SP_ProcPdu_t ) + pdu.mDataSize;
+}
+
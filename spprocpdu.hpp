@@ -7,31 +7,117 @@
 #define __spprocpdu_hpp__
 
 #include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
 
 typedef struct tagSP_ProcPdu {
 	enum { MAGIC_NUM = 0x20071206 };
+	// eDataFd : the data is in a sealed memfd passed with the header,
+	// read_pdu maps it and reports eData
+	// eExit : the data is a SP_ProcExit_t, sent by the process manager
+	enum { eData = 0, eAttachRing = 1, eDataFd = 2, eExit = 3 };
 
 	unsigned int mMagicNum;
+	int mType;
 	pid_t mSrcPid;
 	pid_t mDestPid;
+	unsigned int mSeqNo;   // request id, echoed in the reply
 	size_t mDataSize;
 } SP_ProcPdu_t;
 
+// a record of an accepted connection, passed with its fd
+typedef struct tagSP_ProcFdMeta {
+	enum { MAX_HEAD = 64 };
+
+	struct sockaddr_in mPeerAddr;
+	struct timeval mAcceptTime;
+	int mHeadLen;                  // peeked bytes, they are still in the socket
+	char mHead[ MAX_HEAD ];
+} SP_ProcFdMeta_t;
+
+// the exit of a worker, reaped by the process manager
+typedef struct tagSP_ProcExit {
+	pid_t mPid;
+	int mStatus;                   // see waitpid, WIFEXITED / WIFSIGNALED
+	struct rusage mUsage;
+} SP_ProcExit_t;
+
+// the exit pdu is sent as one message of a SOCK_SEQPACKET socket
+typedef struct tagSP_ProcExitPdu {
+	SP_ProcPdu_t mPdu;
+	SP_ProcExit_t mExit;
+} SP_ProcExitPdu_t;
+
+/**
+ * Per-thread free lists of power of 2 sized buffers, from MIN_SIZE to
+ * MAX_SIZE bytes. Larger buffers are malloc-ed and freed as usual.
+ * A buffer may be put back by another thread, it joins that thread's lists.
+ */
+class SP_ProcBufferPool {
+public:
+	enum { MIN_SIZE = 128, MAX_SIZE = 65536, MAX_FREE = 64 };
+
+	// capacity : the real size of the buffer, which is passed to put
+	static void * get( size_t size, size_t * capacity );
+
+	static void put( void * buff, size_t capacity );
+
+private:
+	SP_ProcBufferPool();
+};
+
 class SP_ProcDataBlock {
 public:
+	// small data is kept in the block itself, including the '\0'
+	enum { INLINE_SIZE = 64 };
+
 	SP_ProcDataBlock();
 	~SP_ProcDataBlock();
 
 	void * getData() const;
 	size_t getDataSize() const;
 
+	// the data is allocated by malloc
 	void setData( void * data, size_t dataSize );
 
+	// room for dataSize bytes and a terminating '\0', taken from the
+	// inline storage or SP_ProcBufferPool, so it costs no malloc/free
+	// in the steady state. NULL : Fail
+	void * alloc( size_t dataSize );
+
+	// map a sealed memfd read-only, the block takes the fd
+	// 0 : OK, -1 : Fail
+	int setMappedData( int memFd, size_t dataSize );
+
+	// writable shared memory which send_block passes without copy,
+	// it is sealed and becomes read-only once it is sent
+	// NULL : Fail
+	void * allocShared( size_t dataSize );
+
+	// the memfd of a mapped or shared block, -1 : private memory
+	int getFd() const;
+
+	// seal a shared block, 0 : OK, -1 : Fail
+	int seal();
+
 	void reset();
 
 private:
+	enum { eNone = 0, eMalloc = 1, eInline = 2, ePool = 3, eMapped = 4 };
+
 	void * mData;
 	size_t mDataSize;
+	char mKind;
+
+	int mFd;
+	size_t mMapSize;             // the mapped length, or the pool capacity
+	char mIsSealed;
+
+	char mInline[ INLINE_SIZE ];
+
+	SP_ProcDataBlock( SP_ProcDataBlock & );
+	SP_ProcDataBlock & operator=( SP_ProcDataBlock & );
 };
 
 class SP_ProcClock {
@@ -50,17 +136,37 @@ private:
 	struct timeval mPrevTime;
 };
 
+struct iovec;
+
 class SP_ProcPduUtils {
 public:
+	enum { MAX_PASS_FDS = 64 };
 
 	// > 0 : OK, 0 : connect reset by peer, -1 : error
 	static int read_pdu( int fd, SP_ProcPdu_t * pdu, SP_ProcDataBlock * block );
 
 	// > 0 : OK, -1 : error
+	// the header and the data are written by one writev,
+	// the data is always written to the socket, only send_block passes a memfd
 	static int send_pdu( int fd, const SP_ProcPdu_t * pdu, const void * data );
 
+	// send count pdus with as few writev as possible
+	// > 0 : OK, -1 : error
+	static int send_pdus( int fd, const SP_ProcPdu_t pdus[], const void * datas[], int count );
+
+	// a shared block, see SP_ProcDataBlock::allocShared, is passed by its
+	// memfd when it reaches the large threshold, others are sent by send_pdu
+	// > 0 : OK, -1 : error
+	static int send_block( int fd, const SP_ProcPdu_t * pdu, SP_ProcDataBlock * block );
+
+	// default is 0, every shared block is passed by its memfd. Should be set
+	// before the process manager is started, so that the workers inherit it
+	static void setLargeThreshold( size_t largeThreshold );
+	static size_t getLargeThreshold();
+
+	// isReusePort : set SO_REUSEPORT, so that many sockets listen on the port
 	// >= 0 : OK, -1 : error
-	static int tcp_listen( const char * ip, int port, int * fd );
+	static int tcp_listen( const char * ip, int port, int * fd, int isReusePort = 0 );
 
 	static void print_cpu_time();
 
@@ -76,15 +182,97 @@ public:
 	 */
 	static int recv_fd( int sockfd );
 
+	/* Pass up to MAX_PASS_FDS file descriptors in one message.
+	 * 0 : OK, -1 : error
+	 */
+	static int send_fds( int sockfd, const int fds[], int count );
+
+	/* Receive the file descriptors passed by send_fds.
+	 * > 0 : count of fds, 0 : connection closed or no fd, -1 : error
+	 */
+	static int recv_fds( int sockfd, int fds[], int maxCount );
+
+	/* Pass up to MAX_PASS_FDS file descriptors and a record of each one
+	 * in one message.
+	 * 0 : OK, -1 : error
+	 */
+	static int send_fds( int sockfd, const int fds[], const SP_ProcFdMeta_t metas[], int count );
+
+	/* Receive the file descriptors and records passed by send_fds.
+	 * > 0 : count of fds, 0 : connection closed, -1 : error
+	 */
+	static int recv_fds( int sockfd, int fds[], SP_ProcFdMeta_t metas[], int maxCount );
+
 	/* Read "n" bytes from a descriptor. */
 	static ssize_t readn(int fd, void *vptr, size_t n);
 
 	/* Write "n" bytes to a descriptor. */
 	static ssize_t writen(int fd, const void *vptr, size_t n);
 
+	/* Write all the buffers to a descriptor, the iov is changed. */
+	static ssize_t writevn( int fd, struct iovec * iov, int count );
+
 private:
 	SP_ProcPduUtils();
 	~SP_ProcPduUtils();
+
+	static size_t mLargeThreshold;
+
+	// the header and an optional fd in one message, memFd < 0 : no fd
+	static int send_header( int fd, const SP_ProcPdu_t * pdu, int memFd );
+
+	// passedFd : -1 if no fd is passed with the header
+	static int read_header( int fd, SP_ProcPdu_t * pdu, int * passedFd );
+};
+
+/**
+ * Buffered reader of a socket, one recv takes the header and as much of
+ * the data as is available, the following pdus are kept for the next read.
+ * The fds passed by SCM_RIGHTS are queued in order, they are taken by the
+ * eDataFd pdus and recv_fds. Do not mix it with other reads of the socket.
+ */
+class SP_ProcPduReader {
+public:
+	// returned by a non-blocking reader when the socket has no more data
+	enum { INCOMPLETE = -2 };
+
+	// isNonBlock : read with MSG_DONTWAIT, a partial pdu is kept in the
+	// buffer until the rest arrives, so the caller never blocks on it
+	SP_ProcPduReader( int fd, size_t buffSize = 16384, int isNonBlock = 0 );
+	~SP_ProcPduReader();
+
+	int getFd() const;
+
+	// the same as SP_ProcPduUtils::read_pdu,
+	// INCOMPLETE : no whole pdu yet, wait for the fd and call again
+	int read_pdu( SP_ProcPdu_t * pdu, SP_ProcDataBlock * block );
+
+	// the same as SP_ProcPduUtils::recv_fds, or INCOMPLETE
+	int recv_fds( int fds[], int maxCount );
+
+	// 1 : a whole pdu is buffered, read it before waiting for the socket
+	int hasPdu() const;
+
+private:
+	int mFd;
+
+	int mIsNonBlock;
+
+	char * mBuff;
+	size_t mBuffSize, mHead, mTail;
+	size_t mInitSize;
+
+	int mFds[ SP_ProcPduUtils::MAX_PASS_FDS ];
+	int mFdCount;
+
+	// > 0 : bytes read, 0 : connection closed, -1 : error, or INCOMPLETE
+	int fill();
+
+	// buffer at least n bytes, n : OK, 0 : connection closed, -1 : error,
+	// or INCOMPLETE. The buffer grows when n is larger than it
+	int ensure( size_t n );
+
+	int takeFd();
 };
 
 #endif
@@ -6,6 +6,10 @@
 #include <unistd.h>
 #include <signal.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <syslog.h>
@@ -15,6 +19,64 @@
 
 #include "spprocpool.hpp"
 #include "spprocpdu.hpp"
+#include "spprocring.hpp"
+
+typedef union tagSP_ProcInfoNode {
+	union tagSP_ProcInfoNode * mNext;
+	char mData[ sizeof( SP_ProcInfo ) ];
+} SP_ProcInfoNode_t;
+
+static pthread_mutex_t gProcInfoMutex = PTHREAD_MUTEX_INITIALIZER;
+static SP_ProcInfoNode_t * gProcInfoFreeList = NULL;
+
+void * SP_ProcInfo :: operator new( size_t size )
+{
+	if( size != sizeof( SP_ProcInfo ) ) return ::operator new( size );
+
+	static const int SP_PROC_SLAB_COUNT = 64;
+
+	pthread_mutex_lock( &gProcInfoMutex );
+
+	if( NULL == gProcInfoFreeList ) {
+		SP_ProcInfoNode_t * slab = (SP_ProcInfoNode_t*)malloc(
+				sizeof( SP_ProcInfoNode_t ) * SP_PROC_SLAB_COUNT );
+		assert( NULL != slab );
+
+		for( int i = 0; i < SP_PROC_SLAB_COUNT; i++ ) {
+			slab[i].mNext = gProcInfoFreeList;
+			gProcInfoFreeList = &( slab[i] );
+		}
+	}
+
+	SP_ProcInfoNode_t * node = gProcInfoFreeList;
+	gProcInfoFreeList = node->mNext;
+
+	pthread_mutex_unlock( &gProcInfoMutex );
+
+	return node;
+}
+
+void SP_ProcInfo :: operator delete( void * ptr, size_t size )
+{
+	if( NULL == ptr ) return;
+
+	// a derived class was allocated by operator new above from the heap
+	if( size != sizeof( SP_ProcInfo ) ) {
+		::operator delete( ptr );
+		return;
+	}
+
+	SP_ProcInfoNode_t * node = (SP_ProcInfoNode_t*)ptr;
+
+	pthread_mutex_lock( &gProcInfoMutex );
+
+	node->mNext = gProcInfoFreeList;
+	gProcInfoFreeList = node;
+
+	pthread_mutex_unlock( &gProcInfoMutex );
+}
+
+//-------------------------------------------------------------------
 
 const char SP_ProcInfo :: CHAR_BUSY = 'B';
 const char SP_ProcInfo :: CHAR_IDLE = 'I';
@@ -28,13 +90,24 @@ SP_ProcInfo :: SP_ProcInfo( int pipeFd )
 	mRequests = 0;
 	time( &mLastActiveTime );
 	mIsIdle = 1;
+	mSlot = -1;
+	mChannel = NULL;
+	mPidFd = -1;
+	memset( &mMemInfo, 0, sizeof( mMemInfo ) );
 }
 
 SP_ProcInfo :: ~SP_ProcInfo()
 {
+	delete mChannel;
+	mChannel = NULL;
+
 	close( mPipeFd );
 	mPipeFd = -1;
 
+	// the pidfd is removed from the exit epoll set by closing it
+	if( mPidFd >= 0 ) close( mPidFd );
+	mPidFd = -1;
+
 	mPid = -1;
 }
 
@@ -83,10 +156,47 @@ int SP_ProcInfo :: isIdle() const
 	return mIsIdle;
 }
 
+void SP_ProcInfo :: setSlot( int slot )
+{
+	mSlot = slot;
+}
+
+int SP_ProcInfo :: getSlot() const
+{
+	return mSlot;
+}
+
+void SP_ProcInfo :: setChannel( SP_ProcRingChannel * channel )
+{
+	mChannel = channel;
+}
+
+SP_ProcRingChannel * SP_ProcInfo :: getChannel() const
+{
+	return mChannel;
+}
+
+void SP_ProcInfo :: setPidFd( int pidFd )
+{
+	mPidFd = pidFd;
+}
+
+int SP_ProcInfo :: getPidFd() const
+{
+	return mPidFd;
+}
+
+SP_ProcMemInfo_t * SP_ProcInfo :: getMemInfo()
+{
+	return &mMemInfo;
+}
+
 void SP_ProcInfo :: dump() const
 {
 	syslog( LOG_INFO, "INFO: pid %d, pipeFd %d, requests %d, lastActiveTime %ld",
 		mPid, mPipeFd, mRequests, mLastActiveTime );
+
+	if( mMemInfo.mCheckRequests > 0 ) SP_ProcMemUtils::dump( mPid, &mMemInfo );
 }
 
 //-------------------------------------------------------------------
@@ -97,6 +207,13 @@ SP_ProcInfoList :: SP_ProcInfoList()
 	mList = ( SP_ProcInfo ** )malloc( sizeof( SP_ProcInfo * ) * mMaxCount );
 
 	mCount = 0;
+
+	mFdIndexSize = 64;
+	mFdIndex = (int*)malloc( sizeof( int ) * mFdIndexSize );
+	memset( mFdIndex, 0xff, sizeof( int ) * mFdIndexSize );
+
+	mPidTableSize = 16;
+	mPidTable = (PidEntry_t*)calloc( mPidTableSize, sizeof( PidEntry_t ) );
 }
 
 SP_ProcInfoList :: ~SP_ProcInfoList()
@@ -108,6 +225,12 @@ SP_ProcInfoList :: ~SP_ProcInfoList()
 	free( mList );
 	mList = NULL;
 
+	free( mFdIndex );
+	mFdIndex = NULL;
+
+	free( mPidTable );
+	mPidTable = NULL;
+
 	mMaxCount = 0;
 	mCount = 0;
 }
@@ -124,6 +247,93 @@ int SP_ProcInfoList :: getCount() const
 	return mCount;
 }
 
+int SP_ProcInfoList :: findPidEntry( pid_t pid ) const
+{
+	int mask = mPidTableSize - 1;
+
+	for( int i = ( (unsigned int)pid * 2654435761U ) & mask; ; i = ( i + 1 ) & mask ) {
+		if( pid == mPidTable[i].mPid || 0 == mPidTable[i].mPid ) return i;
+	}
+}
+
+void SP_ProcInfoList :: insertPid( pid_t pid, int index )
+{
+	// an unset pid is -1, only the real ones are indexed
+	if( pid <= 0 ) return;
+
+	// keep the load factor under 1/2
+	if( ( mCount + 1 ) * 2 > mPidTableSize ) {
+		PidEntry_t * oldTable = mPidTable;
+		int oldSize = mPidTableSize;
+
+		mPidTableSize = mPidTableSize * 2;
+		mPidTable = (PidEntry_t*)calloc( mPidTableSize, sizeof( PidEntry_t ) );
+		assert( NULL != mPidTable );
+
+		for( int i = 0; i < oldSize; i++ ) {
+			if( 0 != oldTable[i].mPid ) mPidTable[ findPidEntry( oldTable[i].mPid ) ] = oldTable[i];
+		}
+
+		free( oldTable );
+	}
+
+	int i = findPidEntry( pid );
+	mPidTable[i].mPid = pid;
+	mPidTable[i].mIndex = index;
+}
+
+void SP_ProcInfoList :: removePid( pid_t pid )
+{
+	if( pid <= 0 ) return;
+
+	int mask = mPidTableSize - 1;
+
+	int i = findPidEntry( pid );
+	if( 0 == mPidTable[i].mPid ) return;
+
+	mPidTable[i].mPid = 0;
+
+	// shift back the following entries of the same probe chain
+	for( int j = ( i + 1 ) & mask; 0 != mPidTable[j].mPid; j = ( j + 1 ) & mask ) {
+		int k = ( (unsigned int)mPidTable[j].mPid * 2654435761U ) & mask;
+
+		if( i <= j ? ( i < k && k <= j ) : ( i < k || k <= j ) ) continue;
+
+		mPidTable[i] = mPidTable[j];
+		mPidTable[j].mPid = 0;
+		i = j;
+	}
+}
+
+void SP_ProcInfoList :: indexItem( int index )
+{
+	SP_ProcInfo * info = mList[ index ];
+
+	int pipeFd = info->getPipeFd();
+	if( pipeFd >= 0 ) {
+		if( pipeFd >= mFdIndexSize ) {
+			int newSize = mFdIndexSize;
+			for( ; pipeFd >= newSize; ) newSize = newSize * 2;
+
+			mFdIndex = (int*)realloc( mFdIndex, sizeof( int ) * newSize );
+			assert( NULL != mFdIndex );
+			memset( mFdIndex + mFdIndexSize, 0xff, sizeof( int ) * ( newSize - mFdIndexSize ) );
+			mFdIndexSize = newSize;
+		}
+		mFdIndex[ pipeFd ] = index;
+	}
+
+	pid_t pid = info->getPid();
+	if( pid > 0 ) {
+		int i = findPidEntry( pid );
+		if( pid == mPidTable[i].mPid ) {
+			mPidTable[i].mIndex = index;
+		} else {
+			insertPid( pid, index );
+		}
+	}
+}
+
 void SP_ProcInfoList :: append( SP_ProcInfo * info )
 {
 	assert( NULL != info );
@@ -134,7 +344,10 @@ void SP_ProcInfoList :: append( SP_ProcInfo * info )
 		assert( NULL != mList );
 	}
 
-	mList[ mCount++ ] = info;
+	mList[ mCount ] = info;
+	indexItem( mCount );
+
+	mCount++;
 }
 
 SP_ProcInfo * SP_ProcInfoList :: getItem( int index ) const
@@ -154,8 +367,13 @@ SP_ProcInfo * SP_ProcInfoList :: takeItem( int index )
 		ret = mList[ index ];
 		mCount--;
 
-		for( int i = index; i < mCount; i++ ) {
-			mList[ i ] = mList[ i + 1 ];
+		if( ret->getPipeFd() >= 0 ) mFdIndex[ ret->getPipeFd() ] = -1;
+		removePid( ret->getPid() );
+
+		// move the last one into the hole
+		if( index < mCount ) {
+			mList[ index ] = mList[ mCount ];
+			indexItem( index );
 		}
 	}
 
@@ -164,51 +382,266 @@ SP_ProcInfo * SP_ProcInfoList :: takeItem( int index )
 
 int SP_ProcInfoList :: findByPid( pid_t pid ) const
 {
-	for( int i = 0; i < mCount; i++ ) {
-		if( mList[i]->getPid() == pid ) return i;
-	}
+	if( pid <= 0 ) return -1;
 
-	return -1;
+	int i = findPidEntry( pid );
+
+	return pid == mPidTable[i].mPid ? mPidTable[i].mIndex : -1;
 }
 
 int SP_ProcInfoList :: findByPipeFd( int pipeFd ) const
 {
-	for( int i = 0; i < mCount; i++ ) {
-		if( mList[i]->getPipeFd() == pipeFd ) return i;
-	}
+	if( pipeFd < 0 || pipeFd >= mFdIndexSize ) return -1;
 
-	return -1;
+	return mFdIndex[ pipeFd ];
 }
 
 //-------------------------------------------------------------------
 
-SP_ProcPool :: SP_ProcPool( int mgrPipe )
+/* A node of the idle stacks. A node is either in the free stack, in the
+ * idle stack or in the cache of a thread. mState is pid << 32 | gen << 8
+ * | state, the gen is bumped every time the node turns idle. reapExited
+ * marks an idle node as exited or retired by CAS, so it never hits a node
+ * which is reused meanwhile, even for the same process. The CAS gives the
+ * process to the reaper, which deletes it at once, the node itself is
+ * dropped when it is popped, or by sweepIdle before the nodes grow.
+ * The heads of the stacks are tag << 32 | ( index + 1 ), the tag is bumped
+ * by every change against ABA. The nodes are added in chunks, a chunk is
+ * never freed while the pool lives, so an index is always valid.
+ */
+typedef struct tagSP_ProcIdleNode {
+	enum { eFree = 0, eIdle = 1, eExited = 2, eRetired = 3 };
+
+	volatile uint64_t mState;
+	SP_ProcInfo * mInfo;
+	int mPidFd;
+	time_t mLastActive;
+	volatile int mNext;           // index + 1, 0 : end of the stack
+} SP_ProcIdleNode_t;
+
+typedef struct tagSP_ProcIdleCache {
+	enum { MAX_SIZE = 16 };
+
+	unsigned int mPoolId;
+	unsigned int mFlushGen;
+	int mCount;
+	int mNodes[ MAX_SIZE ];
+	int mIsKeySet;
+} SP_ProcIdleCache_t;
+
+static __thread SP_ProcIdleCache_t gIdleCache;
+
+// the live pools and the key to give the cache back at thread exit
+static pthread_mutex_t gPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+static SP_ProcPool * gPoolList = NULL;
+static unsigned int gPoolId = 0;
+static pthread_key_t gCacheKey;
+
+// the data of the idle timer in the exit fd, never a pid
+static const uint64_t SP_PROC_IDLE_TIMER = 1ULL << 32;
+
+typedef struct tagSP_ProcIdleAge {
+	time_t mLastActive;
+	int mIndex;
+} SP_ProcIdleAge_t;
+
+static int cmpIdleAge( const void * a, const void * b )
+{
+	time_t t1 = ( (const SP_ProcIdleAge_t*)a )->mLastActive;
+	time_t t2 = ( (const SP_ProcIdleAge_t*)b )->mLastActive;
+
+	return t1 < t2 ? -1 : ( t1 > t2 ? 1 : 0 );
+}
+
+SP_ProcPool :: SP_ProcPool( int mgrPipe, int exitPipe )
 {
 	mMgrPipe = mgrPipe;
+	pthread_mutex_init( &mMgrMutex, NULL );
+
+	mChunks = (SP_ProcIdleNode_t**)calloc( MAX_NODE_CHUNKS, sizeof( SP_ProcIdleNode_t * ) );
+	assert( NULL != mChunks );
+	mNodeCount = 0;
+	pthread_mutex_init( &mGrowMutex, NULL );
 
-	pthread_mutex_init( &mMutex, NULL );
-	mList = new SP_ProcInfoList();
+	mIdleHead = 0;
+	mFreeHead = 0;
+	mIdleCount = 0;
+
+	mPidHints = (uint64_t*)calloc( PID_HINTS, sizeof( uint64_t ) );
+	assert( NULL != mPidHints );
+
+	mDeadCount = 0;
+	mIsSweeping = 0;
+
+	int ret = growNodes();
+	assert( 0 == ret );
+
+	mCacheSize = 0;
+	mCachedCount = 0;
+	mFlushGen = 0;
+
+	pthread_mutex_lock( &gPoolMutex );
+	if( 0 == gPoolId ) {
+		ret = pthread_key_create( &gCacheKey, flushCache );
+		assert( 0 == ret );
+	}
+	mPoolId = ++gPoolId;
+	mNextPool = gPoolList;
+	gPoolList = this;
+	pthread_mutex_unlock( &gPoolMutex );
 
 	mMaxRequestsPerProc = 0;
 	mMaxIdleProc = 0;
+	memset( &mMemLimit, 0, sizeof( mMemLimit ) );
+
+	mIdleTimeout = 0;
+	mMinIdleProc = 0;
+	mIdleTimer = -1;
+
+	mPidFdFails = 0;
+
+	mBusyExits = NULL;
+	mBusyExitCount = mMaxBusyExits = 0;
+	pthread_mutex_init( &mBusyExitMutex, NULL );
+
+	mExitPipe = exitPipe;
+	mIsExitWatched = 0;
+	mExitCallback = NULL;
+	mExitCallbackArg = NULL;
+
+	mExitFd = epoll_create1( EPOLL_CLOEXEC );
+	if( mExitFd < 0 ) {
+		syslog( LOG_WARNING, "WARN: epoll_create fail, errno %d, %s", errno, strerror( errno ) );
+	}
+
+	if( mExitFd >= 0 && mExitPipe >= 0 ) {
+		struct epoll_event event;
+		memset( &event, 0, sizeof( event ) );
+		event.events = EPOLLIN;
+		event.data.u64 = 0;
+
+		if( 0 != epoll_ctl( mExitFd, EPOLL_CTL_ADD, mExitPipe, &event ) ) {
+			syslog( LOG_WARNING, "WARN: epoll_ctl fail, errno %d, %s", errno, strerror( errno ) );
+		}
+	}
 }
 
 SP_ProcPool :: ~SP_ProcPool()
 {
+	pthread_mutex_lock( &gPoolMutex );
+	for( SP_ProcPool ** iter = &gPoolList; NULL != * iter; iter = &( ( * iter )->mNextPool ) ) {
+		if( this == * iter ) {
+			* iter = mNextPool;
+			break;
+		}
+	}
+	pthread_mutex_unlock( &gPoolMutex );
+
+	if( gIdleCache.mPoolId == mPoolId ) gIdleCache.mCount = 0;
+
+	if( mIdleTimer >= 0 ) close( mIdleTimer );
+	mIdleTimer = -1;
+
+	if( mExitFd >= 0 ) close( mExitFd );
+	mExitFd = -1;
+
+	if( mExitPipe >= 0 ) close( mExitPipe );
+	mExitPipe = -1;
+
+	free( mBusyExits );
+	mBusyExits = NULL;
+	pthread_mutex_destroy( &mBusyExitMutex );
+
 	if( mMgrPipe >= 0 ) close( mMgrPipe );
 	mMgrPipe = -1;
+	pthread_mutex_destroy( &mMgrMutex );
 
-	pthread_mutex_destroy( &mMutex );
+	// the stacks and the thread caches are all in the nodes
+	for( int i = 0; i < mNodeCount; i++ ) {
+		SP_ProcIdleNode_t * node = getNode( i );
 
-	delete mList;
-	mList = NULL;
+		// the exited and retired ones are deleted by the reapers
+		if( SP_ProcIdleNode_t::eIdle == ( node->mState & 0xFF ) ) delete node->mInfo;
+	}
+
+	free( (void*)mPidHints );
+	mPidHints = NULL;
+
+	for( int i = 0; i < MAX_NODE_CHUNKS && NULL != mChunks[i]; i++ ) free( mChunks[i] );
+
+	free( mChunks );
+	mChunks = NULL;
+	pthread_mutex_destroy( &mGrowMutex );
 }
 
 void SP_ProcPool :: dump() const
 {
-	pthread_mutex_lock( const_cast<pthread_mutex_t*>(&mMutex) );
-	mList->dump();
-	pthread_mutex_unlock( const_cast<pthread_mutex_t*>(&mMutex));
+	syslog( LOG_INFO, "INFO: idle.count %d", mIdleCount );
+
+	for( int i = 0; i < mNodeCount; i++ ) {
+		SP_ProcIdleNode_t * node = getNode( i );
+		if( SP_ProcIdleNode_t::eIdle == ( node->mState & 0xFF ) ) node->mInfo->dump();
+	}
+}
+
+SP_ProcIdleNode_t * SP_ProcPool :: getNode( int index ) const
+{
+	return &( mChunks[ (unsigned int)index / NODE_CHUNK ][ (unsigned int)index % NODE_CHUNK ] );
+}
+
+int SP_ProcPool :: growNodes()
+{
+	int ret = 0;
+
+	pthread_mutex_lock( &mGrowMutex );
+
+	// another thread may have added a chunk meanwhile
+	if( 0 == ( mFreeHead & 0xFFFFFFFF ) ) {
+		int chunk = mNodeCount / NODE_CHUNK;
+
+		SP_ProcIdleNode_t * nodes = NULL;
+		if( chunk < MAX_NODE_CHUNKS ) {
+			nodes = (SP_ProcIdleNode_t*)calloc( NODE_CHUNK, sizeof( SP_ProcIdleNode_t ) );
+		}
+
+		if( NULL != nodes ) {
+			mChunks[ chunk ] = nodes;
+
+			// the scanners see the chunk before any node of it is used
+			__sync_add_and_fetch( &mNodeCount, NODE_CHUNK );
+
+			for( int i = NODE_CHUNK - 1; i >= 0; i-- ) pushNode( &mFreeHead, chunk * NODE_CHUNK + i );
+		} else {
+			syslog( LOG_WARNING, "WARN: cannot add idle nodes, node.count %d, max %d",
+					mNodeCount, (int)MAX_IDLE_NODES );
+			ret = -1;
+		}
+	}
+
+	pthread_mutex_unlock( &mGrowMutex );
+
+	return ret;
+}
+
+void SP_ProcPool :: flushCache( void * arg )
+{
+	SP_ProcIdleCache_t * cache = (SP_ProcIdleCache_t*)arg;
+
+	if( cache->mCount <= 0 ) return;
+
+	// the pool may be gone already
+	pthread_mutex_lock( &gPoolMutex );
+
+	for( SP_ProcPool * pool = gPoolList; NULL != pool; pool = pool->mNextPool ) {
+		if( pool->mPoolId != cache->mPoolId ) continue;
+
+		pool->giveBack( cache );
+		break;
+	}
+
+	cache->mCount = 0;
+
+	pthread_mutex_unlock( &gPoolMutex );
 }
 
 void SP_ProcPool :: setMaxRequestsPerProc( int maxRequestsPerProc )
@@ -226,32 +659,323 @@ void SP_ProcPool :: setMaxIdleProc( int maxIdleProc )
 	mMaxIdleProc = maxIdleProc;
 }
 
-int SP_ProcPool :: getIdleCount()
+void SP_ProcPool :: setMemLimit( const SP_ProcMemLimit_t * memLimit )
+{
+	mMemLimit = * memLimit;
+}
+
+void SP_ProcPool :: setThreadCache( int cacheSize )
+{
+	if( cacheSize < 0 ) cacheSize = 0;
+	if( cacheSize > SP_ProcIdleCache_t::MAX_SIZE ) cacheSize = SP_ProcIdleCache_t::MAX_SIZE;
+
+	mCacheSize = cacheSize;
+}
+
+void SP_ProcPool :: setIdleTimeout( int idleTimeout, int minIdleProc )
 {
+	mIdleTimeout = idleTimeout > 0 ? idleTimeout : 0;
+	mMinIdleProc = minIdleProc > 0 ? minIdleProc : 0;
+
+	if( mExitFd < 0 ) return;
+
+	if( mIdleTimer < 0 && mIdleTimeout > 0 ) {
+		mIdleTimer = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+		if( mIdleTimer < 0 ) {
+			syslog( LOG_WARNING, "WARN: timerfd_create fail, errno %d, %s", errno, strerror( errno ) );
+			return;
+		}
+
+		struct epoll_event event;
+		memset( &event, 0, sizeof( event ) );
+		event.events = EPOLLIN;
+		event.data.u64 = SP_PROC_IDLE_TIMER;
+
+		if( 0 != epoll_ctl( mExitFd, EPOLL_CTL_ADD, mIdleTimer, &event ) ) {
+			syslog( LOG_WARNING, "WARN: epoll_ctl fail, errno %d, %s", errno, strerror( errno ) );
+			close( mIdleTimer );
+			mIdleTimer = -1;
+			return;
+		}
+	}
+
+	if( mIdleTimer < 0 ) return;
+
+	// check 4 times in a timeout, a zero interval disarms the timer
+	int interval = mIdleTimeout / 4;
+	if( mIdleTimeout > 0 && interval <= 0 ) interval = 1;
+	if( interval > 60 ) interval = 60;
+
+	struct itimerspec spec;
+	memset( &spec, 0, sizeof( spec ) );
+	spec.it_value.tv_sec = interval;
+	spec.it_interval.tv_sec = interval;
+
+	if( 0 != timerfd_settime( mIdleTimer, 0, &spec, NULL ) ) {
+		syslog( LOG_WARNING, "WARN: timerfd_settime fail, errno %d, %s", errno, strerror( errno ) );
+	}
+}
+
+int SP_ProcPool :: reapIdle()
+{
+	if( mIdleTimeout <= 0 || mIdleCount <= mMinIdleProc ) return 0;
+
+	time_t expire = time( NULL ) - mIdleTimeout;
+
+	int nodeCount = mNodeCount;
+
+	SP_ProcIdleAge_t * ages = (SP_ProcIdleAge_t*)malloc( sizeof( SP_ProcIdleAge_t ) * nodeCount );
+	if( NULL == ages ) return 0;
+
 	int count = 0;
 
-	pthread_mutex_lock( &mMutex );
+	for( int i = 0; i < nodeCount; i++ ) {
+		SP_ProcIdleNode_t * node = getNode( i );
 
-	count = mList->getCount();
+		if( SP_ProcIdleNode_t::eIdle == ( node->mState & 0xFF ) && node->mLastActive <= expire ) {
+			ages[ count ].mLastActive = node->mLastActive;
+			ages[ count ].mIndex = i;
+			count++;
+		}
+	}
 
-	pthread_mutex_unlock( &mMutex );
+	// the least recently used first
+	qsort( ages, count, sizeof( ages[0] ), cmpIdleAge );
 
-	return count;
+	int retired = 0;
+
+	for( int i = 0; i < count && mIdleCount > mMinIdleProc; i++ ) {
+		SP_ProcIdleNode_t * node = getNode( ages[i].mIndex );
+
+		uint64_t state = node->mState;
+		if( SP_ProcIdleNode_t::eIdle != ( state & 0xFF ) || node->mLastActive > expire ) continue;
+
+		// the info belongs to the state read above, or the CAS fails
+		__sync_synchronize();
+		SP_ProcInfo * info = node->mInfo;
+
+		// the node is dropped by the one who pops it, the info is ours
+		if( ! __sync_bool_compare_and_swap( &( node->mState ), state,
+				( state & ~0xFFULL ) | SP_ProcIdleNode_t::eRetired ) ) {
+			continue;
+		}
+
+		__sync_sub_and_fetch( &mIdleCount, 1 );
+		__sync_add_and_fetch( &mDeadCount, 1 );
+
+		syslog( LOG_DEBUG, "DEBUG: process #%d idle for %d seconds, retire",
+				info->getPid(), (int)( time( NULL ) - ages[i].mLastActive ) );
+
+		// the worker exits when the pipe is closed
+		release( info );
+		retired++;
+	}
+
+	free( ages );
+
+	if( retired > 0 ) {
+		syslog( LOG_INFO, "INFO: retire %d idle process(es), idle.count %d, min.idle %d",
+				retired, mIdleCount, mMinIdleProc );
+	}
+
+	return retired;
 }
 
-int SP_ProcPool :: ensureIdleProc( int idleCount )
+int SP_ProcPool :: getIdleCount()
 {
-	idleCount = idleCount > mMaxIdleProc ? mMaxIdleProc : idleCount;
+	// a cached one which has exited is uncounted before it is popped
+	int count = mIdleCount - mCachedCount;
 
-	for( int i = mList->getCount(); i < idleCount; i++ ) {
-		SP_ProcInfo * info = create();
-		if( NULL != info ) {
-			save( info );
-		} else {
-			break;
+	return count > 0 ? count : 0;
+}
+
+int SP_ProcPool :: popNode( volatile uint64_t * head )
+{
+	for( ; ; ) {
+		uint64_t old = * head;
+
+		int top = (int)( old & 0xFFFFFFFF );
+		if( 0 == top ) return -1;
+
+		// may be stale if the node is popped meanwhile, then the tag differs
+		uint64_t next = (unsigned int)getNode( top - 1 )->mNext;
+
+		if( __sync_bool_compare_and_swap( head, old, ( ( ( old >> 32 ) + 1 ) << 32 ) | next ) ) {
+			return top - 1;
+		}
+	}
+}
+
+void SP_ProcPool :: pushNode( volatile uint64_t * head, int index )
+{
+	for( ; ; ) {
+		uint64_t old = * head;
+
+		getNode( index )->mNext = (int)( old & 0xFFFFFFFF );
+
+		if( __sync_bool_compare_and_swap( head, old,
+				( ( ( old >> 32 ) + 1 ) << 32 ) | (uint64_t)( index + 1 ) ) ) {
+			return;
+		}
+	}
+}
+
+int SP_ProcPool :: putIdle( SP_ProcInfo * procInfo, int isCache )
+{
+	int index = popNode( &mFreeHead );
+	for( ; index < 0; index = popNode( &mFreeHead ) ) {
+		// reuse the dead nodes before adding more
+		if( mDeadCount > 0 && sweepIdle() > 0 ) continue;
+		if( 0 != growNodes() ) return -1;
+	}
+
+	procInfo->setLastActiveTime( time( NULL ) );
+
+	SP_ProcIdleNode_t * node = getNode( index );
+	node->mInfo = procInfo;
+	node->mPidFd = procInfo->getPidFd();
+	node->mLastActive = procInfo->getLastActiveTime();
+
+	__sync_add_and_fetch( &mIdleCount, 1 );
+
+	uint64_t gen = ( node->mState + 0x100 ) & 0xFFFFFF00ULL;
+
+	// published by the CAS of pushNode
+	node->mState = ( (uint64_t)(unsigned int)procInfo->getPid() << 32 ) | gen | SP_ProcIdleNode_t::eIdle;
+
+	mPidHints[ (unsigned int)procInfo->getPid() % PID_HINTS ] =
+			( (uint64_t)(unsigned int)procInfo->getPid() << 32 ) | (unsigned int)( index + 1 );
+
+	if( isCache && mCacheSize > 0 ) {
+		SP_ProcIdleCache_t * cache = &gIdleCache;
+
+		if( 0 == cache->mCount ) {
+			cache->mPoolId = mPoolId;
+			cache->mFlushGen = mFlushGen;
+		}
+
+		// flushCache gives the cache back when the thread exits
+		if( ! cache->mIsKeySet ) {
+			pthread_setspecific( gCacheKey, cache );
+			cache->mIsKeySet = 1;
+		}
+
+		if( cache->mPoolId == mPoolId && cache->mFlushGen != mFlushGen ) {
+			// another thread has found the pool empty, this one goes too
+			giveBack( cache );
+		} else if( cache->mPoolId == mPoolId && cache->mCount < mCacheSize ) {
+			__sync_synchronize();
+			cache->mNodes[ cache->mCount++ ] = index;
+			__sync_add_and_fetch( &mCachedCount, 1 );
+			return 0;
+		}
+	}
+
+	pushNode( &mIdleHead, index );
+
+	return 0;
+}
+
+void SP_ProcPool :: giveBack( SP_ProcIdleCache_t * cache )
+{
+	__sync_sub_and_fetch( &mCachedCount, cache->mCount );
+
+	for( ; cache->mCount > 0; ) pushNode( &mIdleHead, cache->mNodes[ --cache->mCount ] );
+
+	cache->mFlushGen = mFlushGen;
+}
+
+SP_ProcInfo * SP_ProcPool :: takeIdle( int index )
+{
+	SP_ProcIdleNode_t * node = getNode( index );
+	SP_ProcInfo * info = node->mInfo;
+
+	// only the reapers race with us, a failed CAS is read again, it
+	// finds the node exited or retired
+	uint64_t state = node->mState;
+	for( ; SP_ProcIdleNode_t::eIdle == ( state & 0xFF ); state = node->mState ) {
+		if( __sync_bool_compare_and_swap( &( node->mState ), state,
+				( state & 0xFFFFFF00ULL ) | SP_ProcIdleNode_t::eFree ) ) {
+			__sync_sub_and_fetch( &mIdleCount, 1 );
+
+			node->mInfo = NULL;
+			pushNode( &mFreeHead, index );
+
+			return info;
 		}
 	}
 
+	// the reaper has uncounted and deleted the process
+	dropNode( index, state );
+
+	return NULL;
+}
+
+void SP_ProcPool :: dropNode( int index, uint64_t state )
+{
+	SP_ProcIdleNode_t * node = getNode( index );
+
+	node->mInfo = NULL;
+	node->mState = ( state & 0xFFFFFF00ULL ) | SP_ProcIdleNode_t::eFree;
+
+	__sync_sub_and_fetch( &mDeadCount, 1 );
+
+	pushNode( &mFreeHead, index );
+}
+
+int SP_ProcPool :: sweepIdle()
+{
+	int ret = 0;
+
+	// no node is added meanwhile, so the popped ones fit
+	pthread_mutex_lock( &mGrowMutex );
+
+	int * live = (int*)malloc( sizeof( int ) * mNodeCount );
+
+	if( NULL != live && mDeadCount > 0 ) {
+		mIsSweeping = 1;
+
+		int count = 0;
+		for( int index = popNode( &mIdleHead ); index >= 0; index = popNode( &mIdleHead ) ) {
+			uint64_t state = getNode( index )->mState;
+
+			if( SP_ProcIdleNode_t::eIdle == ( state & 0xFF ) ) {
+				live[ count++ ] = index;
+			} else {
+				dropNode( index, state );
+				ret++;
+			}
+		}
+
+		// in the same order
+		for( ; count > 0; ) pushNode( &mIdleHead, live[ --count ] );
+
+		mIsSweeping = 0;
+	}
+
+	pthread_mutex_unlock( &mGrowMutex );
+
+	free( live );
+
+	return ret;
+}
+
+int SP_ProcPool :: ensureIdleProc( int idleCount )
+{
+	if( mMaxIdleProc > 0 && idleCount > mMaxIdleProc ) idleCount = mMaxIdleProc;
+	if( idleCount > MAX_IDLE_NODES ) idleCount = MAX_IDLE_NODES;
+
+	for( int count = idleCount - getIdleCount(); count > 0; ) {
+		SP_ProcInfo * procList[ SP_ProcPduUtils::MAX_PASS_FDS ];
+
+		int created = create( procList, count );
+		for( int i = 0; i < created; i++ ) saveIdle( procList[i], 0 );
+
+		if( created <= 0 ) break;
+
+		count -= created;
+	}
+
 	return getIdleCount();
 }
 
@@ -259,88 +983,398 @@ SP_ProcInfo * SP_ProcPool :: get()
 {
 	SP_ProcInfo * ret = NULL;
 
-	pthread_mutex_lock( &mMutex );
+	SP_ProcIdleCache_t * cache = &gIdleCache;
 
-	for( ; NULL == ret && mList->getCount() > 0; ) {
-		// get the last one from pool
-		ret = mList->takeItem( mList->getCount() - 1);
+	// nobody else reaps the exits, it costs an epoll_wait like the
+	// kill( pid, 0 ) probe did
+	if( ! mIsExitWatched ) reapExited();
 
-		if( 0 != kill( ret->getPid(), 0 ) ) {
+	for( ; NULL == ret; ) {
+		if( cache->mCount > 0 && cache->mPoolId == mPoolId && cache->mFlushGen != mFlushGen ) {
+			giveBack( cache );
+		}
+
+		// the last one saved by this thread first
+		int index = -1;
+		if( cache->mCount > 0 && cache->mPoolId == mPoolId ) {
+			index = cache->mNodes[ --cache->mCount ];
+			__sync_sub_and_fetch( &mCachedCount, 1 );
+		} else {
+			index = popNode( &mIdleHead );
+		}
+
+		// the idle stack is empty while it is swept, wait for it
+		if( index < 0 && mIsSweeping ) {
+			pthread_mutex_lock( &mGrowMutex );
+			pthread_mutex_unlock( &mGrowMutex );
+			index = popNode( &mIdleHead );
+		}
+
+		// the others hold the idle ones, ask them to give them back
+		if( index < 0 && mCachedCount > 0 ) __sync_add_and_fetch( &mFlushGen, 1 );
+
+		if( index < 0 ) break;
+
+		ret = takeIdle( index );
+
+		// without a pidfd the exit is not reported, so probe it, and one
+		// which has exited while it was saved is known already
+		if( NULL != ret && ( ( ret->getPidFd() < 0 && 0 != kill( ret->getPid(), 0 ) )
+				|| findBusyExit( ret->getPid(), ret->getPidFd(), 0 ) ) ) {
 			syslog( LOG_DEBUG, "DEBUG: process #%d is not exist, remove", ret->getPid() );
-			delete ret;
+			release( ret );
 			ret = NULL;
 		}
 	}
 
-	pthread_mutex_unlock( &mMutex );
-
-	if( NULL == ret ) ret = create();
+	if( NULL == ret && 1 != create( &ret, 1 ) ) ret = NULL;
 
 	if( NULL != ret ) ret->setRequests( ret->getRequests() + 1 );
 
 	return ret;
 }
 
-SP_ProcInfo * SP_ProcPool :: create()
+int SP_ProcPool :: create( SP_ProcInfo * procList[], int count )
 {
-	SP_ProcInfo * ret = NULL;
+	if( count > SP_ProcPduUtils::MAX_PASS_FDS ) count = SP_ProcPduUtils::MAX_PASS_FDS;
+
+	int appFds[ SP_ProcPduUtils::MAX_PASS_FDS ], workerFds[ SP_ProcPduUtils::MAX_PASS_FDS ];
+
+	int pairs = 0;
+	for( ; pairs < count; pairs++ ) {
+		int pipeFd[ 2 ] = { -1, -1 };
+		if( 0 != socketpair( AF_UNIX, SOCK_STREAM, 0, pipeFd ) ) {
+			syslog( LOG_WARNING, "socketpair fail, errno %d, %s", errno, strerror( errno ) );
+			break;
+		}
+		workerFds[ pairs ] = pipeFd[0];
+		appFds[ pairs ] = pipeFd[1];
+	}
+
+	int ret = 0;
+
+	if( pairs > 0 ) {
+		// only the manager channel is locked, get/save are not blocked by fork
+		pthread_mutex_lock( &mMgrMutex );
+
+		if( 0 == SP_ProcPduUtils::send_fds( mMgrPipe, workerFds, pairs ) ) {
+			for( int i = 0; i < pairs; i++ ) {
+				SP_ProcPdu_t pdu;
+				if( SP_ProcPduUtils::read_pdu( mMgrPipe, &pdu, NULL ) <= 0 ) break;
 
-	int pipeFd[ 2 ] = { -1, -1 };
-	if( 0 == socketpair( AF_UNIX, SOCK_STREAM, 0, pipeFd ) ) {
-		pthread_mutex_lock( &mMutex );
-		if( 0 == SP_ProcPduUtils::send_fd( mMgrPipe, pipeFd[0] ) ) {
-			SP_ProcPdu_t pdu;
-			if( SP_ProcPduUtils::read_pdu( mMgrPipe, &pdu, NULL ) > 0 ) {
 				if( pdu.mSrcPid > 0 ) {
-					ret = new SP_ProcInfo( pipeFd[1] );
-					ret->setPid( pdu.mSrcPid );
+					procList[ ret ] = new SP_ProcInfo( appFds[i] );
+					procList[ ret ]->setPid( pdu.mSrcPid );
+					watchExit( procList[ ret ] );
+					appFds[i] = -1;
+					ret++;
 				} else {
 					pdu.mSrcPid = abs( pdu.mSrcPid );
 					syslog( LOG_WARNING, "WARN: cannot create process, errno %d, %s",
 							pdu.mSrcPid, strerror( pdu.mSrcPid ) );
 				}
 			}
-			if( NULL == ret ) close( pipeFd[1] );
 		} else {
 			syslog( LOG_WARNING, "WARN: send fd fail, errno %d, %s",
 					errno, strerror( errno ) );
 		}
-		close( pipeFd[0] );
-		pthread_mutex_unlock( &mMutex );
-	} else {
-		syslog( LOG_WARNING, "socketpair fail, errno %d, %s", errno, strerror( errno ) );
+
+		pthread_mutex_unlock( &mMgrMutex );
+	}
+
+	for( int i = 0; i < pairs; i++ ) {
+		close( workerFds[i] );
+		if( appFds[i] >= 0 ) close( appFds[i] );
 	}
 
 	return ret;
 }
 
 void SP_ProcPool :: save( SP_ProcInfo * procInfo )
+{
+	saveIdle( procInfo, 1 );
+}
+
+void SP_ProcPool :: saveIdle( SP_ProcInfo * procInfo, int isCache )
 {
 	if( mMaxRequestsPerProc > 0 && procInfo->getRequests() >= mMaxRequestsPerProc ) {
 		syslog( LOG_DEBUG, "DEBUG: process #%d serve %d requests, remove",
 				procInfo->getPid(), procInfo->getRequests() );
-		delete procInfo;
+		release( procInfo );
+	} else if( SP_ProcMemUtils::isOverLimit( procInfo->getPid(), procInfo->getRequests(),
+			&mMemLimit, procInfo->getMemInfo() ) ) {
+		release( procInfo );
 	} else {
-		pthread_mutex_lock( &mMutex );
-
-		if( mMaxIdleProc > 0 && mList->getCount() >= mMaxIdleProc ) {
-			syslog( LOG_DEBUG, "DEBUG: too many idle process, remove process #%d",
-					procInfo->getPid() );
-			delete procInfo;
-		} else {
-			syslog( LOG_DEBUG, "DEBUG: save process #%d", procInfo->getPid() );
-
-			procInfo->setLastActiveTime( time( NULL ) );
-			mList->append( procInfo );
+		// another thread may take the process as soon as it is idle
+		pid_t pid = procInfo->getPid();
+		int pidFd = procInfo->getPidFd();
+
+		if( ( mMaxIdleProc > 0 && mIdleCount >= mMaxIdleProc ) || 0 != putIdle( procInfo, isCache ) ) {
+			syslog( LOG_DEBUG, "DEBUG: too many idle process, remove process #%d", pid );
+			release( procInfo );
+		} else if( findBusyExit( pid, pidFd, 0 ) ) {
+			/* checked after the node is idle, so reapExited either has
+			 * recorded the exit, or finds the node. The record is kept,
+			 * another thread may take the process before removeIdle,
+			 * then its save finds the record again
+			 */
+			syslog( LOG_DEBUG, "DEBUG: process #%d exited while busy, remove", pid );
+			removeIdle( pid, pidFd );
 		}
-
-		pthread_mutex_unlock( &mMutex );
 	}
 }
 
 void SP_ProcPool :: erase( SP_ProcInfo * procInfo )
 {
 	syslog( LOG_DEBUG, "DEBUG: erase process #%d", procInfo->getPid() );
+	release( procInfo );
+}
+
+void SP_ProcPool :: release( SP_ProcInfo * procInfo )
+{
+	// counted by watchExit
+	if( mExitFd >= 0 && procInfo->getPidFd() < 0 ) __sync_sub_and_fetch( &mPidFdFails, 1 );
+
+	findBusyExit( procInfo->getPid(), procInfo->getPidFd(), 1 );
+
 	delete procInfo;
 }
 
+void SP_ProcPool :: addBusyExit( pid_t pid, int pidFd )
+{
+	pthread_mutex_lock( &mBusyExitMutex );
+
+	if( mBusyExitCount >= mMaxBusyExits ) {
+		mMaxBusyExits = mMaxBusyExits * 2 + 8;
+		mBusyExits = (uint64_t*)realloc( mBusyExits, sizeof( uint64_t ) * mMaxBusyExits );
+		assert( NULL != mBusyExits );
+	}
+
+	mBusyExits[ mBusyExitCount++ ] = ( (uint64_t)pidFd << 32 ) | (unsigned int)pid;
+
+	pthread_mutex_unlock( &mBusyExitMutex );
+}
+
+int SP_ProcPool :: findBusyExit( pid_t pid, int pidFd, int isRemove )
+{
+	// checked without the lock, an exit of a busy process is rare
+	if( mBusyExitCount <= 0 || pidFd < 0 ) return 0;
+
+	uint64_t key = ( (uint64_t)pidFd << 32 ) | (unsigned int)pid;
+
+	int ret = 0;
+
+	pthread_mutex_lock( &mBusyExitMutex );
+
+	for( int i = 0; i < mBusyExitCount; i++ ) {
+		if( key == mBusyExits[i] ) {
+			if( isRemove ) mBusyExits[i] = mBusyExits[ --mBusyExitCount ];
+			ret = 1;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock( &mBusyExitMutex );
+
+	return ret;
+}
+
+int SP_ProcPool :: getExitFd() const
+{
+	return mExitFd;
+}
+
+void SP_ProcPool :: setExitWatched( int isWatched )
+{
+	mIsExitWatched = isWatched;
+}
+
+void SP_ProcPool :: watchExit( SP_ProcInfo * procInfo )
+{
+	if( mExitFd < 0 ) return;
+
+	// the exit pipe has to search the idle nodes for it
+	__sync_add_and_fetch( &mPidFdFails, 1 );
+
+#ifdef SYS_pidfd_open
+	/* the pidfd is opened as soon as the manager replies, it refers to
+	 * this process even if the pid is reused later
+	 */
+	int pidFd = syscall( SYS_pidfd_open, procInfo->getPid(), 0 );
+	if( pidFd < 0 ) {
+		syslog( LOG_WARNING, "WARN: pidfd_open #%d fail, errno %d, %s",
+				procInfo->getPid(), errno, strerror( errno ) );
+		return;
+	}
+
+	struct epoll_event event;
+	memset( &event, 0, sizeof( event ) );
+	event.events = EPOLLIN | EPOLLET;
+	event.data.u64 = ( (uint64_t)pidFd << 32 ) | (unsigned int)procInfo->getPid();
+
+	if( 0 != epoll_ctl( mExitFd, EPOLL_CTL_ADD, pidFd, &event ) ) {
+		syslog( LOG_WARNING, "WARN: epoll_ctl fail, errno %d, %s", errno, strerror( errno ) );
+		close( pidFd );
+		return;
+	}
+
+	procInfo->setPidFd( pidFd );
+
+	__sync_sub_and_fetch( &mPidFdFails, 1 );
+#endif
+}
+
+void SP_ProcPool :: setExitCallback( ExitFunc_t exitCallback, void * arg )
+{
+	mExitCallback = exitCallback;
+	mExitCallbackArg = arg;
+}
+
+int SP_ProcPool :: reapExited()
+{
+	if( mExitFd < 0 ) return 0;
+
+	static const int SP_PROC_MAX_EVENTS = 64;
+	struct epoll_event events[ SP_PROC_MAX_EVENTS ];
+
+	int count = 0;
+
+	for( int nevents = SP_PROC_MAX_EVENTS; SP_PROC_MAX_EVENTS == nevents; ) {
+		nevents = epoll_wait( mExitFd, events, SP_PROC_MAX_EVENTS, 0 );
+
+		for( int i = 0; i < nevents; i++ ) {
+			if( SP_PROC_IDLE_TIMER == events[i].data.u64 ) {
+				uint64_t value = 0;
+				read( mIdleTimer, &value, sizeof( value ) );
+				count += reapIdle();
+				continue;
+			}
+
+			pid_t pid = (pid_t)( events[i].data.u64 & 0xFFFFFFFF );
+			int pidFd = (int)( events[i].data.u64 >> 32 );
+
+			if( 0 == pid ) {
+				count += readExitPipe();
+			} else {
+				// recorded first, a busy process is left to its owner,
+				// and is dropped if it is saved, see save(), an idle one
+				// is released with its record
+				addBusyExit( pid, pidFd );
+				__sync_synchronize();
+
+				count += removeIdle( pid, pidFd );
+			}
+		}
+	}
+
+	return count;
+}
+
+int SP_ProcPool :: readExitPipe()
+{
+	int count = 0;
+
+	for( ; ; ) {
+		SP_ProcExitPdu_t msg;
+
+		int len = recv( mExitPipe, &msg, sizeof( msg ), MSG_DONTWAIT );
+
+		if( len < 0 ) {
+			if( EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno ) {
+				syslog( LOG_WARNING, "WARN: recv exit fail, errno %d, %s", errno, strerror( errno ) );
+			}
+			break;
+		}
+
+		if( 0 == len ) {
+			// the process manager has gone
+			epoll_ctl( mExitFd, EPOLL_CTL_DEL, mExitPipe, NULL );
+			break;
+		}
+
+		if( (int)sizeof( msg ) != len || SP_ProcPdu_t::MAGIC_NUM != msg.mPdu.mMagicNum
+				|| SP_ProcPdu_t::eExit != msg.mPdu.mType ) {
+			syslog( LOG_WARNING, "WARN: invalid exit pdu, len %d", len );
+			continue;
+		}
+
+		const SP_ProcExit_t * procExit = &( msg.mExit );
+
+		if( WIFSIGNALED( procExit->mStatus ) ) {
+			syslog( LOG_WARNING, "WARN: process #%d killed by signal %d, maxrss %ld KB",
+					procExit->mPid, WTERMSIG( procExit->mStatus ), procExit->mUsage.ru_maxrss );
+		} else {
+			syslog( LOG_DEBUG, "DEBUG: process #%d exit %d, maxrss %ld KB",
+					procExit->mPid, WEXITSTATUS( procExit->mStatus ), procExit->mUsage.ru_maxrss );
+		}
+
+		// the pid may be reused by a new process already, a process
+		// with a pidfd is reported by the pidfd
+		if( mPidFdFails > 0 ) count += removeIdle( procExit->mPid, -1 );
+
+		if( NULL != mExitCallback ) mExitCallback( procExit, mExitCallbackArg );
+	}
+
+	return count;
+}
+
+int SP_ProcPool :: findIdle( pid_t pid )
+{
+	/* the hint is the node the pid was saved in last. If the pid has gone
+	 * from it, the process is not idle, a later save would have moved the
+	 * hint. Only a hint taken by another pid of the same slot, or a pid
+	 * which is never saved, makes us search the nodes
+	 */
+	uint64_t hint = mPidHints[ (unsigned int)pid % PID_HINTS ];
+
+	if( pid == (pid_t)( hint >> 32 ) && ( hint & 0xFFFFFFFF ) > 0 ) {
+		int index = (int)( hint & 0xFFFFFFFF ) - 1;
+		uint64_t state = getNode( index )->mState;
+
+		if( SP_ProcIdleNode_t::eIdle == ( state & 0xFF ) && pid == (pid_t)( state >> 32 ) ) return index;
+
+		return -1;
+	}
+
+	int nodeCount = mNodeCount;
+
+	for( int i = 0; i < nodeCount; i++ ) {
+		uint64_t state = getNode( i )->mState;
+
+		if( SP_ProcIdleNode_t::eIdle == ( state & 0xFF ) && pid == (pid_t)( state >> 32 ) ) return i;
+	}
+
+	return -1;
+}
+
+int SP_ProcPool :: removeIdle( pid_t pid, int pidFd )
+{
+	int index = findIdle( pid );
+	if( index < 0 ) return 0;
+
+	SP_ProcIdleNode_t * node = getNode( index );
+
+	uint64_t state = node->mState;
+	if( SP_ProcIdleNode_t::eIdle != ( state & 0xFF ) || pid != (pid_t)( state >> 32 ) ) return 0;
+
+	// the pid may be reused already, the gen in the CAS covers mPidFd
+	if( pidFd != node->mPidFd ) return 0;
+
+	// the info belongs to the state read above, or the CAS fails
+	__sync_synchronize();
+	SP_ProcInfo * info = node->mInfo;
+
+	// the node is dropped by the one who pops it, the info is ours
+	if( ! __sync_bool_compare_and_swap( &( node->mState ), state,
+			( state & ~0xFFULL ) | SP_ProcIdleNode_t::eExited ) ) {
+		return 0;
+	}
+
+	__sync_sub_and_fetch( &mIdleCount, 1 );
+	__sync_add_and_fetch( &mDeadCount, 1 );
+
+	syslog( LOG_DEBUG, "DEBUG: process #%d exited, remove", pid );
+	release( info );
+
+	return 1;
+}
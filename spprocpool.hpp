@@ -8,8 +8,17 @@
 
 #include <sys/types.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <time.h>
 
+#include "spprocmem.hpp"
+
+class SP_ProcRingChannel;
+
+typedef struct tagSP_ProcExit SP_ProcExit_t;
+typedef struct tagSP_ProcIdleNode SP_ProcIdleNode_t;
+typedef struct tagSP_ProcIdleCache SP_ProcIdleCache_t;
+
 class SP_ProcInfo {
 public:
 	static const char CHAR_BUSY;
@@ -19,6 +28,11 @@ public:
 	SP_ProcInfo( int pipeFd );
 	~SP_ProcInfo();
 
+	// allocated from a slab instead of one heap block per process,
+	// other sizes ( derived classes ) go to the heap
+	static void * operator new( size_t size );
+	static void operator delete( void * ptr, size_t size );
+
 	void setPid( pid_t pid );
 	pid_t getPid() const;
 
@@ -33,6 +47,21 @@ public:
 	void setIdle( int idle );
 	int isIdle() const;
 
+	// index of the slot in the scoreboard, -1 : no slot
+	void setSlot( int slot );
+	int getSlot() const;
+
+	// shared memory channel, deleted with the info
+	void setChannel( SP_ProcRingChannel * channel );
+	SP_ProcRingChannel * getChannel() const;
+
+	// pidfd of the process, closed with the info, -1 : not supported
+	void setPidFd( int pidFd );
+	int getPidFd() const;
+
+	// kept by the SP_ProcMemLimit_t check of the pool
+	SP_ProcMemInfo_t * getMemInfo();
+
 	void dump() const;
 
 private:
@@ -42,8 +71,15 @@ private:
 	int mRequests;
 	time_t mLastActiveTime;
 	char mIsIdle;
+	int mSlot;
+	SP_ProcRingChannel * mChannel;
+	int mPidFd;
+	SP_ProcMemInfo_t mMemInfo;
 };
 
+// Items are indexed by pid and by pipe fd, lookup and removal are O(1).
+// takeItem moves the last item into the hole, so the order is not kept,
+// except that taking the last item leaves the others untouched.
 class SP_ProcInfoList {
 public:
 	SP_ProcInfoList();
@@ -51,10 +87,12 @@ public:
 
 	int getCount() const;
 
+	// the pid and pipe fd of the item must not be changed while in the list
 	void append( SP_ProcInfo * info );
 	SP_ProcInfo * getItem( int index ) const;
 	SP_ProcInfo * takeItem( int index );
 
+	// -1 : not exists, an unset pid ( -1 ) is never found
 	int findByPid( pid_t pid ) const;
 	int findByPipeFd( int pipeFd ) const;
 
@@ -64,43 +102,221 @@ private:
 	SP_ProcInfo ** mList;
 	int mMaxCount;
 	int mCount;
+
+	// pipe fd -> index, -1 : not exists
+	int * mFdIndex;
+	int mFdIndexSize;
+
+	// pid -> index, open addressing with linear probing, 0 is empty
+	typedef struct tagPidEntry {
+		pid_t mPid;
+		int mIndex;
+	} PidEntry_t;
+
+	PidEntry_t * mPidTable;
+	int mPidTableSize;
+
+	int findPidEntry( pid_t pid ) const;
+	void insertPid( pid_t pid, int index );
+	void removePid( pid_t pid );
+	void indexItem( int index );
 };
 
 class SP_ProcPool {
 public:
-	SP_ProcPool( int mgrPipe );
+	typedef void ( * ExitFunc_t )( const SP_ProcExit_t * procExit, void * arg );
+
+	// exitPipe : the exit pdus of the process manager, -1 : none
+	SP_ProcPool( int mgrPipe, int exitPipe = -1 );
 	~SP_ProcPool();
 
 	// default is 0, unlimited
 	void setMaxRequestsPerProc( int maxRequestsPerProc );
 	int getMaxRequestsPerProc() const;
 
-	// default is 0, unlimited
+	// default is unlimited, the processes over the limit are not saved
+	void setMemLimit( const SP_ProcMemLimit_t * memLimit );
+
+	// default is 0, unlimited, but no more than MAX_IDLE_NODES
 	void setMaxIdleProc( int maxIdleProc );
 
+	/* default is 0, no cache. Each calling thread keeps up to cacheSize
+	 * of the processes it saves, and takes them first in get(). It suits
+	 * the threads which both get and save, a thread which only saves holds
+	 * them until it calls the pool again. The cached processes are not
+	 * counted by getIdleCount, ensureIdleProc never caches. When get() of
+	 * another thread finds the pool empty, each cache is given back by the
+	 * next get or save of its thread, and at the latest when it exits
+	 */
+	void setThreadCache( int cacheSize );
+
+	/* default is 0, never. The idle processes unused for idleTimeout seconds
+	 * are retired by reapExited, the least recently used first, but
+	 * minIdleProc of them are kept. The timer is in the exit fd, so they
+	 * are only retired while it is serviced, by the loop which watches it,
+	 * or else by get(). An app which does neither can call reapIdle
+	 */
+	void setIdleTimeout( int idleTimeout, int minIdleProc = 0 );
+
+	// retire the expired idle processes now, @return the count
+	int reapIdle();
+
+	// create the missing processes in batches, @return the idle count
 	int ensureIdleProc( int idleCount );
 
+	// the processes in the thread caches are not counted
 	int getIdleCount();
 
+	// lock-free, the idle processes are not probed. Unless the exit fd is
+	// watched, get() calls reapExited first, so the idle processes which
+	// have exited are removed before one is taken
 	SP_ProcInfo * get();
 
+	// readable when a process has exited, watch it in the event loop
+	// of the app and call reapExited
+	int getExitFd() const;
+
+	// default is 0, set it when an event loop watches getExitFd(), then
+	// get() leaves the exits to the loop
+	void setExitWatched( int isWatched );
+
+	// remove the exited processes from the idle list, and retire the
+	// expired ones if the idle timer fires, @return the count
+	int reapExited();
+
+	// called by reapExited for every exit reported by the process manager,
+	// busy processes included, it runs in the thread of get() unless the
+	// exit fd is watched
+	void setExitCallback( ExitFunc_t exitCallback, void * arg );
+
 	void save( SP_ProcInfo * procInfo );
 
 	void erase( SP_ProcInfo * procInfo );
 
 	void dump() const;
 
+	// the nodes grow in chunks which are freed with the pool
+	enum { NODE_CHUNK = 1024, MAX_NODE_CHUNKS = 4096 };
+	enum { MAX_IDLE_NODES = NODE_CHUNK * MAX_NODE_CHUNKS };
+
+	// the size of the pid -> node hints, see removeIdle
+	enum { PID_HINTS = 4096 };
+
 private:
 
-	SP_ProcInfo * create();
+	// ask the process manager for up to count processes in one message,
+	// @return the count of created processes
+	int create( SP_ProcInfo * procList[], int count );
 
 	// pipes to communicate between process manager and app
 	int mMgrPipe;
+	pthread_mutex_t mMgrMutex;
+
+	// the idle processes, Treiber stacks of node indexes, see spprocpool.cpp
+	SP_ProcIdleNode_t ** mChunks;
+	volatile int mNodeCount;
+	pthread_mutex_t mGrowMutex;
+	volatile uint64_t mIdleHead;
+	volatile uint64_t mFreeHead;
+	volatile int mIdleCount;
+
+	// pid << 32 | ( index + 1 ) of the node a pid was last saved in
+	volatile uint64_t * mPidHints;
+
+	// the exited or retired nodes still in a stack, see sweepIdle
+	volatile int mDeadCount;
+	volatile int mIsSweeping;
+
+	unsigned int mPoolId;
+	int mCacheSize;
 
-	SP_ProcInfoList * mList;
-	pthread_mutex_t mMutex;
+	// the processes in the thread caches, and the count of the get()
+	// calls which have found the pool empty, the caches are given back
+	// when it changes
+	volatile int mCachedCount;
+	volatile unsigned int mFlushGen;
+
+	// the live pools, for the thread caches given back at thread exit
+	SP_ProcPool * mNextPool;
 
 	int mMaxRequestsPerProc, mMaxIdleProc;
+	SP_ProcMemLimit_t mMemLimit;
+
+	// an epoll set of the pidfds, edge triggered, so every exit is
+	// reported once, data is the pidfd << 32 | pid, the exit pipe,
+	// data is 0, and the idle timer
+	int mExitFd;
+	int mExitPipe;
+	volatile int mIsExitWatched;
+
+	int mIdleTimeout, mMinIdleProc;
+	int mIdleTimer;
+
+	// the processes without a pidfd, their exits are found by the exit pipe
+	volatile int mPidFdFails;
+
+	// the events of the processes which exited while busy, they are
+	// dropped instead of being saved
+	uint64_t * mBusyExits;
+	int mBusyExitCount, mMaxBusyExits;
+	pthread_mutex_t mBusyExitMutex;
+
+	void addBusyExit( pid_t pid, int pidFd );
+
+	// 1 : the process has exited while busy, isRemove : drop the record,
+	// else it is kept until the process is released
+	int findBusyExit( pid_t pid, int pidFd, int isRemove );
+
+	// delete a process which leaves the pool, and uncount it in mPidFdFails
+	void release( SP_ProcInfo * procInfo );
+
+	ExitFunc_t mExitCallback;
+	void * mExitCallbackArg;
+
+	void watchExit( SP_ProcInfo * procInfo );
+
+	// @return the count of the removed processes
+	int readExitPipe();
+
+	// pidFd : the pidfd which reports the exit, -1 : the process has no
+	// pidfd, the process is deleted at once
+	// @return 1 : removed, 0 : not an idle process
+	int removeIdle( pid_t pid, int pidFd );
+
+	// the node of an idle process, -1 : not found
+	int findIdle( pid_t pid );
+
+	SP_ProcIdleNode_t * getNode( int index ) const;
+
+	// add a chunk of free nodes, 0 : OK, -1 : no more
+	int growNodes();
+
+	// the pthread key destructor of the thread cache
+	static void flushCache( void * arg );
+
+	// @return the index, -1 : empty
+	int popNode( volatile uint64_t * head );
+
+	void pushNode( volatile uint64_t * head, int index );
+
+	// isCache : the process may go to the cache of the calling thread
+	void saveIdle( SP_ProcInfo * procInfo, int isCache );
+
+	// 0 : OK, -1 : no free node
+	int putIdle( SP_ProcInfo * procInfo, int isCache );
+
+	// push the cache of the calling thread to the idle stack
+	void giveBack( SP_ProcIdleCache_t * cache );
+
+	// NULL : the process has exited and is deleted
+	SP_ProcInfo * takeIdle( int index );
+
+	// put a popped exited or retired node back to the free stack
+	void dropNode( int index, uint64_t state );
+
+	// drop the exited and retired nodes left in the idle stack,
+	// @return the count
+	int sweepIdle();
 };
 
 #endif
@@ -0,0 +1,310 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <assert.h>
+
+#include "spprocring.hpp"
+
+#include "spprocpdu.hpp"
+
+typedef struct tagSP_ProcRingMsg {
+	enum { PAD_SIZE = 0xFFFFFFFF };
+
+	unsigned int mSize;
+	unsigned int mSeqNo;
+} SP_ProcRingMsg_t;
+
+SP_ProcRing :: SP_ProcRing()
+{
+	mCtrl = NULL;
+	mData = NULL;
+	mSize = 0;
+}
+
+SP_ProcRing :: ~SP_ProcRing()
+{
+}
+
+void SP_ProcRing :: init( SP_ProcRingCtrl_t * ctrl, char * data, unsigned int size )
+{
+	mCtrl = ctrl;
+	mData = data;
+	mSize = size;
+}
+
+int SP_ProcRing :: push( unsigned int seqNo, const void * data, size_t len )
+{
+	unsigned int need = ( sizeof( SP_ProcRingMsg_t ) + len + 7 ) & ~7;
+
+	// keep room for the padding at the end
+	if( len > mSize / 2 || need > mSize / 2 ) return -1;
+
+	unsigned int head = mCtrl->mHead;
+	unsigned int used = head - mCtrl->mTail;
+	unsigned int tailRoom = mSize - ( head & ( mSize - 1 ) );
+
+	if( need > tailRoom ) {
+		if( used + tailRoom + need > mSize ) return -1;
+
+		SP_ProcRingMsg_t * pad = (SP_ProcRingMsg_t*)( mData + ( head & ( mSize - 1 ) ) );
+		pad->mSize = SP_ProcRingMsg_t::PAD_SIZE;
+
+		head += tailRoom;
+		used += tailRoom;
+	}
+
+	if( used + need > mSize ) return -1;
+
+	SP_ProcRingMsg_t * msg = (SP_ProcRingMsg_t*)( mData + ( head & ( mSize - 1 ) ) );
+	msg->mSize = len;
+	msg->mSeqNo = seqNo;
+	if( len > 0 ) memcpy( msg + 1, data, len );
+
+	__sync_synchronize();
+
+	mCtrl->mHead = head + need;
+
+	return 0;
+}
+
+int SP_ProcRing :: pop( unsigned int * seqNo, SP_ProcDataBlock * block )
+{
+	unsigned int tail = mCtrl->mTail;
+
+	for( ; ; ) {
+		if( tail == mCtrl->mHead ) return 0;
+
+		__sync_synchronize();
+
+		SP_ProcRingMsg_t * msg = (SP_ProcRingMsg_t*)( mData + ( tail & ( mSize - 1 ) ) );
+
+		if( SP_ProcRingMsg_t::PAD_SIZE == msg->mSize ) {
+			tail += mSize - ( tail & ( mSize - 1 ) );
+			continue;
+		}
+
+		char * buff = (char*)block->alloc( msg->mSize );
+		assert( NULL != buff );
+		memcpy( buff, msg + 1, msg->mSize );
+
+		* seqNo = msg->mSeqNo;
+
+		tail += ( sizeof( SP_ProcRingMsg_t ) + msg->mSize + 7 ) & ~7;
+
+		__sync_synchronize();
+
+		mCtrl->mTail = tail;
+
+		return 1;
+	}
+}
+
+int SP_ProcRing :: isEmpty() const
+{
+	return mCtrl->mTail == mCtrl->mHead;
+}
+
+int SP_ProcRing :: sleep()
+{
+	mCtrl->mIsSleeping = 1;
+
+	// pairs with the barrier between push and isSleeping
+	__sync_synchronize();
+
+	if( isEmpty() ) return 1;
+
+	mCtrl->mIsSleeping = 0;
+
+	return 0;
+}
+
+void SP_ProcRing :: awake()
+{
+	mCtrl->mIsSleeping = 0;
+}
+
+int SP_ProcRing :: isSleeping() const
+{
+	__sync_synchronize();
+
+	return mCtrl->mIsSleeping;
+}
+
+//-------------------------------------------------------------------
+
+SP_ProcRingChannel :: SP_ProcRingChannel()
+{
+	for( int i = 0; i < FD_COUNT; i++ ) mFds[i] = -1;
+
+	mEpollFd = mWatchFd = -1;
+
+	mHeader = NULL;
+	mMapSize = 0;
+}
+
+SP_ProcRingChannel :: ~SP_ProcRingChannel()
+{
+	if( mEpollFd >= 0 && 0 != epoll_ctl( mEpollFd, EPOLL_CTL_DEL, mWatchFd, NULL ) ) {
+		syslog( LOG_WARNING, "WARN: unwatch ring fail, errno %d, %s", errno, strerror( errno ) );
+	}
+	mEpollFd = mWatchFd = -1;
+
+	if( NULL != mHeader ) munmap( mHeader, mMapSize );
+	mHeader = NULL;
+
+	for( int i = 0; i < FD_COUNT; i++ ) {
+		if( mFds[i] >= 0 ) close( mFds[i] );
+		mFds[i] = -1;
+	}
+}
+
+int SP_ProcRingChannel :: map()
+{
+	struct stat st;
+	if( 0 != fstat( mFds[0], &st ) || st.st_size < (off_t)sizeof( Header_t ) ) {
+		syslog( LOG_WARNING, "WARN: invalid ring memfd, errno %d, %s", errno, strerror( errno ) );
+		return -1;
+	}
+
+	mMapSize = st.st_size;
+
+	void * addr = mmap( NULL, mMapSize, PROT_READ | PROT_WRITE, MAP_SHARED, mFds[0], 0 );
+	if( MAP_FAILED == addr ) {
+		syslog( LOG_WARNING, "WARN: mmap ring fail, errno %d, %s", errno, strerror( errno ) );
+		return -1;
+	}
+
+	mHeader = (Header_t*)addr;
+
+	unsigned int ringSize = mHeader->mRingSize;
+	if( sizeof( Header_t ) + 2 * (size_t)ringSize > mMapSize ) {
+		syslog( LOG_WARNING, "WARN: invalid ring size %u", ringSize );
+		return -1;
+	}
+
+	char * data = (char*)( mHeader + 1 );
+
+	mRings[ eRequest ].init( &( mHeader->mCtrl[ eRequest ] ), data, ringSize );
+	mRings[ eReply ].init( &( mHeader->mCtrl[ eReply ] ), data + ringSize, ringSize );
+
+	return 0;
+}
+
+int SP_ProcRingChannel :: create( size_t ringSize, int spinUsec )
+{
+	unsigned int size = 4096;
+	for( ; size < ringSize && size < 0x40000000; ) size = size * 2;
+
+	mFds[0] = memfd_create( "spprocring", MFD_CLOEXEC );
+	mFds[1] = eventfd( 0, EFD_NONBLOCK );
+	mFds[2] = eventfd( 0, EFD_NONBLOCK );
+
+	if( mFds[0] < 0 || mFds[1] < 0 || mFds[2] < 0 ) {
+		syslog( LOG_WARNING, "WARN: create ring fds fail, errno %d, %s", errno, strerror( errno ) );
+		return -1;
+	}
+
+	if( 0 != ftruncate( mFds[0], sizeof( Header_t ) + 2 * (size_t)size ) ) {
+		syslog( LOG_WARNING, "WARN: ftruncate ring fail, errno %d, %s", errno, strerror( errno ) );
+		return -1;
+	}
+
+	Header_t header;
+	memset( &header, 0, sizeof( header ) );
+	header.mRingSize = size;
+	header.mSpinUsec = spinUsec;
+
+	// the consumers are asleep until they find out the rings
+	header.mCtrl[ eRequest ].mIsSleeping = 1;
+	header.mCtrl[ eReply ].mIsSleeping = 1;
+
+	if( sizeof( header ) != pwrite( mFds[0], &header, sizeof( header ), 0 ) ) {
+		syslog( LOG_WARNING, "WARN: init ring fail, errno %d, %s", errno, strerror( errno ) );
+		return -1;
+	}
+
+	return map();
+}
+
+int SP_ProcRingChannel :: attach( const int fds[] )
+{
+	for( int i = 0; i < FD_COUNT; i++ ) mFds[i] = fds[i];
+
+	return map();
+}
+
+void SP_ProcRingChannel :: getFds( int fds[] ) const
+{
+	for( int i = 0; i < FD_COUNT; i++ ) fds[i] = mFds[i];
+}
+
+int SP_ProcRingChannel :: send( int which, unsigned int seqNo, const void * data, size_t len )
+{
+	SP_ProcRing * ring = &( mRings[ which ] );
+
+	if( 0 != ring->push( seqNo, data, len ) ) return -1;
+
+	if( ring->isSleeping() ) {
+		uint64_t value = 1;
+		if( write( mFds[ 1 + which ], &value, sizeof( value ) ) < 0 && EAGAIN != errno ) {
+			syslog( LOG_WARNING, "WARN: wakeup ring fail, errno %d, %s", errno, strerror( errno ) );
+		}
+	}
+
+	return 0;
+}
+
+int SP_ProcRingChannel :: recv( int which, unsigned int * seqNo, SP_ProcDataBlock * block )
+{
+	return mRings[ which ].pop( seqNo, block );
+}
+
+int SP_ProcRingChannel :: sleep( int which )
+{
+	return mRings[ which ].sleep();
+}
+
+void SP_ProcRingChannel :: awake( int which )
+{
+	mRings[ which ].awake();
+}
+
+int SP_ProcRingChannel :: getEventFd( int which ) const
+{
+	return mFds[ 1 + which ];
+}
+
+void SP_ProcRingChannel :: clearEvent( int which )
+{
+	uint64_t value = 0;
+	read( mFds[ 1 + which ], &value, sizeof( value ) );
+}
+
+int SP_ProcRingChannel :: watch( int which, int epollFd, struct epoll_event * event )
+{
+	if( 0 != epoll_ctl( epollFd, EPOLL_CTL_ADD, mFds[ 1 + which ], event ) ) return -1;
+
+	mEpollFd = epollFd;
+	mWatchFd = mFds[ 1 + which ];
+
+	return 0;
+}
+
+int SP_ProcRingChannel :: getSpinUsec() const
+{
+	return mHeader->mSpinUsec;
+}
+
@@ -0,0 +1,130 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spprocring_hpp__
+#define __spprocring_hpp__
+
+#include <sys/types.h>
+
+class SP_ProcDataBlock;
+struct epoll_event;
+
+typedef struct tagSP_ProcRingCtrl {
+	volatile unsigned int mHead;         // written by the producer
+	char mPad0[ 60 ];
+
+	volatile unsigned int mTail;         // written by the consumer
+	volatile int mIsSleeping;            // the consumer waits for the eventfd
+	char mPad1[ 56 ];
+} SP_ProcRingCtrl_t;
+
+/**
+ * A single-producer/single-consumer message ring in shared memory.
+ * A message is a 8 bytes header ( size, seq.no ) and the payload,
+ * rounded up to 8 bytes, it never wraps around the end of the ring.
+ */
+class SP_ProcRing {
+public:
+	SP_ProcRing();
+	~SP_ProcRing();
+
+	// size : power of 2
+	void init( SP_ProcRingCtrl_t * ctrl, char * data, unsigned int size );
+
+	// producer, 0 : OK, -1 : no room or too large
+	int push( unsigned int seqNo, const void * data, size_t len );
+
+	// consumer, 1 : OK, 0 : empty
+	int pop( unsigned int * seqNo, SP_ProcDataBlock * block );
+
+	int isEmpty() const;
+
+	// consumer, 1 : marked as sleeping, 0 : not empty, keep going
+	int sleep();
+
+	void awake();
+
+	// producer, must be checked after push
+	int isSleeping() const;
+
+private:
+	SP_ProcRingCtrl_t * mCtrl;
+	char * mData;
+	unsigned int mSize;
+};
+
+/**
+ * A pair of rings between the app and a worker, the request ring is
+ * consumed by the worker and the reply ring by the app. The shared
+ * memory is a memfd, the fds are passed to the worker by SCM_RIGHTS.
+ * An eventfd is only written when the consumer of the ring is sleeping.
+ */
+class SP_ProcRingChannel {
+public:
+	enum { eRequest = 0, eReply = 1 };
+
+	// memfd, request eventfd, reply eventfd
+	enum { FD_COUNT = 3 };
+
+	SP_ProcRingChannel();
+	~SP_ProcRingChannel();
+
+	// app side, ringSize : bytes of one ring, spinUsec : see getSpinUsec
+	// 0 : OK, -1 : Fail
+	int create( size_t ringSize, int spinUsec );
+
+	// worker side, the channel takes the fds
+	// 0 : OK, -1 : Fail
+	int attach( const int fds[] );
+
+	void getFds( int fds[] ) const;
+
+	// 0 : OK, -1 : no room or too large, use the socket instead
+	int send( int which, unsigned int seqNo, const void * data, size_t len );
+
+	// 1 : OK, 0 : empty
+	int recv( int which, unsigned int * seqNo, SP_ProcDataBlock * block );
+
+	// consumer, 1 : marked as sleeping, 0 : not empty, keep going
+	int sleep( int which );
+
+	void awake( int which );
+
+	// readable after a message is sent to a sleeping consumer
+	int getEventFd( int which ) const;
+
+	void clearEvent( int which );
+
+	// app side, add the eventfd to epollFd, it is removed when the channel
+	// is deleted, the worker holds the eventfd after the channel is closed
+	// 0 : OK, -1 : Fail
+	int watch( int which, int epollFd, struct epoll_event * event );
+
+	// how long the worker polls the request ring before sleeping
+	int getSpinUsec() const;
+
+private:
+	typedef struct tagHeader {
+		unsigned int mRingSize;
+		int mSpinUsec;
+		char mPad[ 56 ];
+
+		SP_ProcRingCtrl_t mCtrl[ 2 ];
+	} Header_t;
+
+	int mFds[ FD_COUNT ];
+
+	int mEpollFd, mWatchFd;
+
+	Header_t * mHeader;
+	size_t mMapSize;
+
+	SP_ProcRing mRings[ 2 ];
+
+	int map();
+};
+
+#endif
+
@@ -0,0 +1,231 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <assert.h>
+
+#include "spprocscoreboard.hpp"
+
+SP_ProcScoreboard :: SP_ProcScoreboard( int maxSlots )
+{
+	mMaxSlots = maxSlots > 0 ? maxSlots : 1;
+	mEventFd = -1;
+
+	mHeader = NULL;
+	mSlots = NULL;
+	mStats = NULL;
+	mMapSize = 0;
+
+	mFreeList = (int*)malloc( sizeof( int ) * mMaxSlots );
+	mFreeCount = 0;
+
+	memset( &mExitedLockStats, 0, sizeof( mExitedLockStats ) );
+}
+
+SP_ProcScoreboard :: ~SP_ProcScoreboard()
+{
+	if( NULL != mHeader ) munmap( mHeader, mMapSize );
+	mHeader = NULL;
+	mSlots = NULL;
+	mStats = NULL;
+
+	if( mEventFd >= 0 ) close( mEventFd );
+	mEventFd = -1;
+
+	free( mFreeList );
+	mFreeList = NULL;
+}
+
+int SP_ProcScoreboard :: init()
+{
+	mMapSize = sizeof( Header_t ) + ( sizeof( SP_ProcSlot_t ) + sizeof( SP_ProcSlotStats_t ) ) * mMaxSlots;
+
+	void * addr = mmap( NULL, mMapSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+	if( MAP_FAILED == addr ) {
+		syslog( LOG_WARNING, "WARN: mmap scoreboard fail, errno %d, %s",
+				errno, strerror( errno ) );
+		return -1;
+	}
+
+	mEventFd = eventfd( 0, EFD_NONBLOCK );
+	if( mEventFd < 0 ) {
+		syslog( LOG_WARNING, "WARN: eventfd fail, errno %d, %s", errno, strerror( errno ) );
+		munmap( addr, mMapSize );
+		return -1;
+	}
+
+	mHeader = (Header_t*)addr;
+	mSlots = (SP_ProcSlot_t*)( mHeader + 1 );
+	mStats = (SP_ProcSlotStats_t*)( mSlots + mMaxSlots );
+
+	memset( addr, 0, mMapSize );
+
+	// pop the lowest index first
+	for( int i = mMaxSlots - 1; i >= 0; i-- ) mFreeList[ mFreeCount++ ] = i;
+
+	return 0;
+}
+
+void SP_ProcScoreboard :: setIdleRange( int minIdle, int maxIdle )
+{
+	mHeader->mMinIdle = minIdle;
+	mHeader->mMaxIdle = maxIdle;
+}
+
+int SP_ProcScoreboard :: getMaxSlots() const
+{
+	return mMaxSlots;
+}
+
+int SP_ProcScoreboard :: getIdleCount() const
+{
+	return mHeader->mIdleCount;
+}
+
+int SP_ProcScoreboard :: getEventFd() const
+{
+	return mEventFd;
+}
+
+void SP_ProcScoreboard :: clearEvent()
+{
+	uint64_t value = 0;
+	read( mEventFd, &value, sizeof( value ) );
+}
+
+SP_ProcSlot_t * SP_ProcScoreboard :: getSlot( int index ) const
+{
+	return ( index >= 0 && index < mMaxSlots ) ? &( mSlots[ index ] ) : NULL;
+}
+
+SP_ProcSlotStats_t * SP_ProcScoreboard :: getStats( int index ) const
+{
+	return ( index >= 0 && index < mMaxSlots ) ? &( mStats[ index ] ) : NULL;
+}
+
+int SP_ProcScoreboard :: alloc( pid_t pid )
+{
+	if( mFreeCount <= 0 ) return -1;
+
+	int index = mFreeList[ --mFreeCount ];
+
+	SP_ProcSlot_t * slot = &( mSlots[ index ] );
+	slot->mPid = pid;
+	slot->mRequests = 0;
+	slot->mLastActiveTime = time( NULL );
+	memset( &( mStats[ index ] ), 0, sizeof( SP_ProcSlotStats_t ) );
+	slot->mState = SP_ProcSlot_t::eIdle;
+
+	__sync_add_and_fetch( &( mHeader->mIdleCount ), 1 );
+
+	return index;
+}
+
+void SP_ProcScoreboard :: release( int index )
+{
+	SP_ProcSlot_t * slot = getSlot( index );
+	if( NULL == slot ) return;
+
+	// the worker has gone, so nobody else touches the slot
+	int state = __sync_lock_test_and_set( &( slot->mState ), SP_ProcSlot_t::eFree );
+	if( SP_ProcSlot_t::eIdle == state ) __sync_sub_and_fetch( &( mHeader->mIdleCount ), 1 );
+
+	if( SP_ProcSlot_t::eFree != state ) {
+		SP_ProcLock::addStats( &mExitedLockStats, &( mStats[ index ].mLockStats ) );
+
+		slot->mPid = 0;
+		mFreeList[ mFreeCount++ ] = index;
+	}
+}
+
+void SP_ProcScoreboard :: notify()
+{
+	uint64_t value = 1;
+	if( write( mEventFd, &value, sizeof( value ) ) < 0 && EAGAIN != errno ) {
+		syslog( LOG_WARNING, "WARN: notify scoreboard fail, errno %d, %s",
+				errno, strerror( errno ) );
+	}
+}
+
+void SP_ProcScoreboard :: setBusy( int index )
+{
+	SP_ProcSlot_t * slot = getSlot( index );
+	if( NULL == slot ) return;
+
+	__sync_add_and_fetch( &( slot->mRequests ), 1 );
+	slot->mLastActiveTime = time( NULL );
+
+	if( __sync_bool_compare_and_swap( &( slot->mState ),
+			SP_ProcSlot_t::eIdle, SP_ProcSlot_t::eBusy ) ) {
+		int idleCount = __sync_sub_and_fetch( &( mHeader->mIdleCount ), 1 );
+		if( idleCount == mHeader->mMinIdle - 1 ) notify();
+	}
+}
+
+void SP_ProcScoreboard :: setIdle( int index )
+{
+	SP_ProcSlot_t * slot = getSlot( index );
+	if( NULL == slot ) return;
+
+	slot->mLastActiveTime = time( NULL );
+
+	if( __sync_bool_compare_and_swap( &( slot->mState ),
+			SP_ProcSlot_t::eBusy, SP_ProcSlot_t::eIdle ) ) {
+		int idleCount = __sync_add_and_fetch( &( mHeader->mIdleCount ), 1 );
+		if( idleCount == mHeader->mMaxIdle + 1 ) notify();
+	}
+}
+
+void SP_ProcScoreboard :: setExit( int index )
+{
+	SP_ProcSlot_t * slot = getSlot( index );
+	if( NULL == slot ) return;
+
+	int state = __sync_lock_test_and_set( &( slot->mState ), SP_ProcSlot_t::eExit );
+	if( SP_ProcSlot_t::eIdle == state ) __sync_sub_and_fetch( &( mHeader->mIdleCount ), 1 );
+}
+
+void SP_ProcScoreboard :: getLockStats( SP_ProcLockStats_t * stats ) const
+{
+	* stats = mExitedLockStats;
+
+	for( int i = 0; i < mMaxSlots; i++ ) {
+		const SP_ProcSlot_t * slot = &( mSlots[ i ] );
+		if( SP_ProcSlot_t::eFree == slot->mState ) continue;
+
+		SP_ProcLock::addStats( stats, &( mStats[ i ].mLockStats ) );
+	}
+}
+
+void SP_ProcScoreboard :: dump() const
+{
+	syslog( LOG_INFO, "INFO: scoreboard idle.count %d, min.idle %d, max.idle %d",
+			mHeader->mIdleCount, mHeader->mMinIdle, mHeader->mMaxIdle );
+
+	for( int i = 0; i < mMaxSlots; i++ ) {
+		const SP_ProcSlot_t * slot = &( mSlots[ i ] );
+		if( SP_ProcSlot_t::eFree == slot->mState ) continue;
+
+		const SP_ProcSlotStats_t * stats = &( mStats[ i ] );
+
+		syslog( LOG_INFO, "INFO: slot %d, pid %d, state %d, requests %u, lastActiveTime %ld, "
+				"lock.acquires %u, lock.contended %u, lock.wait %llu us",
+				i, slot->mPid, slot->mState, slot->mRequests, (long)slot->mLastActiveTime,
+				stats->mLockStats.mAcquires, stats->mLockStats.mContended,
+				(unsigned long long)stats->mLockStats.mWaitUsec );
+
+		if( stats->mMemInfo.mCheckRequests > 0 ) SP_ProcMemUtils::dump( slot->mPid, &( stats->mMemInfo ) );
+	}
+}
+
@@ -0,0 +1,110 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spprocscoreboard_hpp__
+#define __spprocscoreboard_hpp__
+
+#include <sys/types.h>
+#include <time.h>
+
+#include "spproclock.hpp"
+#include "spprocmem.hpp"
+
+typedef struct tagSP_ProcSlot {
+	enum { eFree = 0, eIdle = 1, eBusy = 2, eExit = 3 };
+
+	volatile int mState;
+	volatile pid_t mPid;
+	volatile unsigned int mRequests;
+	volatile time_t mLastActiveTime;
+} __attribute__(( aligned( 64 ) )) SP_ProcSlot_t;
+
+// the counters of a worker, apart from the slot which the parent polls
+typedef struct tagSP_ProcSlotStats {
+	// see SP_ProcLock::setStatsEnabled
+	SP_ProcLockStats_t mLockStats;
+
+	// updated by the worker on every memory check, see SP_ProcMemLimit_t
+	SP_ProcMemInfo_t mMemInfo;
+} __attribute__(( aligned( 64 ) )) SP_ProcSlotStats_t;
+
+/**
+ * A scoreboard in shared memory, one cache line per worker process,
+ * and the stats of the workers in an array after the slots.
+ *
+ * Workers update their own slot with atomic operations, the parent is
+ * only woken up through an eventfd when the idle count drops below the
+ * min idle or goes above the max idle.
+ */
+class SP_ProcScoreboard {
+public:
+	SP_ProcScoreboard( int maxSlots );
+	~SP_ProcScoreboard();
+
+	// must be called before SP_ProcManager::start()
+	// 0 : OK, -1 : Fail
+	int init();
+
+	void setIdleRange( int minIdle, int maxIdle );
+
+	int getMaxSlots() const;
+
+	int getIdleCount() const;
+
+	// readable when the parent need to check the idle count
+	int getEventFd() const;
+
+	void clearEvent();
+
+	SP_ProcSlot_t * getSlot( int index ) const;
+
+	SP_ProcSlotStats_t * getStats( int index ) const;
+
+	// parent side, the new slot is idle
+	// >= 0 : slot index, -1 : no free slot
+	int alloc( pid_t pid );
+
+	void release( int index );
+
+	// worker side
+	void setBusy( int index );
+
+	void setIdle( int index );
+
+	void setExit( int index );
+
+	// parent side, the accept lock stats of all the workers,
+	// including the ones which have exited
+	void getLockStats( SP_ProcLockStats_t * stats ) const;
+
+	void dump() const;
+
+private:
+	typedef struct tagHeader {
+		volatile int mIdleCount;
+		int mMinIdle;
+		int mMaxIdle;
+	} __attribute__(( aligned( 64 ) )) Header_t;
+
+	int mMaxSlots;
+	int mEventFd;
+
+	Header_t * mHeader;
+	SP_ProcSlot_t * mSlots;
+	SP_ProcSlotStats_t * mStats;
+	size_t mMapSize;
+
+	// parent side, indexes of the free slots
+	int * mFreeList;
+	int mFreeCount;
+
+	// parent side, the stats of the released slots
+	SP_ProcLockStats_t mExitedLockStats;
+
+	void notify();
+};
+
+#endif
+
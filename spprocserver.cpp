@@ -8,17 +8,30 @@
 #include <syslog.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
 
 #include "spprocserver.hpp"
 
 #include "spprocpool.hpp"
 #include "spprocmanager.hpp"
 #include "spprocpdu.hpp"
+#include "spprocscoreboard.hpp"
+#include "spproclock.hpp"
+#include "spprocmem.hpp"
 
 SP_ProcInetService :: ~SP_ProcInetService()
 {
 }
 
+void SP_ProcInetService :: handleEx( int socketFd, const SP_ProcFdMeta_t * meta )
+{
+	handle( socketFd );
+}
+
 //-------------------------------------------------------------------
 
 SP_ProcInetServiceFactory :: ~SP_ProcInetServiceFactory()
@@ -51,6 +64,10 @@ SP_ProcBaseServer :: SP_ProcBaseServer( const char * bindIP, int port,
 	mArgs->mMinIdleProc = 1;
 
 	mMaxRequestsPerProc = 0;
+	mMemLimit = (SP_ProcMemLimit_t*)calloc( 1, sizeof( SP_ProcMemLimit_t ) );
+	mIdleTimeout = 0;
+	mIsZygote = 0;
+	mAcceptMode = eAcceptShared;
 
 	mIsStop = 1;
 }
@@ -59,6 +76,9 @@ SP_ProcBaseServer :: ~SP_ProcBaseServer()
 {
 	free( mArgs );
 	mArgs = NULL;
+
+	free( mMemLimit );
+	mMemLimit = NULL;
 }
 
 void SP_ProcBaseServer :: setArgs( const SP_ProcArgs_t * args )
@@ -80,6 +100,26 @@ void SP_ProcBaseServer :: setMaxRequestsPerProc( int maxRequestsPerProc )
 	mMaxRequestsPerProc = maxRequestsPerProc;
 }
 
+void SP_ProcBaseServer :: setMemLimit( const SP_ProcMemLimit_t * memLimit )
+{
+	* mMemLimit = * memLimit;
+}
+
+void SP_ProcBaseServer :: setIdleTimeout( int idleTimeout )
+{
+	mIdleTimeout = idleTimeout;
+}
+
+void SP_ProcBaseServer :: setZygote( int isZygote )
+{
+	mIsZygote = isZygote;
+}
+
+void SP_ProcBaseServer :: setAcceptMode( int acceptMode )
+{
+	mAcceptMode = acceptMode;
+}
+
 void SP_ProcBaseServer :: shutdown()
 {
 	mIsStop = 1;
@@ -90,3 +130,212 @@ int SP_ProcBaseServer :: isStop()
 	return mIsStop;
 }
 
+int SP_ProcBaseServer :: spawn( SP_ProcPool * procPool, SP_ProcScoreboard * scoreboard,
+		int epfd, SP_ProcInfoList * procList )
+{
+	SP_ProcInfo * info = procPool->get();
+	if( NULL == info ) return -1;
+
+	int slot = scoreboard->alloc( info->getPid() );
+
+	struct epoll_event event;
+	memset( &event, 0, sizeof( event ) );
+	event.events = EPOLLIN;
+	event.data.ptr = info;
+
+	// tell the worker which slot it owns
+	if( slot >= 0
+			&& (ssize_t)sizeof( slot ) == SP_ProcPduUtils::writen( info->getPipeFd(), &slot, sizeof( slot ) )
+			&& 0 == epoll_ctl( epfd, EPOLL_CTL_ADD, info->getPipeFd(), &event ) ) {
+		info->setSlot( slot );
+		procList->append( info );
+		return 0;
+	}
+
+	scoreboard->release( slot );
+	procPool->erase( info );
+
+	return -1;
+}
+
+int SP_ProcBaseServer :: supervise( SP_ProcPool * procPool, SP_ProcScoreboard * scoreboard, int podfd,
+		SP_ProcLock * lock )
+{
+	int epfd = epoll_create( 1024 );
+	assert( epfd >= 0 );
+
+	struct epoll_event event;
+	memset( &event, 0, sizeof( event ) );
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if( 0 != epoll_ctl( epfd, EPOLL_CTL_ADD, scoreboard->getEventFd(), &event ) ) {
+		syslog( LOG_WARNING, "WARN: epoll_ctl fail, errno %d, %s", errno, strerror( errno ) );
+	}
+
+	// the idle processes which have exited are removed at once
+	if( procPool->getExitFd() >= 0 ) {
+		event.data.ptr = procPool;
+		if( 0 != epoll_ctl( epfd, EPOLL_CTL_ADD, procPool->getExitFd(), &event ) ) {
+			syslog( LOG_WARNING, "WARN: watch exit fd fail, errno %d, %s", errno, strerror( errno ) );
+		} else {
+			procPool->setExitWatched( 1 );
+		}
+	}
+
+	SP_ProcInfoList procList;
+
+	// a slot without a worker would strand the connections of its socket
+	int minIdle = mArgs->mMinIdleProc, maxIdle = mArgs->mMaxIdleProc;
+	if( eAcceptReusePort == mAcceptMode ) minIdle = maxIdle = mArgs->mMaxProc;
+
+	// prespawn in batches, spawn() takes them from the pool
+	procPool->ensureIdleProc( minIdle );
+
+	for( int i = 0; i < minIdle; i++ ) {
+		if( 0 != spawn( procPool, scoreboard, epfd, &procList ) ) {
+			syslog( LOG_WARNING, "WARN: Create proc fail, only %d idle proc",
+					procList.getCount() );
+			break;
+		}
+	}
+
+	// pods have been sent, but the workers have not exited yet
+	int podCount = 0;
+
+	// the workers recover the accept lock by themselves, only report it here
+	int recoverCount = NULL != lock ? lock->getRecoverCount() : 0;
+
+	int isLockStats = NULL != lock && lock->isStatsEnabled();
+	time_t lastStatsTime = time( NULL );
+
+	static const int SP_PROC_MAX_EVENTS = 256;
+	struct epoll_event events[ SP_PROC_MAX_EVENTS ];
+
+	mIsStop = 0;
+
+	for( ; 0 == mIsStop; ) {
+		int nevents = epoll_wait( epfd, events, SP_PROC_MAX_EVENTS,
+				isLockStats ? LOCK_STATS_INTERVAL * 1000 : -1 );
+
+		if( isLockStats && time( NULL ) - lastStatsTime >= LOCK_STATS_INTERVAL ) {
+			logLockStats( scoreboard );
+			lastStatsTime = time( NULL );
+		}
+
+		for( int i = 0; i < nevents; i++ ) {
+			SP_ProcInfo * info = (SP_ProcInfo*)events[i].data.ptr;
+
+			if( NULL == info ) {
+				// the idle count is out of range
+				scoreboard->clearEvent();
+				continue;
+			}
+
+			if( (void*)procPool == (void*)info ) {
+				procPool->reapExited();
+				continue;
+			}
+
+			/* find out the child is exit */
+			int isProcExit = 0;
+
+			char buff[ 128 ] = { 0 };
+			int len = recv( info->getPipeFd(), buff, sizeof( buff ), MSG_DONTWAIT );
+			if( len > 0 ) {
+				if( SP_ProcInfo::CHAR_EXIT == buff[ len - 1 ] ) isProcExit = 1;
+			} else if( 0 == len || ( EAGAIN != errno && EINTR != errno ) ) {
+				isProcExit = 1;
+			}
+
+			if( isProcExit ) {
+				syslog( LOG_INFO, "INFO: proc #%u exit", info->getPid() );
+				if( podCount > 0 ) podCount--;
+
+				if( NULL != lock && (pid_t)info->getPid() == lock->getOwner() ) {
+					syslog( LOG_WARNING, "WARN: proc #%u exit with the accept lock held",
+							info->getPid() );
+				}
+
+				scoreboard->release( info->getSlot() );
+				epoll_ctl( epfd, EPOLL_CTL_DEL, info->getPipeFd(), NULL );
+				procList.takeItem( procList.findByPipeFd( info->getPipeFd() ) );
+				procPool->erase( info );
+			}
+		}
+
+		if( NULL != lock && recoverCount != lock->getRecoverCount() ) {
+			int count = lock->getRecoverCount();
+			syslog( LOG_WARNING, "WARN: accept lock recovered from exited owner, %d time(s), %d in total",
+					count - recoverCount, count );
+			recoverCount = count;
+		}
+
+		int idleCount = scoreboard->getIdleCount() - podCount;
+
+		if( idleCount > maxIdle ) {
+			int count = idleCount - maxIdle;
+			for( int i = 0; i < count; i++ ) {
+				assert( write( podfd, &SP_ProcInfo::CHAR_EXIT, 1 ) > 0 );
+			}
+			podCount += count;
+
+			syslog( LOG_INFO, "INFO: idle.count %d, max.idle %d, send %d pod(s)",
+					idleCount, maxIdle, count );
+		}
+
+		if( idleCount < minIdle && procList.getCount() < mArgs->mMaxProc ) {
+			int count = minIdle - idleCount;
+			int room = mArgs->mMaxProc - procList.getCount();
+			// ensureIdleProc takes the target, the pool may still hold some
+			procPool->ensureIdleProc( procPool->getIdleCount() + ( count > room ? room : count ) );
+		}
+
+		for( ; idleCount < minIdle && procList.getCount() < mArgs->mMaxProc; idleCount++ ) {
+			if( 0 != spawn( procPool, scoreboard, epfd, &procList ) ) {
+				syslog( LOG_WARNING, "WARN: Create proc fail, only %d idle proc", idleCount );
+				break;
+			}
+		}
+	}
+
+	if( isLockStats ) logLockStats( scoreboard );
+
+	procPool->setExitWatched( 0 );
+
+	close( epfd );
+
+	return 0;
+}
+
+int SP_ProcBaseServer :: listenReusePort( int * listenfds, int count )
+{
+	for( int i = 0; i < count; i++ ) {
+		listenfds[i] = -1;
+
+		if( 0 != SP_ProcPduUtils::tcp_listen( mBindIP, mPort, &( listenfds[i] ), 1 )
+				|| 0 != fcntl( listenfds[i], F_SETFL, fcntl( listenfds[i], F_GETFL ) | O_NONBLOCK ) ) {
+			syslog( LOG_WARNING, "WARN: listen reuseport #%d fail, errno %d, %s",
+					i, errno, strerror( errno ) );
+			for( int j = 0; j <= i; j++ ) {
+				if( listenfds[j] >= 0 ) close( listenfds[j] );
+			}
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void SP_ProcBaseServer :: logLockStats( SP_ProcScoreboard * scoreboard )
+{
+	SP_ProcLockStats_t stats;
+	scoreboard->getLockStats( &stats );
+
+	const volatile unsigned int * hist = stats.mWaitHist;
+
+	syslog( LOG_INFO, "INFO: accept lock acquires %u, contended %u, wait %llu us, "
+			"wait.hist <1us %u, <10us %u, <100us %u, <1ms %u, <10ms %u, <100ms %u, <1s %u, >=1s %u",
+			stats.mAcquires, stats.mContended, (unsigned long long)stats.mWaitUsec,
+			hist[0], hist[1], hist[2], hist[3], hist[4], hist[5], hist[6], hist[7] );
+}
+
@@ -7,12 +7,23 @@
 #define __spprocserver_hpp__
 
 class SP_ProcInfo;
+class SP_ProcInfoList;
+class SP_ProcPool;
+class SP_ProcScoreboard;
+class SP_ProcLock;
+
+typedef struct tagSP_ProcFdMeta SP_ProcFdMeta_t;
+typedef struct tagSP_ProcMemLimit SP_ProcMemLimit_t;
 
 class SP_ProcInetService {
 public:
 	virtual ~SP_ProcInetService();
 
 	virtual void handle( int socketFd ) = 0;
+
+	// called by SP_ProcInetServer with the record of the connection,
+	// the default calls handle( socketFd )
+	virtual void handleEx( int socketFd, const SP_ProcFdMeta_t * meta );
 };
 
 class SP_ProcInetServiceFactory {
@@ -34,6 +45,19 @@ typedef struct tagSP_ProcArgs {
 
 class SP_ProcBaseServer {
 public:
+	// how the workers of SP_ProcLFServer and SP_ProcMTServer accept
+	//   eAcceptShared : all the workers accept on one socket, under the accept lock
+	//   eAcceptReusePort : the server opens a SO_REUSEPORT socket per scoreboard
+	//       slot, the worker in a slot accepts on the socket of it, the kernel
+	//       spreads the connections and no lock is used. The sockets outlive
+	//       the workers, so nothing queued is lost when a worker is recycled.
+	//       Every socket gets a share of the connections, so the pool is kept
+	//       at MaxProc, MinIdleProc and MaxIdleProc are ignored
+	//   eAcceptExclusive : all the workers wait on one socket by their own
+	//       epoll with EPOLLEXCLUSIVE, the one woken up accepts until EAGAIN,
+	//       no lock is used
+	enum { eAcceptShared = 0, eAcceptReusePort = 1, eAcceptExclusive = 2 };
+
 	SP_ProcBaseServer( const char * bindIP, int port,
 			SP_ProcInetServiceFactory * factory );
 	virtual ~SP_ProcBaseServer();
@@ -44,6 +68,21 @@ public:
 
 	void setMaxRequestsPerProc( int maxRequestsPerProc );
 
+	// default is unlimited, the workers over the limit are recycled,
+	// SP_ProcInetServer checks them when they are saved into the pool,
+	// the workers of SP_ProcLFServer and SP_ProcMTServer check themselves
+	void setMemLimit( const SP_ProcMemLimit_t * memLimit );
+
+	// default is 0, never. The idle processes of SP_ProcInetServer unused
+	// for idleTimeout seconds are retired, down to MinIdleProc
+	void setIdleTimeout( int idleTimeout );
+
+	// default is 0, see SP_ProcManager::setZygote
+	void setZygote( int isZygote );
+
+	// default is eAcceptShared
+	void setAcceptMode( int acceptMode );
+
 	int isStop();
 
 	void shutdown();
@@ -52,6 +91,17 @@ public:
 
 protected:
 
+	// supervisor loop for the servers whose workers accept by themselves,
+	// keeps the idle process count between MinIdleProc and MaxIdleProc,
+	// and reports the workers which exit with the accept lock held,
+	// the lock stats are logged every LOCK_STATS_INTERVAL seconds if enabled
+	int supervise( SP_ProcPool * procPool, SP_ProcScoreboard * scoreboard, int podfd,
+			SP_ProcLock * lock = NULL );
+
+	// open count non-blocking SO_REUSEPORT sockets, one per scoreboard slot,
+	// 0 : OK, -1 : Fail, nothing is left open
+	int listenReusePort( int * listenfds, int count );
+
 	char mBindIP[ 64 ];
 	int mPort;
 
@@ -60,6 +110,19 @@ protected:
 	int mIsStop;
 	SP_ProcArgs_t * mArgs;
 	int mMaxRequestsPerProc;
+	SP_ProcMemLimit_t * mMemLimit;
+	int mIdleTimeout;
+	int mIsZygote;
+	int mAcceptMode;
+
+private:
+	enum { LOCK_STATS_INTERVAL = 60 };
+
+	void logLockStats( SP_ProcScoreboard * scoreboard );
+
+	// 0 : OK, -1 : Fail
+	int spawn( SP_ProcPool * procPool, SP_ProcScoreboard * scoreboard,
+			int epfd, SP_ProcInfoList * procList );
 };
 
 #endif
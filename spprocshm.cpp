@@ -0,0 +1,175 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <assert.h>
+
+#include "spprocshm.hpp"
+
+#include "spprocring.hpp"
+
+SP_ProcShmArena :: SP_ProcShmArena()
+{
+	mBase = NULL;
+	mSize = 0;
+	mUsed = 0;
+	mIsHugePage = 0;
+}
+
+SP_ProcShmArena :: ~SP_ProcShmArena()
+{
+	if( NULL != mBase ) munmap( mBase, mSize );
+	mBase = NULL;
+}
+
+int SP_ProcShmArena :: init( size_t size, int isHugePage )
+{
+	if( NULL != mBase ) return -1;
+
+	void * addr = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	if( isHugePage ) {
+		// 2MB, the default huge page size on x86_64 and aarch64
+		size_t hugeSize = 2 * 1024 * 1024;
+		mSize = ( size + hugeSize - 1 ) & ~( hugeSize - 1 );
+
+		addr = mmap( NULL, mSize, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+		if( MAP_FAILED == addr ) {
+			syslog( LOG_INFO, "INFO: mmap huge pages fail, errno %d, %s, use normal pages",
+					errno, strerror( errno ) );
+		} else {
+			mIsHugePage = 1;
+		}
+	}
+#endif
+
+	if( MAP_FAILED == addr ) {
+		size_t pageSize = sysconf( _SC_PAGESIZE );
+		mSize = ( size + pageSize - 1 ) & ~( pageSize - 1 );
+		if( mSize <= 0 ) mSize = pageSize;
+
+		addr = mmap( NULL, mSize, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+	}
+
+	if( MAP_FAILED == addr ) {
+		syslog( LOG_WARNING, "WARN: mmap arena fail, errno %d, %s", errno, strerror( errno ) );
+		mSize = 0;
+		return -1;
+	}
+
+	mBase = (char*)addr;
+	mUsed = 0;
+
+	return 0;
+}
+
+void * SP_ProcShmArena :: alloc( size_t size )
+{
+	if( NULL == mBase ) return NULL;
+
+	size_t need = ( size + ALIGN - 1 ) & ~( (size_t)ALIGN - 1 );
+	if( need <= 0 ) need = ALIGN;
+
+	if( need > mSize - mUsed ) {
+		syslog( LOG_WARNING, "WARN: arena is full, size %d, used %d, need %d",
+				(int)mSize, (int)mUsed, (int)need );
+		return NULL;
+	}
+
+	void * ret = mBase + mUsed;
+	mUsed += need;
+
+	// a fresh mapping is zero filled, but be explicit
+	memset( ret, 0, need );
+
+	return ret;
+}
+
+pthread_mutex_t * SP_ProcShmArena :: allocMutex( int isRobust )
+{
+	pthread_mutex_t * mutex = allocArray< pthread_mutex_t >( 1 );
+	if( NULL == mutex ) return NULL;
+
+	pthread_mutexattr_t mattr;
+	pthread_mutexattr_init( &mattr );
+	int ret = pthread_mutexattr_setpshared( &mattr, PTHREAD_PROCESS_SHARED );
+	if( 0 == ret && isRobust ) ret = pthread_mutexattr_setrobust( &mattr, PTHREAD_MUTEX_ROBUST );
+	if( 0 == ret ) ret = pthread_mutex_init( mutex, &mattr );
+	pthread_mutexattr_destroy( &mattr );
+
+	if( 0 != ret ) {
+		syslog( LOG_WARNING, "WARN: init shared mutex fail, errno %d, %s", ret, strerror( ret ) );
+		return NULL;
+	}
+
+	return mutex;
+}
+
+pthread_cond_t * SP_ProcShmArena :: allocCond()
+{
+	pthread_cond_t * cond = allocArray< pthread_cond_t >( 1 );
+	if( NULL == cond ) return NULL;
+
+	pthread_condattr_t cattr;
+	pthread_condattr_init( &cattr );
+	int ret = pthread_condattr_setpshared( &cattr, PTHREAD_PROCESS_SHARED );
+	if( 0 == ret ) ret = pthread_cond_init( cond, &cattr );
+	pthread_condattr_destroy( &cattr );
+
+	if( 0 != ret ) {
+		syslog( LOG_WARNING, "WARN: init shared cond fail, errno %d, %s", ret, strerror( ret ) );
+		return NULL;
+	}
+
+	return cond;
+}
+
+volatile long * SP_ProcShmArena :: allocCounters( int count )
+{
+	return allocArray< long >( count );
+}
+
+SP_ProcShmCounter_t * SP_ProcShmArena :: allocPaddedCounters( int count )
+{
+	return allocArray< SP_ProcShmCounter_t >( count );
+}
+
+int SP_ProcShmArena :: allocRing( SP_ProcRing * ring, unsigned int size )
+{
+	if( 0 == size || 0 != ( size & ( size - 1 ) ) ) return -1;
+
+	SP_ProcRingCtrl_t * ctrl = allocArray< SP_ProcRingCtrl_t >( 1 );
+	char * data = (char*)alloc( size );
+
+	if( NULL == ctrl || NULL == data ) return -1;
+
+	ring->init( ctrl, data, size );
+
+	return 0;
+}
+
+size_t SP_ProcShmArena :: getSize() const
+{
+	return mSize;
+}
+
+size_t SP_ProcShmArena :: getUsed() const
+{
+	return mUsed;
+}
+
+int SP_ProcShmArena :: isHugePage() const
+{
+	return mIsHugePage;
+}
+
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spprocshm_hpp__
+#define __spprocshm_hpp__
+
+#include <sys/types.h>
+#include <pthread.h>
+
+class SP_ProcRing;
+
+// a counter on its own cache line, index an array of them, not mValue
+typedef struct tagSP_ProcShmCounter {
+	volatile long mValue;
+	char mPad[ 64 - sizeof( long ) ];
+} SP_ProcShmCounter_t;
+
+/**
+ * One shared mapping for the process-shared state, created and filled
+ * before SP_ProcManager::start(), so every worker inherits it at the
+ * same address. Allocations are cache line aligned and zero filled,
+ * they are never freed one by one, the whole mapping goes away with
+ * the arena.
+ */
+class SP_ProcShmArena {
+public:
+	enum { ALIGN = 64 };
+
+	SP_ProcShmArena();
+	~SP_ProcShmArena();
+
+	// size is rounded up to pages, isHugePage : try MAP_HUGETLB first,
+	// fall back to normal pages if no huge page is available
+	// 0 : OK, -1 : Fail
+	int init( size_t size, int isHugePage = 0 );
+
+	// parent side, before the workers are forked
+	// NULL : no room
+	void * alloc( size_t size );
+
+	template< typename T >
+	T * allocArray( int count ) {
+		return (T*)alloc( sizeof( T ) * ( count > 0 ? count : 1 ) );
+	}
+
+	// process-shared, robust mutexes recover from an exited owner
+	// NULL : no room, or the init fails
+	pthread_mutex_t * allocMutex( int isRobust = 1 );
+
+	// NULL : no room, or the init fails
+	pthread_cond_t * allocCond();
+
+	// counters for the __sync_* builtins, packed together
+	volatile long * allocCounters( int count );
+
+	// the same, each on its own cache line
+	SP_ProcShmCounter_t * allocPaddedCounters( int count );
+
+	// size : bytes of the ring, power of 2
+	// 0 : OK, -1 : no room
+	int allocRing( SP_ProcRing * ring, unsigned int size );
+
+	size_t getSize() const;
+
+	size_t getUsed() const;
+
+	int isHugePage() const;
+
+private:
+	char * mBase;
+	size_t mSize;
+	size_t mUsed;
+	int mIsHugePage;
+};
+
+#endif
+
@@ -80,6 +80,33 @@ void sig_int(int signo)
 
 int main( int argc, char * argv[] )
 {
+	int port = 1770, procCount = 10;
+	int queueDepth = 1, acceptThreads = 1;
+
+	extern char *optarg ;
+	int c ;
+
+	while( ( c = getopt ( argc, argv, "p:c:q:t:v" )) != EOF ) {
+		switch ( c ) {
+			case 'p' :
+				port = atoi( optarg );
+				break;
+			case 'c':
+				procCount = atoi( optarg );
+				break;
+			case 'q':
+				queueDepth = atoi( optarg );
+				break;
+			case 't':
+				acceptThreads = atoi( optarg );
+				break;
+			case '?' :
+			case 'v' :
+				printf( "Usage: %s [-p <port>] [-c <proc count>] [-q <queue depth>] [-t <accept threads>]\n", argv[0] );
+				exit( 0 );
+		}
+	}
+
 #ifdef LOG_PERROR
 	openlog( "testinetserver", LOG_CONS | LOG_PID | LOG_PERROR, LOG_USER );
 #else
@@ -92,8 +119,6 @@ int main( int argc, char * argv[] )
 	printf( "chapter 30.9 TCP Preforked Server, Descriptor Passing\n" );
 	printf( "You can run the testinetclient to communicate with this server\n\n" );
 
-	int port = 1770, procCount = 10;
-
 	printf( "testinetserver listen on port [%d]\n", port );
 
 	signal( SIGINT, sig_int );
@@ -105,6 +130,10 @@ int main( int argc, char * argv[] )
 	server.setArgs( &args );
 	server.setMaxRequestsPerProc( 1000 );
 
+	// pass the next connections before a worker has finished the current one
+	server.setQueueDepth( queueDepth );
+	server.setAcceptThreads( acceptThreads );
+
 	server.start();
 
 	closelog();
@@ -21,6 +21,8 @@
 #include "spprocpdu.hpp"
 #include "spprocpool.hpp"
 #include "spproclock.hpp"
+#include "spprocshm.hpp"
+#include "spprocmem.hpp"
 
 #define MAXN    16384           /* max # bytes client can request */
 #define MAXLINE         4096    /* max text line length */
@@ -84,11 +86,14 @@ int main( int argc, char * argv[] )
 {
 	int port = 1770, procCount = 10;
 	char lockType = '0';
+	int isZygote = 0;
+	char acceptType = 's';
+	int maxPrivateDirty = 0;
 
 	extern char *optarg ;
 	int c ;
 
-	while( ( c = getopt ( argc, argv, "p:c:l:v" )) != EOF ) {
+	while( ( c = getopt ( argc, argv, "p:c:l:a:m:zv" )) != EOF ) {
 		switch ( c ) {
 			case 'p' :
 				port = atoi( optarg );
@@ -99,9 +104,18 @@ int main( int argc, char * argv[] )
 			case 'l':
 				lockType = *optarg;
 				break;
+			case 'a':
+				acceptType = *optarg;
+				break;
+			case 'm':
+				maxPrivateDirty = atoi( optarg );
+				break;
+			case 'z':
+				isZygote = 1;
+				break;
 			case '?' :
 			case 'v' :
-				printf( "Usage: %s [-p <port>] [-c <proc count>] [-l <f|t>]\n", argv[0] );
+				printf( "Usage: %s [-p <port>] [-c <proc count>] [-l <f|t|s>] [-a <s|r|e>] [-m <max private dirty KB>] [-z]\n", argv[0] );
 				exit( 0 );
 		}
 	}
@@ -129,18 +143,43 @@ int main( int argc, char * argv[] )
 	server.setArgs( &args );
 	server.setMaxRequestsPerProc( 1000 );
 
+	// recycle the workers which have copied too much of the parent
+	SP_ProcMemLimit_t memLimit;
+	memset( &memLimit, 0, sizeof( memLimit ) );
+	memLimit.mMaxPrivateDirty = maxPrivateDirty;
+	memLimit.mCheckInterval = 100;
+	server.setMemLimit( &memLimit );
+	server.setZygote( isZygote );
+
+	// shared by the locks which live in shared memory
+	SP_ProcShmArena arena;
+	assert( 0 == arena.init( 4096 ) );
+
 	SP_ProcLock * lock = NULL;
 	if( 'f' == lockType || 'F' == lockType ) {
 		lock = new SP_ProcFileLock();
 		assert( 0 == ((SP_ProcFileLock*)lock)->init( "/tmp/testlfserver.lck" ) );
 	} else if( 't' == lockType || 'T' == lockType ) {
-		lock = new SP_ProcThreadLock();
+		lock = new SP_ProcThreadLock( &arena );
+	} else if( 's' == lockType || 'S' == lockType ) {
+		SP_ProcThreadLock * threadLock = new SP_ProcThreadLock( &arena );
+		threadLock->setSpinCount( 100 );
+		lock = threadLock;
 	} else {
 		// no locking
 	}
 
+	// the supervisor logs the accept lock stats every minute
+	if( NULL != lock ) lock->setStatsEnabled( 1 );
+
 	server.setAcceptLock( lock );
 
+	if( 'r' == acceptType || 'R' == acceptType ) {
+		server.setAcceptMode( SP_ProcBaseServer::eAcceptReusePort );
+	} else if( 'e' == acceptType || 'E' == acceptType ) {
+		server.setAcceptMode( SP_ProcBaseServer::eAcceptExclusive );
+	}
+
 	server.start();
 
 	closelog();
@@ -86,11 +86,13 @@ int main( int argc, char * argv[] )
 {
 	int port = 1770, procCount = 10;
 	char lockType = '0';
+	int isZygote = 0;
+	char acceptType = 's';
 
 	extern char *optarg ;
 	int c ;
 
-	while( ( c = getopt ( argc, argv, "p:c:l:v" )) != EOF ) {
+	while( ( c = getopt ( argc, argv, "p:c:l:a:zv" )) != EOF ) {
 		switch ( c ) {
 			case 'p' :
 				port = atoi( optarg );
@@ -101,9 +103,15 @@ int main( int argc, char * argv[] )
 			case 'l':
 				lockType = *optarg;
 				break;
+			case 'a':
+				acceptType = *optarg;
+				break;
+			case 'z':
+				isZygote = 1;
+				break;
 			case '?' :
 			case 'v' :
-				printf( "Usage: %s [-p <port>] [-c <proc count>] [-l <f|t>]\n", argv[0] );
+				printf( "Usage: %s [-p <port>] [-c <proc count>] [-l <f|t|s>] [-a <s|r|e>] [-z]\n", argv[0] );
 				exit( 0 );
 		}
 	}
@@ -130,6 +138,7 @@ int main( int argc, char * argv[] )
 	server.setArgs( &args );
 	server.setThreadsPerProc( 10 );
 	server.setMaxRequestsPerProc( 1000 );
+	server.setZygote( isZygote );
 
 	SP_ProcLock * lock = NULL;
 	if( 'f' == lockType || 'F' == lockType ) {
@@ -137,12 +146,25 @@ int main( int argc, char * argv[] )
 		assert( 0 == ((SP_ProcFileLock*)lock)->init( "/tmp/testmtserver.lck" ) );
 	} else if( 't' == lockType || 'T' == lockType ) {
 		lock = new SP_ProcThreadLock();
+	} else if( 's' == lockType || 'S' == lockType ) {
+		SP_ProcThreadLock * threadLock = new SP_ProcThreadLock();
+		threadLock->setSpinCount( 100 );
+		lock = threadLock;
 	} else {
 		// no locking
 	}
 
+	// the supervisor logs the accept lock stats every minute
+	if( NULL != lock ) lock->setStatsEnabled( 1 );
+
 	server.setAcceptLock( lock );
 
+	if( 'r' == acceptType || 'R' == acceptType ) {
+		server.setAcceptMode( SP_ProcBaseServer::eAcceptReusePort );
+	} else if( 'e' == acceptType || 'E' == acceptType ) {
+		server.setAcceptMode( SP_ProcBaseServer::eAcceptExclusive );
+	}
+
 	server.start();
 
 	closelog();
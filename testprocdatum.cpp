@@ -13,6 +13,8 @@
 #include "spprocpdu.hpp"
 #include "spprocpool.hpp"
 
+static const size_t LARGE_SIZE = 256 * 1024;
+
 class SP_ProcEchoService : public SP_ProcDatumService {
 public:
 	SP_ProcEchoService(){}
@@ -20,6 +22,13 @@ public:
 	virtual ~SP_ProcEchoService(){}
 
 	virtual void handle( const SP_ProcDataBlock * request, SP_ProcDataBlock * reply ) {
+		// a large payload is echoed back through a shared block
+		if( request->getDataSize() >= LARGE_SIZE ) {
+			void * data = reply->allocShared( request->getDataSize() );
+			if( NULL != data ) memcpy( data, request->getData(), request->getDataSize() );
+			return;
+		}
+
 		char buff[ 512 ] = { 0 };
 		snprintf( buff, sizeof( buff ), "worker #%d - %s", (int)getpid(), (char*)request->getData() );
 		reply->setData( strdup( buff ), strlen( buff ) );
@@ -51,6 +60,212 @@ public:
 	}
 };
 
+// records the replies by the request ids
+class SP_ProcCountHandler : public SP_ProcDatumHandler {
+public:
+	enum { MAX_COUNT = 256 };
+
+	SP_ProcCountHandler() {
+		mReplies = mErrors = 0;
+		memset( mIds, 0, sizeof( mIds ) );
+	}
+
+	virtual ~SP_ProcCountHandler() {}
+
+	virtual void onReplyEx( pid_t pid, unsigned int id, const SP_ProcDataBlock * reply ) {
+		// "worker #pid - Ring index"
+		const char * pos = strstr( (char*)reply->getData(), "Ring " );
+		int index = -1;
+		if( NULL != pos ) index = atoi( pos + 5 );
+
+		if( index >= 0 && index < MAX_COUNT ) mIds[ index ] = id;
+
+		__sync_add_and_fetch( &mReplies, 1 );
+	}
+
+	virtual void onErrorEx( pid_t pid, unsigned int id ) {
+		__sync_add_and_fetch( &mErrors, 1 );
+	}
+
+	// @return 0 : all the requests are done in time
+	int wait( int count ) {
+		for( int i = 0; i < 1000 && mReplies + mErrors < count; i++ ) usleep( 10000 );
+		return mReplies + mErrors < count ? -1 : 0;
+	}
+
+	volatile int mReplies, mErrors;
+	unsigned int mIds[ MAX_COUNT ];
+};
+
+// dispatch again while all the workers are busy
+pid_t dispatchRetry( SP_ProcDatumDispatcher * dispatcher,
+		const void * request, size_t len, unsigned int * id )
+{
+	pid_t pid = -1;
+
+	for( int i = 0; i < 1000 && pid < 0; i++ ) {
+		pid = dispatcher->dispatch( request, len, id );
+		if( pid < 0 ) usleep( 1000 );
+	}
+
+	return pid;
+}
+
+// the requests and the replies go through the shared memory rings,
+// every reply comes back with the id of its request
+void testRing()
+{
+	SP_ProcCountHandler * handler = new SP_ProcCountHandler();
+
+	// the process manager signals the process group when it is deleted,
+	// so the dispatcher lives until exit
+	SP_ProcDatumDispatcher * dispatcher = new SP_ProcDatumDispatcher(
+			new SP_ProcEchoServiceFactory(), handler );
+	dispatcher->setMaxProc( 4 );
+	dispatcher->setQueueDepth( 4 );
+	dispatcher->setRingSize( 64 * 1024 );
+
+	int count = 200;
+	unsigned int ids[ SP_ProcCountHandler::MAX_COUNT ] = { 0 };
+
+	char buff[ 256 ] = { 0 };
+	for( int i = 0; i < count; i++ ) {
+		snprintf( buff, sizeof( buff ), "Ring %d", i );
+		assert( dispatchRetry( dispatcher, buff, strlen( buff ), &( ids[i] ) ) > 0 );
+	}
+
+	assert( 0 == handler->wait( count ) );
+	assert( 0 == handler->mErrors );
+
+	for( int i = 0; i < count; i++ ) assert( ids[i] == handler->mIds[i] );
+
+	printf( "ring: %d replies, %d errors\n", handler->mReplies, handler->mErrors );
+}
+
+// byte i of the large payload #index
+static char largeByte( int index, size_t i )
+{
+	return (char)( ( i * 7 + index ) & 0xFF );
+}
+
+class SP_ProcLargeHandler : public SP_ProcCountHandler {
+public:
+	SP_ProcLargeHandler() { mMatches = 0; }
+
+	virtual ~SP_ProcLargeHandler() {}
+
+	virtual void onReplyEx( pid_t pid, unsigned int id, const SP_ProcDataBlock * reply ) {
+		const char * data = (char*)reply->getData();
+
+		// the first byte tells which payload it is
+		int index = (unsigned char)data[0];
+
+		int isMatch = ( LARGE_SIZE == reply->getDataSize() && reply->getFd() >= 0 );
+		for( size_t i = 0; isMatch && i < LARGE_SIZE; i++ ) {
+			isMatch = ( largeByte( index, i ) == data[i] );
+		}
+
+		if( isMatch ) __sync_add_and_fetch( &mMatches, 1 );
+
+		__sync_add_and_fetch( &mReplies, 1 );
+	}
+
+	volatile int mMatches;
+};
+
+// the plain large requests are written to the socket, the shared blocks
+// built in place are passed through sealed memfds, so are the replies
+void testLarge()
+{
+	SP_ProcPduUtils::setLargeThreshold( 64 * 1024 );
+
+	SP_ProcLargeHandler * handler = new SP_ProcLargeHandler();
+
+	// lives until exit as the one of testRing
+	SP_ProcDatumDispatcher * dispatcher = new SP_ProcDatumDispatcher(
+			new SP_ProcEchoServiceFactory(), handler );
+	dispatcher->setMaxProc( 2 );
+
+	int count = 8;
+
+	char * buff = (char*)malloc( LARGE_SIZE );
+
+	for( int i = 0; i < count; i++ ) {
+		unsigned int id = 0;
+
+		if( 0 == ( i % 2 ) ) {
+			for( size_t j = 0; j < LARGE_SIZE; j++ ) buff[j] = largeByte( i, j );
+			assert( dispatchRetry( dispatcher, buff, LARGE_SIZE, &id ) > 0 );
+		} else {
+			SP_ProcDataBlock block;
+			char * data = (char*)block.allocShared( LARGE_SIZE );
+			assert( NULL != data );
+			for( size_t j = 0; j < LARGE_SIZE; j++ ) data[j] = largeByte( i, j );
+
+			pid_t pid = -1;
+			for( int k = 0; k < 1000 && pid < 0; k++ ) {
+				pid = dispatcher->dispatch( &block, &id );
+				if( pid < 0 ) usleep( 1000 );
+			}
+			assert( pid > 0 );
+		}
+	}
+
+	free( buff );
+
+	assert( 0 == handler->wait( count ) );
+	assert( 0 == handler->mErrors && count == handler->mMatches );
+
+	printf( "large: %d replies, %d matched\n", handler->mReplies, handler->mMatches );
+
+	SP_ProcPduUtils::setLargeThreshold( 0 );
+}
+
+// the idle workers are retired by the reply thread of the dispatcher
+void testIdleTimeout()
+{
+	SP_ProcCountHandler * handler = new SP_ProcCountHandler();
+
+	// lives until exit as the one of testRing
+	SP_ProcDatumDispatcher * dispatcher = new SP_ProcDatumDispatcher(
+			new SP_ProcEchoServiceFactory(), handler );
+	dispatcher->setMaxProc( 2 );
+	dispatcher->setIdleTimeout( 1 );
+
+	int count = 4;
+
+	char buff[ 256 ] = { 0 };
+	for( int i = 0; i < count; i++ ) {
+		snprintf( buff, sizeof( buff ), "Ring %d", i );
+		assert( dispatchRetry( dispatcher, buff, strlen( buff ), NULL ) > 0 );
+	}
+
+	assert( 0 == handler->wait( count ) && 0 == handler->mErrors );
+
+	SP_ProcPool * pool = dispatcher->getProcPool();
+	for( int i = 0; i < 500 && pool->getIdleCount() > 0; i++ ) usleep( 10000 );
+	assert( 0 == pool->getIdleCount() );
+
+	printf( "idle timeout: %d replies, all idle retired\n", handler->mReplies );
+}
+
+// small blocks are kept inline, bigger ones come from the buffer pool
+void testBlock()
+{
+	SP_ProcDataBlock block;
+
+	for( size_t size = 1; size <= 65536; size = size * 4 ) {
+		char * data = (char*)block.alloc( size );
+		assert( NULL != data && data == block.getData() && size == block.getDataSize() );
+		assert( '\0' == data[ size ] );
+
+		memset( data, 'x', size );
+		block.reset();
+	}
+
+	printf( "block: alloc ok\n" );
+}
+
 int main( int argc, char * argv[] )
 {
 #ifdef LOG_PERROR
@@ -79,6 +294,14 @@ int main( int argc, char * argv[] )
 
 	dispatcher.dump();
 
+	testBlock();
+
+	testRing();
+
+	testLarge();
+
+	testIdleTimeout();
+
 	closelog();
 
 	return 0;
@@ -10,9 +10,203 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <stdlib.h>
+#include <assert.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
 
 #include "spprocpdu.hpp"
 
+// a batch of pdus by send_pdus, a large one by the socket and then by a
+// sealed memfd, read back by SP_ProcPduReader
+void testReader()
+{
+	int pipeFd[ 2 ] = { -1, -1 };
+	assert( 0 == socketpair( AF_UNIX, SOCK_STREAM, 0, pipeFd ) );
+
+	static const int count = 32;
+	static const size_t largeSize = 128 * 1024;
+
+	pid_t pid = fork();
+	assert( pid >= 0 );
+
+	if( 0 == pid ) {
+		close( pipeFd[1] );
+
+		SP_ProcPdu_t pdus[ count ];
+		const void * datas[ count ];
+		char buffs[ count ][ 32 ];
+
+		for( int i = 0; i < count; i++ ) {
+			snprintf( buffs[i], sizeof( buffs[i] ), "pdu %d", i );
+
+			memset( &( pdus[i] ), 0, sizeof( pdus[i] ) );
+			pdus[i].mMagicNum = SP_ProcPdu_t::MAGIC_NUM;
+			pdus[i].mSeqNo = i;
+			pdus[i].mDataSize = strlen( buffs[i] );
+			datas[i] = buffs[i];
+		}
+
+		assert( SP_ProcPduUtils::send_pdus( pipeFd[0], pdus, datas, count ) > 0 );
+
+		SP_ProcDataBlock large;
+		char * data = (char*)large.allocShared( largeSize );
+		assert( NULL != data );
+		for( size_t i = 0; i < largeSize; i++ ) data[i] = (char)( i & 0xFF );
+
+		SP_ProcPdu_t pdu;
+		memset( &pdu, 0, sizeof( pdu ) );
+		pdu.mMagicNum = SP_ProcPdu_t::MAGIC_NUM;
+		pdu.mSeqNo = count;
+		pdu.mDataSize = largeSize;
+
+		// a plain write, then the same payload by the memfd
+		assert( SP_ProcPduUtils::send_pdu( pipeFd[0], &pdu, data ) > 0 );
+		assert( SP_ProcPduUtils::send_block( pipeFd[0], &pdu, &large ) > 0 );
+
+		_exit( 0 );
+	}
+
+	close( pipeFd[0] );
+
+	SP_ProcPduReader reader( pipeFd[1] );
+
+	for( int i = 0; i < count; i++ ) {
+		SP_ProcPdu_t pdu;
+		SP_ProcDataBlock block;
+		assert( reader.read_pdu( &pdu, &block ) > 0 );
+
+		char expected[ 32 ] = { 0 };
+		snprintf( expected, sizeof( expected ), "pdu %d", i );
+
+		assert( (unsigned int)i == pdu.mSeqNo );
+		assert( 0 == strcmp( expected, (char*)block.getData() ) );
+	}
+
+	for( int i = 0; i < 2; i++ ) {
+		SP_ProcPdu_t pdu;
+		SP_ProcDataBlock block;
+		assert( reader.read_pdu( &pdu, &block ) > 0 );
+		assert( SP_ProcPdu_t::eData == pdu.mType && largeSize == block.getDataSize() );
+		assert( 0 == i ? block.getFd() < 0 : block.getFd() >= 0 );
+
+		const char * data = (char*)block.getData();
+		for( size_t j = 0; j < largeSize; j++ ) assert( (char)( j & 0xFF ) == data[j] );
+	}
+
+	waitpid( pid, NULL, 0 );
+	close( pipeFd[1] );
+
+	printf( "reader: %d pdus, a large pdu and a memfd pdu\n", count );
+}
+
+// a non-blocking reader keeps a partial pdu until the rest arrives,
+// the payload is larger than its buffer
+void testNonBlockReader()
+{
+	int pipeFd[ 2 ] = { -1, -1 };
+	assert( 0 == socketpair( AF_UNIX, SOCK_STREAM, 0, pipeFd ) );
+
+	static const size_t dataSize = 64 * 1024;
+
+	char * data = (char*)malloc( dataSize );
+	for( size_t i = 0; i < dataSize; i++ ) data[i] = (char)( i & 0xFF );
+
+	SP_ProcPdu_t pdu;
+	memset( &pdu, 0, sizeof( pdu ) );
+	pdu.mMagicNum = SP_ProcPdu_t::MAGIC_NUM;
+	pdu.mSeqNo = 1;
+	pdu.mDataSize = dataSize;
+
+	SP_ProcPduReader reader( pipeFd[1], 1024, 1 );
+
+	SP_ProcPdu_t readPdu;
+	SP_ProcDataBlock block;
+
+	assert( SP_ProcPduReader::INCOMPLETE == reader.read_pdu( &readPdu, &block ) );
+
+	// the header and half of the payload
+	assert( (ssize_t)sizeof( pdu ) == write( pipeFd[0], &pdu, sizeof( pdu ) ) );
+	assert( (ssize_t)( dataSize / 2 ) == write( pipeFd[0], data, dataSize / 2 ) );
+	assert( SP_ProcPduReader::INCOMPLETE == reader.read_pdu( &readPdu, &block ) );
+
+	assert( (ssize_t)( dataSize / 2 ) == write( pipeFd[0], data + dataSize / 2, dataSize / 2 ) );
+	assert( reader.read_pdu( &readPdu, &block ) > 0 );
+	assert( 1 == readPdu.mSeqNo && dataSize == block.getDataSize() );
+	assert( 0 == memcmp( data, block.getData(), dataSize ) );
+
+	free( data );
+	close( pipeFd[0] );
+	close( pipeFd[1] );
+
+	printf( "non-blocking reader: a pdu in 3 reads\n" );
+}
+
+// a batch of connections with their records by send_fds
+void testFds()
+{
+	int pipeFd[ 2 ] = { -1, -1 };
+	assert( 0 == socketpair( AF_UNIX, SOCK_STREAM, 0, pipeFd ) );
+
+	static const int count = 3;
+
+	pid_t pid = fork();
+	assert( pid >= 0 );
+
+	if( 0 == pid ) {
+		close( pipeFd[1] );
+
+		int fds[ count ];
+		SP_ProcFdMeta_t metas[ count ];
+
+		for( int i = 0; i < count; i++ ) {
+			int connFd[ 2 ] = { -1, -1 };
+			assert( 0 == pipe( connFd ) );
+
+			char buff[ 32 ] = { 0 };
+			snprintf( buff, sizeof( buff ), "conn %d", i );
+			write( connFd[1], buff, strlen( buff ) );
+			close( connFd[1] );
+
+			fds[i] = connFd[0];
+
+			memset( &( metas[i] ), 0, sizeof( metas[i] ) );
+			metas[i].mPeerAddr.sin_port = htons( 1000 + i );
+			metas[i].mHeadLen = snprintf( metas[i].mHead, sizeof( metas[i].mHead ), "GET /%d", i );
+		}
+
+		assert( 0 == SP_ProcPduUtils::send_fds( pipeFd[0], fds, metas, count ) );
+
+		_exit( 0 );
+	}
+
+	close( pipeFd[0] );
+
+	int fds[ SP_ProcPduUtils::MAX_PASS_FDS ];
+	SP_ProcFdMeta_t metas[ SP_ProcPduUtils::MAX_PASS_FDS ];
+
+	assert( count == SP_ProcPduUtils::recv_fds( pipeFd[1], fds, metas, SP_ProcPduUtils::MAX_PASS_FDS ) );
+
+	for( int i = 0; i < count; i++ ) {
+		char expected[ 32 ] = { 0 }, buff[ 32 ] = { 0 };
+
+		snprintf( expected, sizeof( expected ), "conn %d", i );
+		read( fds[i], buff, sizeof( buff ) - 1 );
+		assert( 0 == strcmp( expected, buff ) );
+
+		snprintf( expected, sizeof( expected ), "GET /%d", i );
+		assert( 1000 + i == ntohs( metas[i].mPeerAddr.sin_port ) );
+		assert( (int)strlen( expected ) == metas[i].mHeadLen );
+		assert( 0 == memcmp( expected, metas[i].mHead, metas[i].mHeadLen ) );
+
+		close( fds[i] );
+	}
+
+	waitpid( pid, NULL, 0 );
+	close( pipeFd[1] );
+
+	printf( "fds: %d with records\n", count );
+}
+
 int main( int argc, char * argv[] )
 {
 	const char * text = "Hello, world!";
@@ -56,6 +250,10 @@ int main( int argc, char * argv[] )
 
 			close( fd );
 		}
+
+		testReader();
+		testNonBlockReader();
+		testFds();
 	}
 
 	return 0;
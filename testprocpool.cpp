@@ -6,8 +6,11 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <signal.h>
+#include <dirent.h>
 #include <pthread.h>
 #include <syslog.h>
+#include <assert.h>
 
 #include "spprocmanager.hpp"
 #include "spprocpool.hpp"
@@ -66,6 +69,226 @@ void * echoWorkerCaller( void * args )
 	return NULL;
 }
 
+static const int CACHE_ROUNDS = 200;
+
+static volatile int gCacheReplies = 0;
+
+void * cacheCaller( void * args )
+{
+	SP_ProcPool * procPool = (SP_ProcPool*)args;
+
+	for( int i = 0; i < CACHE_ROUNDS; i++ ) {
+		SP_ProcInfo * info = procPool->get();
+		assert( NULL != info );
+
+		char text[ 64 ] = { 0 }, expected[ 128 ] = { 0 }, buff[ 256 ] = { 0 };
+		snprintf( text, sizeof( text ), "round %d", i );
+		snprintf( expected, sizeof( expected ), "<%d> %s", (int)info->getPid(), text );
+
+		if( write( info->getPipeFd(), text, strlen( text ) ) > 0
+				&& read( info->getPipeFd(), buff, sizeof( buff ) - 1 ) > 0
+				&& 0 == strcmp( expected, buff ) ) {
+			__sync_add_and_fetch( &gCacheReplies, 1 );
+		}
+
+		procPool->save( info );
+	}
+
+	return NULL;
+}
+
+static SP_ProcPool * gCachePool = NULL;
+
+void * getCaller( void * args )
+{
+	* (SP_ProcInfo**)args = gCachePool->get();
+
+	return NULL;
+}
+
+// get/save from several threads with the thread cache, the processes
+// cached by a thread are given back to the pool when it exits
+void testThreadCache( SP_ProcPool * procPool )
+{
+	static const int MAX_CACHE_THREAD = 4;
+
+	procPool->setThreadCache( 4 );
+
+	gCachePool = procPool;
+
+	pthread_t threadArray[ MAX_CACHE_THREAD ];
+
+	for( int i = 0; i < MAX_CACHE_THREAD; i++ ) {
+		pthread_create( &( threadArray[i] ), NULL, cacheCaller, procPool );
+	}
+
+	for( int i = 0; i < MAX_CACHE_THREAD; i++ ) {
+		pthread_join( threadArray[i], NULL );
+	}
+
+	procPool->setThreadCache( 0 );
+
+	assert( MAX_CACHE_THREAD * CACHE_ROUNDS == gCacheReplies );
+
+	// a new process has served only this request
+	int idleCount = procPool->getIdleCount();
+
+	SP_ProcInfo * infos[ 256 ];
+	assert( idleCount <= (int)( sizeof( infos ) / sizeof( infos[0] ) ) );
+
+	for( int i = 0; i < idleCount; i++ ) {
+		infos[i] = procPool->get();
+		assert( NULL != infos[i] && infos[i]->getRequests() > 1 );
+	}
+
+	// the processes created by ensureIdleProc are never cached, so another
+	// thread takes one of them instead of forking
+	procPool->setThreadCache( 4 );
+
+	assert( 2 == procPool->ensureIdleProc( 2 ) );
+
+	pthread_t holder;
+	SP_ProcInfo * held = NULL;
+	pthread_create( &holder, NULL, getCaller, &held );
+	pthread_join( holder, NULL );
+
+	assert( NULL != held && 1 == procPool->getIdleCount() );
+
+	procPool->setThreadCache( 0 );
+
+	procPool->save( held );
+
+	for( int i = 0; i < idleCount; i++ ) procPool->save( infos[i] );
+
+	printf( "cache: %d replies, %d idle given back\n", gCacheReplies, idleCount );
+}
+
+// the pool is used directly, get() drops the idle process which has exited
+void testExitedIdle( SP_ProcPool * procPool )
+{
+	SP_ProcInfo * info = procPool->get();
+	assert( NULL != info );
+
+	pid_t pid = info->getPid();
+	procPool->save( info );
+
+	kill( pid, SIGKILL );
+
+	// the exit is reported by the pidfd, or by the exit pipe of the manager
+	for( int i = 0; i < 100 && 0 == kill( pid, 0 ); i++ ) usleep( 10000 );
+	usleep( 100000 );
+
+	info = procPool->get();
+	assert( NULL != info && pid != info->getPid() );
+	procPool->save( info );
+
+	printf( "exited: process #%d is not handed out\n", (int)pid );
+}
+
+static const int KILL_ROUNDS = 2000;
+
+static volatile int gKillStop = 0;
+static volatile pid_t gKillPids[ 64 ];
+
+void * killCaller( void * args )
+{
+	SP_ProcPool * procPool = (SP_ProcPool*)args;
+
+	for( int i = 0; 0 == gKillStop; i++ ) {
+		SP_ProcInfo * info = procPool->get();
+		assert( NULL != info );
+
+		pid_t pid = info->getPid();
+
+		usleep( 100 );
+
+		procPool->save( info );
+
+		// idle now, unless another thread has taken it again
+		gKillPids[ i % 64 ] = pid;
+	}
+
+	return NULL;
+}
+
+static int countFds()
+{
+	int count = 0;
+
+	DIR * dir = opendir( "/proc/self/fd" );
+	assert( NULL != dir );
+
+	for( struct dirent * entry = readdir( dir ); NULL != entry; entry = readdir( dir ) ) {
+		if( '.' != entry->d_name[0] ) count++;
+	}
+
+	closedir( dir );
+
+	return count;
+}
+
+// erase the idle processes, @return the fd count without them
+static int dropIdle( SP_ProcPool * procPool )
+{
+	for( int i = procPool->getIdleCount(); i > 0; i-- ) procPool->erase( procPool->get() );
+
+	return countFds();
+}
+
+// kill the processes while threads get and save them, the exited ones
+// are deleted with their fds as soon as the exits are reaped
+void testKillIdle( SP_ProcPool * procPool )
+{
+	static const int MAX_KILL_THREAD = 4;
+
+	int fdCount = dropIdle( procPool );
+
+	procPool->ensureIdleProc( 4 );
+	int procFds = ( countFds() - fdCount ) / 4;
+
+	pthread_t threadArray[ MAX_KILL_THREAD ];
+
+	for( int i = 0; i < MAX_KILL_THREAD; i++ ) {
+		pthread_create( &( threadArray[i] ), NULL, killCaller, procPool );
+	}
+
+	int kills = 0;
+	for( int i = 0; i < KILL_ROUNDS; i++ ) {
+		pid_t pid = gKillPids[ i % 64 ];
+		if( pid > 0 && 0 == kill( pid, SIGKILL ) ) kills++;
+		usleep( 200 );
+	}
+
+	gKillStop = 1;
+
+	for( int i = 0; i < MAX_KILL_THREAD; i++ ) {
+		pthread_join( threadArray[i], NULL );
+	}
+
+	// wait for the last exits to be reported
+	usleep( 200000 );
+	procPool->reapExited();
+
+	int idleCount = procPool->getIdleCount();
+
+	assert( fdCount + procFds * idleCount == countFds() );
+
+	// nothing pops the killed ones here, reapExited has to delete them
+	SP_ProcInfo * infos[ 2 ] = { procPool->get(), procPool->get() };
+	pid_t pids[ 2 ] = { infos[0]->getPid(), infos[1]->getPid() };
+
+	for( int i = 0; i < 2; i++ ) procPool->save( infos[i] );
+	for( int i = 0; i < 2; i++ ) kill( pids[i], SIGKILL );
+
+	usleep( 200000 );
+	procPool->reapExited();
+
+	assert( fdCount + procFds * procPool->getIdleCount() == countFds() );
+	assert( fdCount == dropIdle( procPool ) );
+
+	printf( "kill: %d kills, %d idle, fd count %d\n", kills, idleCount, fdCount );
+}
+
 int main( int argc, char * argv[] )
 {
 #ifdef LOG_PERROR
@@ -91,6 +314,12 @@ int main( int argc, char * argv[] )
 		pthread_join( threadArray[i], NULL );
 	}
 
+	testExitedIdle( procPool );
+
+	testKillIdle( procPool );
+
+	testThreadCache( procPool );
+
 	procPool->dump();
 
 	closelog();